@@ -16,207 +16,1071 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
-#include <cairo/cairo.h>
 #include <libconfig.h>
 #include <opencv/cv.h>
-#include <opencv/highgui.h>
 
 #include "asciimatic.h"
+#include "bitmatch.h"
+#include "classify.h"
+#include "descriptor.h"
+#include "edges.h"
+#include "fftmatch.h"
 #include "logging.h"
 #include "main.h"
+#include "matcher.h"
+#include "templates.h"
+#include "trace.h"
+#include "tree.h"
 #include "utils.h"
+#include "workpool.h"
 
-/* Clobal config stuff */
-extern config_t config;
+/* Which implementation scores cells against the templates. */
+enum matcher_kind {
+    MATCHER_OPENCV,     /* cvMatchTemplate per glyph; the reference */
+    MATCHER_ATLAS,      /* batched SIMD kernel over the glyph atlas */
+    MATCHER_BITSET,     /* XOR/popcount over bit-packed cells and glyphs */
+    MATCHER_DESCRIPTOR, /* stroke orientations, looked up in a nearest-glyph table */
+    MATCHER_TREE,       /* a decision tree trained with -L, falling back to atlas */
+    MATCHER_FFT,        /* spectral products of the cell and each glyph */
+    NUM_MATCHERS
+};
+static const char *matcher_names[NUM_MATCHERS] = {"opencv", "atlas", "bitset", "descriptor", "tree", "fft"};
 
-static int output_rows;
-static int output_cols;
+static char
+char_for_subimage(IplImage *image, IplImage **templates, IplImage *scratch, const char *charset) {
+    IplImage **t;
+    int i = 0, best_match;
+    double global_maxval = -1.0;
+
+    for (t = templates; *t != NULL; t++) {
+        double minval, maxval;
+        
+        cvMatchTemplate(image, *t, scratch, CV_TM_SQDIFF_NORMED);
+        cvPow(scratch, scratch, 3);
+        cvNormalize(scratch, scratch, 1, 0, CV_MINMAX, 0);
+
+        cvMinMaxLoc(scratch, &minval, &maxval, NULL, NULL, 0);
+
+        if (maxval > global_maxval) {
+            global_maxval = maxval;
+            best_match = i;
+        }
+        i++;
+    }
 
-static int num_threads;
+    return charset[best_match];
+}
 
-/* Edge detection stuff */
-IplImage *src;
+/* Per-worker scratch state.  Cells are read straight out of the shared edge
+ * image; only the OpenCV reference matcher needs its own bordered copy.
+ */
+struct cell_scratch {
+    IplImage *subimage;
+    IplImage *result;
+    struct match_scratch match;
+    struct fft_scratch fft;
+    uint64_t *cellbits;
+    float *sig;
+    int *cands;
+    float *features;
+    int fallbacks;      /* cells the tree wasn't sure enough of */
+};
 
-int first_thresh;
-int second_thresh;
-const char *valid_characters;
+/* Everything asciify() needs for one cell size.  It is built the first time
+ * that size is seen and kept, so matching a frame goes to the heap only when
+ * it needs a cell size that isn't cached.  A handful are kept so that batches
+ * mixing a few sizes reuse their template banks.
+ */
+struct frame_state {
+    struct asciimatic *ctx;
+    int char_width, char_height;
+    unsigned long last_used;
+    struct template_bank *bank;
+    struct glyph_atlas *atlas;
+    struct fft_bank *fft;
+    bool_t atlas_via_fft;   /* are cells big enough that the atlas matcher uses fft? */
+    struct bit_bank *bits;
+    struct descriptor_index *desc;
+    struct glyph_signatures *sigs;
+    char blank;         /* what an empty cell matches */
+    uint64_t blank_hash;
+    bool_t padded;      /* does any matcher in use want the bordered subimage? */
+    struct arena arena;
+    struct cell_scratch *scratch;
+};
 
-FILE *input_file;
-FILE *output_file;
+#define FRAME_CACHE_SIZE 8
 
-/* Given the supplied set of valid characters, generate the templates we'll be
- * matching against.
+/* One pipeline: its settings, its worker pool and every cache it keeps.
+ * Contexts share nothing, so separate ones can be used from separate threads;
+ * a single context is used by one thread at a time.
  */
-static IplImage**
-init_templates(int char_width, int char_height) {
-    IplImage **templates;
-    int num_chars = strlen(valid_characters);
+struct asciimatic {
+    char *charset;
+    char *font;
+    char *template_cache;   /* NULL to render templates every time */
+    int thresh1, thresh2;
 
-    templates = xmalloc(sizeof(IplImage*) * (1 + num_chars));
-    templates[num_chars] = NULL;
+    enum matcher_kind matcher;
+    /* If set, every cell is also run through a reference matcher and the rate
+     * at which the two agree is logged.
+     */
+    bool_t check_matcher;
+    int bitset_shift;
 
-    int square_side = MAX(char_width, char_height);
+    /* The classification front end: cells with at most empty_cell_pixels
+     * edge pixels skip matching and become the blank glyph, and if prune_keep
+     * is set, other cells are only matched against the prune_keep glyphs whose
+     * coarse signatures are most like theirs.
+     */
+    int empty_cell_pixels;
+    int prune_keep;
 
-    /* For each character, render each as a square image and then scale it to the
-     * (char_width x char_height) dimension.
+    /* The tree matcher's model.  Leaves it is less than tree_confidence sure
+     * of are handed to the atlas matcher instead.
      */
-    for (int i = 0; i < num_chars; i++) {
-        cairo_text_extents_t te;
-        char c = valid_characters[i];
-        char letter[2] = {c, '\0'};
+    struct tree_model *tree;
+    double tree_confidence;
 
-        cairo_surface_t *surface =
-            cairo_image_surface_create(CAIRO_FORMAT_ARGB32, char_width, char_height);
-        cairo_t *cr = cairo_create(surface);
+    /* Cells of at least fft_crossover pixels are matched through the FFT
+     * rather than the atlas; 0 never does.  Asking for it to be measured (< 0)
+     * does so in asciimatic_create(), not while converting.
+     */
+    int fft_crossover;
 
-        /* Render the text onto the image. */
-        cairo_set_source_rgb (cr, 0, 0, 0);
-        cairo_paint(cr);
+    /* Inputs are halved before edge detection for as long as every cell of
+     * the grid stays at least min_cell_width x min_cell_height pixels.  Both 0
+     * turns this off.
+     */
+    int min_cell_width, min_cell_height;
 
-        cairo_select_font_face(cr, "sans-serif", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
-        cairo_set_font_size(cr, (int)(char_height * (4.0/3))); // x px <-> (4/3)x pt
-        cairo_set_source_rgb(cr, 1.0, 1.0, 1.0);
-        cairo_text_extents (cr, letter, &te);
-        cairo_move_to(cr, (char_width / 2) - te.x_bearing - te.width / 2,
-                          (char_height / 2) - te.y_bearing - te.height / 2);
-        cairo_show_text(cr, letter);
-        cairo_surface_flush(surface);
+    /* Set once asciify_samples() has been called; frames then carry what the
+     * exact matcher needs.
+     */
+    bool_t labelling;
 
-        /* Copy the Cairo surface into an IplImage... */
-        IplImage *image = cvCreateImageHeader(cvSize(char_width, char_height), IPL_DEPTH_8U, 4);
-        char *data = xmalloc(char_width * char_height * sizeof(uint32_t));
-        memcpy(data, cairo_image_surface_get_data(surface), char_width * char_height * sizeof(uint32_t));
-        cvSetData(image, data, char_width * sizeof(uint32_t));
+    struct workpool *pool;
+    struct gradient gradient;
+    struct edge_sat sat;
+    struct frame_state frames[FRAME_CACHE_SIZE];
+    unsigned long frame_clock;
 
-        /* ...next, convert to grayscale. */
-        IplImage *grayscale_image = cvCreateImage(cvSize(char_width, char_height), IPL_DEPTH_8U, 1);
-        cvCvtColor(image, grayscale_image, CV_RGB2GRAY);
+    /* trace_now() after which asciimatic_convert() gives up; 0 for never.
+     * Rows not yet matched by then are skipped.
+     */
+    uint64_t deadline;
 
-        templates[i] = grayscale_image;
+    /* asciimatic_convert()'s buffers, grown as needed. */
+    IplImage *smoothed, *edges;
+    struct pyramid pyramid;
+    char *grid;
+    size_t grid_size;
+};
 
-        free(image->imageData);
-        cvReleaseImageHeader(&image);
-        cairo_surface_destroy(surface);
-        cairo_destroy(cr);
-    }
+static enum matcher_kind
+reference_matcher(const struct asciimatic *ctx) {
+    return ctx->matcher == MATCHER_ATLAS ? MATCHER_OPENCV : MATCHER_ATLAS;
+}
 
-    return templates;
+static bool_t
+matcher_in_use(const struct asciimatic *ctx, enum matcher_kind kind) {
+    return ctx->matcher == kind || (ctx->check_matcher && reference_matcher(ctx) == kind);
 }
 
-void
-free_templates(IplImage **templates) {
-    int i, num_chars;
+struct asciify_job {
+    const IplImage *edges;
+    struct frame_state *frame;
+    int cols;
+    char *grid;
+    struct cell_cache *cache;
+    bool_t dirty_only;  /* trust the cache for every cell not marked dirty */
+    const struct edge_sat *sat;     /* over edges, or NULL to count pixels */
 
-    num_chars = strlen(valid_characters);
-    for (i = 0; i < num_chars; i++) {
-        cvReleaseImage(&templates[i]);
-    }
-    free(templates);
+    int matched;        /* cells run through a matcher */
+    int pruned;         /* ... against only some of the glyphs */
+    int empty;          /* cells too empty to be worth matching */
+    int reused;         /* cells whose character came from the cache */
 
-    cvReleaseImage(&src);
+    int checked;        /* cells compared against the reference matcher */
+    int agreed;
+};
+
+/* The exact matcher: the atlas, or the FFT for cells big enough to pay. */
+static int
+exact_match(struct frame_state *f, struct cell_scratch *s, const unsigned char *cell, int step,
+            const int *cands, int ncands) {
+    if (f->atlas_via_fft) {
+        return fft_match(f->fft, &s->fft, cell, step, cands, ncands);
+    }
+    return atlas_match(f->atlas, &s->match, cell, step, cands, ncands);
 }
 
+/* Matches a cell against the ncands glyphs in cands, or all of them if cands
+ * is NULL.  The reference matcher always looks at every glyph, and so does the
+ * descriptor matcher, whose lookup costs the same whatever the candidates.
+ */
 static char
-char_for_subimage(IplImage *image, IplImage **templates, IplImage *scratch) {
-    IplImage **t;
-    int i = 0, best_match;
-    double global_maxval = -1.0;
+match_cell(struct frame_state *f, struct cell_scratch *s, enum matcher_kind kind,
+           const unsigned char *cell, int step, const int *cands, int ncands) {
+    const struct asciimatic *ctx = f->ctx;
+    const char *charset = ctx->charset;
+    int y;
 
-    for (t = templates; *t != NULL; t++) {
-        double minval, maxval;
-        
-        cvMatchTemplate(image, *t, scratch, CV_TM_SQDIFF_NORMED);
-        cvPow(scratch, scratch, 3);
-        cvNormalize(scratch, scratch, 1, 0, CV_MINMAX, 0);
+    switch (kind) {
+        case MATCHER_BITSET:
+            return charset[bitbank_match(f->bits, s->cellbits, cell, step, cands, ncands)];
+        case MATCHER_DESCRIPTOR:
+            return charset[descriptor_match(f->desc, cell, step)];
+        case MATCHER_TREE: {
+            float confidence;
 
-        cvMinMaxLoc(scratch, &minval, &maxval, NULL, NULL, 0);
+            tree_features(cell, step, f->char_width, f->char_height, s->features);
+            char c = tree_classify(ctx->tree, s->features, &confidence);
+            if (confidence >= ctx->tree_confidence) {
+                return c;
+            }
+            s->fallbacks++;
+            return charset[exact_match(f, s, cell, step, cands, ncands)];
+        }
+        case MATCHER_ATLAS:
+            return charset[exact_match(f, s, cell, step, cands, ncands)];
+        case MATCHER_FFT:
+            return charset[fft_match(f->fft, &s->fft, cell, step, cands, ncands)];
+        case MATCHER_OPENCV:
+        default:
+            /* The border was zeroed when the subimage was made; only the
+             * middle ever changes.
+             */
+            for (y = 0; y < f->char_height; y++) {
+                memcpy(s->subimage->imageData + (y + f->char_height / 2) * s->subimage->widthStep + f->char_width / 2,
+                       cell + y * step, f->char_width);
+            }
+            return char_for_subimage(s->subimage, f->bank->templates, s->result, charset);
+    }
+}
 
-        if (maxval > global_maxval) {
-            global_maxval = maxval;
-            best_match = i;
+/* A 64-bit hash of a cell's pixels, eight at a time.  This is one streaming
+ * pass over the cell, which is far cheaper than matching it.
+ */
+static uint64_t
+hash_cell(const unsigned char *cell, int step, int w, int h) {
+    uint64_t hash = 0x9e3779b97f4a7c15ULL;
+
+    for (int y = 0; y < h; y++) {
+        const unsigned char *p = cell + y * step;
+        int x = 0;
+
+        for (; x + 8 <= w; x += 8) {
+            uint64_t v;
+            memcpy(&v, p + x, sizeof(v));
+            hash = (hash ^ v) * 0xff51afd7ed558ccdULL;
+            hash ^= hash >> 32;
         }
-        i++;
+        for (; x < w; x++) {
+            hash = (hash ^ p[x]) * 0x100000001b3ULL;
+        }
+        hash = (hash ^ (uint64_t)y) * 0xc4ceb9fe1a85ec53ULL;
     }
+    return hash ^ (hash >> 29);
+}
 
-    return valid_characters[best_match];
+static void
+frame_release(struct frame_state *f) {
+    if (f->scratch != NULL) {
+        for (int i = 0; i < workpool_size(f->ctx->pool); i++) {
+            cvReleaseImage(&f->scratch[i].subimage);
+            cvReleaseImage(&f->scratch[i].result);
+        }
+    }
+    arena_free(&f->arena);
+    signatures_destroy(f->sigs);
+    atlas_destroy(f->atlas);
+    fft_bank_destroy(f->fft);
+    bitbank_destroy(f->bits);
+    descriptor_index_destroy(f->desc);
+    template_bank_free(f->bank);
+    memset(f, 0, sizeof(*f));
 }
 
-void
-asciify(IplImage *edges) {
-    int i, j;
-    int char_height = edges->height / output_rows;
-    int char_width = edges->width / output_cols;
-    IplImage *scratch;
+/* Whether cells this size are matched faster through the FFT than against the
+ * atlas.
+ */
+static bool_t
+fft_pays(const struct asciimatic *ctx, int char_width, int char_height) {
+    int area = char_width * char_height;
 
-    xlog(LOG_INFO, "Characters correspond to %dx%d pixel blocks\n", char_width, char_height);
+    return ctx->fft_crossover > 0 && area >= FFT_MIN_AREA && area >= ctx->fft_crossover;
+}
+
+static struct frame_state *
+frame_prepare(struct asciimatic *ctx, int char_width, int char_height) {
+    struct frame_state *f = &ctx->frames[0];
+    int nworkers = workpool_size(ctx->pool);
+    const char *charset = ctx->charset;
+    int i;
 
-    IplImage **templates = init_templates(char_width, char_height);
+    for (i = 0; i < FRAME_CACHE_SIZE; i++) {
+        struct frame_state *c = &ctx->frames[i];
+
+        if (c->bank != NULL && c->char_width == char_width && c->char_height == char_height) {
+            c->last_used = ++ctx->frame_clock;
+            return c;
+        }
+        if (c->last_used < f->last_used) {
+            f = c;
+        }
+    }
+    if (f->ctx != NULL) {
+        frame_release(f);
+    }
+
+    f->ctx = ctx;
+    f->char_width = char_width;
+    f->char_height = char_height;
+    f->last_used = ++ctx->frame_clock;
+    arena_init(&f->arena);
+
+    {
+        TRACE_SCOPE("templates");
+        f->bank = template_bank_get(ctx->template_cache, charset, ctx->font, char_width, char_height);
+    }
+    /* When checking the fft matcher, the atlas it is checked against stays
+     * the atlas whatever the cell size.
+     */
+    if (matcher_in_use(ctx, MATCHER_ATLAS) || matcher_in_use(ctx, MATCHER_TREE)) {
+        f->atlas_via_fft = ctx->matcher != MATCHER_FFT && fft_pays(ctx, char_width, char_height);
+        if (!f->atlas_via_fft) {
+            f->atlas = atlas_create(f->bank->templates, charset, char_width, char_height);
+            xlog(LOG_DEBUG, "Matching against the glyph atlas with the %s kernel", f->atlas->kernel);
+        }
+    }
+    if (matcher_in_use(ctx, MATCHER_FFT) || f->atlas_via_fft) {
+        TRACE_SCOPE("glyph spectra");
+        f->fft = fft_bank_create(f->bank->templates, charset, char_width, char_height);
+        xlog(LOG_DEBUG, "Matching %dx%d cells through the FFT", char_width, char_height);
+    }
+    if (matcher_in_use(ctx, MATCHER_BITSET)) {
+        f->bits = bitbank_create(f->bank->templates, charset, char_width, char_height, ctx->bitset_shift);
+        xlog(LOG_DEBUG, "Matching bit-packed cells with the %s kernel", f->bits->kernel);
+    }
+    if (matcher_in_use(ctx, MATCHER_DESCRIPTOR)) {
+        TRACE_SCOPE("descriptor index");
+        f->desc = descriptor_index_create(f->bank->templates, strlen(charset), char_width, char_height);
+    }
+    if (ctx->prune_keep > 0) {
+        f->sigs = signatures_create(f->bank->templates, strlen(charset), char_width, char_height);
+    }
+    f->padded = matcher_in_use(ctx, MATCHER_OPENCV) || ctx->labelling;
 
     /* subimage will be size [w*2,h*2] 
      * http://docs.opencv.org/modules/imgproc/doc/object_detection.html#matchtemplate */
-    scratch = cvCreateImage(cvSize(char_width + 1, char_height + 1), IPL_DEPTH_32F, 1);
+    f->scratch = arena_alloc(&f->arena, nworkers * sizeof(struct cell_scratch), sizeof(void *));
+    for (i = 0; i < nworkers; i++) {
+        struct cell_scratch *s = &f->scratch[i];
+
+        if (f->padded) {
+            s->subimage = cvCreateImage(cvSize(char_width * 2, char_height * 2), IPL_DEPTH_8U, 1);
+            s->result = cvCreateImage(cvSize(char_width + 1, char_height + 1), IPL_DEPTH_32F, 1);
+            cvSetZero(s->subimage);
+        }
+        if (f->atlas != NULL) {
+            match_scratch_init(&s->match, f->atlas, &f->arena);
+        }
+        if (f->fft != NULL) {
+            fft_scratch_init(&s->fft, f->fft, &f->arena);
+        }
+        if (f->bits != NULL) {
+            s->cellbits = bitbank_scratch(f->bits, &f->arena);
+        }
+        if (f->sigs != NULL) {
+            s->sig = arena_alloc(&f->arena, SIG_LEN * sizeof(float), sizeof(float));
+            s->cands = arena_alloc(&f->arena, f->sigs->count * sizeof(int), sizeof(int));
+        }
+        if (ctx->tree != NULL || ctx->labelling) {
+            s->features = arena_alloc(&f->arena, TREE_FEATURES * sizeof(float), sizeof(float));
+        }
+    }
+
+    /* Whatever the matcher makes of an empty cell is what the fast path
+     * hands out, so skipping empty cells never changes the output.
+     */
+    unsigned char *empty = arena_alloc(&f->arena, char_width * char_height, 1);
+    f->blank = match_cell(f, &f->scratch[0], ctx->matcher, empty, char_width, NULL, 0);
+    f->blank_hash = hash_cell(empty, char_width, char_width, char_height);
+
+    return f;
+}
+
+/* How many edge pixels a cell has, from the SAT if there is one. */
+static int
+cell_ink(const struct asciify_job *job, const unsigned char *cell, int step, int i, int j) {
+    struct frame_state *f = job->frame;
+    int n = 0;
+
+    if (job->sat != NULL) {
+        return sat_count(job->sat, i * f->char_width, j * f->char_height, f->char_width, f->char_height);
+    }
+    for (int y = 0; y < f->char_height; y++) {
+        for (int x = 0; x < f->char_width; x++) {
+            n += cell[y * step + x] != 0;
+        }
+    }
+    return n;
+}
+
+static void
+asciify_row(int j, int worker, void *arg) {
+    TRACE_SCOPE("match row");
+    struct asciify_job *job = arg;
+    struct frame_state *f = job->frame;
+    const struct asciimatic *ctx = f->ctx;
+    struct cell_scratch *s = &f->scratch[worker];
+    struct cell_cache *cache = job->cache;
+    char *line = job->grid + j * (job->cols + 1);
+    int step = job->edges->widthStep;
+    const unsigned char *row = (const unsigned char *)job->edges->imageData + j * f->char_height * step;
+    int i, agreed = 0, matched = 0, pruned = 0, empty = 0, reused = 0;
+
+    if (ctx->deadline != 0 && trace_now() > ctx->deadline) {
+        memset(line, f->blank, job->cols);
+        line[job->cols] = '\n';
+        return;
+    }
 
-    for (j = 0; j < output_rows; j++) {
-        for (i = 0; i < output_cols; i++) {
-            IplImage *subimage;
+    for (i = 0; i < job->cols; i++) {
+        const unsigned char *cell = row + i * f->char_width;
+        int idx = j * job->cols + i;
+        uint64_t hash = 0;
 
-            CvRect char_area = cvRect(i * char_width, j * char_height, char_width, char_height);
-            cvSetImageROI(edges, char_area);
+        if (cache != NULL) {
+            if (job->dirty_only && !cache->dirty[idx] && cache->chars[idx] != '\0') {
+                line[i] = cache->chars[idx];
+                reused++;
+                continue;
+            }
+            cache->dirty[idx] = 0;
+        }
 
-            subimage = cvCreateImage(cvSize(char_width * 2, char_height * 2), IPL_DEPTH_8U, 1);
-            cvCopyMakeBorder(edges, subimage, cvPoint(char_width / 2, char_height / 2), IPL_BORDER_CONSTANT, cvScalarAll(0));
+        int ink = cell_ink(job, cell, step, i, j);
+        if (ink <= ctx->empty_cell_pixels) {
+            line[i] = f->blank;
+            empty++;
+            if (cache != NULL) {
+                cache->hashes[idx] = ink == 0 ? f->blank_hash : hash_cell(cell, step, f->char_width, f->char_height);
+                cache->chars[idx] = f->blank;
+            }
+            continue;
+        }
 
-            fprintf(stderr, "%c", char_for_subimage(subimage, templates, scratch));
+        if (cache != NULL) {
+            hash = hash_cell(cell, step, f->char_width, f->char_height);
+            if (cache->chars[idx] != '\0' && cache->hashes[idx] == hash) {
+                line[i] = cache->chars[idx];
+                reused++;
+                continue;
+            }
+        }
 
-            cvReleaseImage(&subimage);
+        if (f->sigs != NULL) {
+            cell_signature(cell, step, f->char_width, f->char_height, 1, s->sig);
+            int n = prune_candidates(f->sigs, s->sig, ctx->prune_keep, s->cands);
+            line[i] = match_cell(f, s, ctx->matcher, cell, step, s->cands, n);
+            pruned++;
+        } else {
+            line[i] = match_cell(f, s, ctx->matcher, cell, step, NULL, 0);
+        }
+        matched++;
+        if (ctx->check_matcher) {
+            agreed += line[i] == match_cell(f, s, reference_matcher(ctx), cell, step, NULL, 0);
+        }
+        if (cache != NULL) {
+            cache->hashes[idx] = hash;
+            cache->chars[idx] = line[i];
         }
-        fprintf(stderr, "\n");
     }
+    line[job->cols] = '\n';
 
-    cvReleaseImage(&scratch);
-    free_templates(templates);
+    __sync_fetch_and_add(&job->matched, matched);
+    __sync_fetch_and_add(&job->pruned, pruned);
+    __sync_fetch_and_add(&job->empty, empty);
+    __sync_fetch_and_add(&job->reused, reused);
+    if (ctx->check_matcher) {
+        __sync_fetch_and_add(&job->checked, matched);
+        __sync_fetch_and_add(&job->agreed, agreed);
+    }
 }
 
-/* Performs Canny edge detection on an input image.  Caller is responsible for freeing the
- * allocated memory in the return value.
+void
+cell_cache_init(struct cell_cache *cache) {
+    memset(cache, 0, sizeof(*cache));
+}
+
+void
+cell_cache_free(struct cell_cache *cache) {
+    free(cache->hashes);
+    free(cache->chars);
+    free(cache->dirty);
+    cell_cache_init(cache);
+}
+
+/* Marks every cell overlapping the given pixel rectangle as needing to be
+ * matched again by asciify_grid_dirty().
+ */
+void
+cell_cache_touch(struct cell_cache *cache, CvRect r) {
+    if (cache->dirty == NULL) {
+        return;
+    }
+
+    int x0 = MAX(r.x / cache->char_width, 0);
+    int y0 = MAX(r.y / cache->char_height, 0);
+    int x1 = MIN((r.x + r.width - 1) / cache->char_width, cache->cols - 1);
+    int y1 = MIN((r.y + r.height - 1) / cache->char_height, cache->rows - 1);
+
+    for (int y = y0; y <= y1; y++) {
+        for (int x = x0; x <= x1; x++) {
+            cache->dirty[y * cache->cols + x] = 1;
+        }
+    }
+}
+
+/* Sizes the cache for a rows x cols grid, forgetting everything in it if the
+ * grid or the cell size has changed since the last frame.
+ */
+static void
+cell_cache_prepare(struct cell_cache *cache, int rows, int cols, int char_width, int char_height) {
+    if (cache->rows == rows && cache->cols == cols &&
+            cache->char_width == char_width && cache->char_height == char_height) {
+        return;
+    }
+    cell_cache_free(cache);
+    cache->rows = rows;
+    cache->cols = cols;
+    cache->char_width = char_width;
+    cache->char_height = char_height;
+    cache->hashes = xcalloc(rows * cols, sizeof(uint64_t));
+    cache->chars = xcalloc(rows * cols, sizeof(char));
+    cache->dirty = xcalloc(rows * cols, sizeof(char));
+}
+
+static void asciify_cells(struct asciimatic *ctx, const IplImage *edges, int rows, int cols, char *out,
+                          struct cell_cache *cache, bool_t dirty_only, bool_t sat_ready);
+
+/* Matches every cell of edges on ctx's worker pool, filling grid with rows
+ * lines of cols characters, each ending in a newline.
+ */
+void
+asciify_grid(struct asciimatic *ctx, const IplImage *edges, int rows, int cols, char *out) {
+    asciify_grid_cached(ctx, edges, rows, cols, out, NULL);
+}
+
+/* As asciify_grid(), but cells whose pixels hash the same as they did in the
+ * previous frame through this cache take their old character instead of being
+ * matched again.
+ */
+void
+asciify_grid_cached(struct asciimatic *ctx, const IplImage *edges, int rows, int cols, char *out,
+                    struct cell_cache *cache) {
+    asciify_cells(ctx, edges, rows, cols, out, cache, false, false);
+}
+
+/* As asciify_grid_cached(), but only cells marked with cell_cache_touch() since
+ * the last call are looked at; the rest are taken from the cache without even
+ * being hashed.  Only correct if nothing else in edges has changed.
+ */
+void
+asciify_grid_dirty(struct asciimatic *ctx, const IplImage *edges, int rows, int cols, char *out,
+                   struct cell_cache *cache) {
+    asciify_cells(ctx, edges, rows, cols, out, cache, true, false);
+}
+
+/* Matches the same edges at each of n grid sizes.  Every grid's cells are
+ * windows on the one edge map, so the summed-area table their edge counts come
+ * from is built once for all of them; a coarse grid whose cells are whole
+ * blocks of a finer grid's is counted from the same table as the fine one.
+ * Each cell size gets its own template bank, kept like any other.
+ */
+void
+asciify_grids(struct asciimatic *ctx, const IplImage *edges, struct grid_target *targets, int n) {
+    for (int k = 0; k < n; k++) {
+        asciify_cells(ctx, edges, targets[k].rows, targets[k].cols, targets[k].out, NULL, false, k > 0);
+    }
+}
+
+static void
+asciify_cells(struct asciimatic *ctx, const IplImage *edges, int rows, int cols, char *out,
+              struct cell_cache *cache, bool_t dirty_only, bool_t sat_ready) {
+    struct asciify_job job;
+    int char_height = edges->height / rows;
+    int char_width = edges->width / cols;
+
+    xlog(LOG_DEBUG, "Characters correspond to %dx%d pixel blocks", char_width, char_height);
+
+    memset(&job, 0, sizeof(job));
+    job.edges = edges;
+    job.frame = frame_prepare(ctx, char_width, char_height);
+    job.cols = cols;
+    job.grid = out;
+    if (cache != NULL) {
+        cell_cache_prepare(cache, rows, cols, char_width, char_height);
+        job.cache = cache;
+        job.dirty_only = dirty_only;
+    }
+
+    /* When only a few dirty cells will be looked at, counting their pixels
+     * directly beats summing the whole image.  sat_ready says the table is
+     * already over edges.
+     */
+    if (!job.dirty_only) {
+        if (!sat_ready) {
+            TRACE_SCOPE("sat");
+            sat_build(&ctx->sat, edges, ctx->pool);
+        }
+        job.sat = &ctx->sat;
+    }
+
+    unsigned long allocs = xalloc_count();
+    workpool_run(ctx->pool, rows, asciify_row, &job);
+    /* Only our own allocators are counted; cvMatchTemplate() allocates
+     * internally on every call, which this can't see.
+     */
+    if (matcher_in_use(ctx, MATCHER_OPENCV)) {
+        xlog(LOG_DEBUG, "%lu heap allocations while matching, not counting OpenCV's own",
+             xalloc_count() - allocs);
+    } else {
+        xlog(LOG_DEBUG, "%lu heap allocations while matching", xalloc_count() - allocs);
+    }
+    xlog(LOG_DEBUG, "%d cells empty, %d matched (%d against pruned candidates), %d reused",
+         job.empty, job.matched, job.pruned, job.reused);
+
+    if (ctx->tree != NULL) {
+        int fallbacks = 0;
+
+        for (int i = 0; i < workpool_size(ctx->pool); i++) {
+            fallbacks += job.frame->scratch[i].fallbacks;
+            job.frame->scratch[i].fallbacks = 0;
+        }
+        xlog(LOG_DEBUG, "%d of %d cells fell back from the tree to exact matching",
+             fallbacks, job.matched);
+    }
+
+    if (cache != NULL) {
+        cache->matched = job.matched;
+        cache->empty = job.empty;
+        cache->reused = job.reused;
+    }
+    trace_count(TRACE_CELLS_MATCHED, job.matched);
+    trace_count(TRACE_CELLS_PRUNED, job.pruned);
+    trace_count(TRACE_CELLS_EMPTY, job.empty);
+    trace_count(TRACE_CELLS_REUSED, job.reused);
+    trace_count(TRACE_ALLOCATIONS, xalloc_count() - allocs);
+
+    if (ctx->check_matcher) {
+        xlog(LOG_INFO, "%s matcher agreed with %s on %d of %d cells (%.2f%%)",
+             matcher_names[ctx->matcher], matcher_names[reference_matcher(ctx)],
+             job.agreed, job.checked, 100.0 * job.agreed / MAX(job.checked, 1));
+    }
+}
+
+struct sample_job {
+    const IplImage *edges;
+    struct frame_state *frame;
+    int cols;
+    float *features;    /* rows x cols x TREE_FEATURES */
+    char *labels;       /* '\0' for cells too empty to train on */
+};
+
+static void
+sample_row(int j, int worker, void *arg) {
+    struct sample_job *job = arg;
+    struct frame_state *f = job->frame;
+    struct cell_scratch *s = &f->scratch[worker];
+    int step = job->edges->widthStep;
+    const unsigned char *row = (const unsigned char *)job->edges->imageData + j * f->char_height * step;
+
+    for (int i = 0; i < job->cols; i++) {
+        const unsigned char *cell = row + i * f->char_width;
+        int idx = j * job->cols + i;
+        float *features = job->features + (size_t)idx * TREE_FEATURES;
+
+        tree_features(cell, step, f->char_width, f->char_height, features);
+        /* The same cells the matchers never see at run time. */
+        if (features[SIG_LEN] * f->char_width * f->char_height <= f->ctx->empty_cell_pixels) {
+            job->labels[idx] = '\0';
+            continue;
+        }
+        job->labels[idx] = match_cell(f, s, MATCHER_OPENCV, cell, step, NULL, 0);
+    }
+}
+
+/* Adds every non-empty cell of edges to samples, labelled with what the exact
+ * matcher (char_for_subimage()) makes of it, for training the tree matcher.
+ */
+void
+asciify_samples(struct asciimatic *ctx, const IplImage *edges, int rows, int cols,
+                struct tree_samples *samples) {
+    struct sample_job job;
+    int n = rows * cols;
+
+    ctx->labelling = true;
+    memset(&job, 0, sizeof(job));
+    job.edges = edges;
+    job.frame = frame_prepare(ctx, edges->width / cols, edges->height / rows);
+    job.cols = cols;
+    job.features = xmalloc((size_t)n * TREE_FEATURES * sizeof(float));
+    job.labels = xmalloc(n);
+
+    workpool_run(ctx->pool, rows, sample_row, &job);
+    for (int i = 0; i < n; i++) {
+        if (job.labels[i] != '\0') {
+            tree_samples_add(samples, job.features + (size_t)i * TREE_FEATURES, job.labels[i]);
+        }
+    }
+
+    free(job.features);
+    free(job.labels);
+}
+
+/* Draws grid into dst, one glyph template per cell, sizing cells to fit dst.
+ * Only cells that differ from shown are drawn, unless shown is NULL.
+ */
+void
+render_grid(struct asciimatic *ctx, IplImage *dst, const char *grid, const char *shown, int rows, int cols) {
+    int char_width = dst->width / cols, char_height = dst->height / rows;
+    IplImage **templates = frame_prepare(ctx, char_width, char_height)->bank->templates;
+    int i, j, y;
+
+    for (j = 0; j < rows; j++) {
+        for (i = 0; i < cols; i++) {
+            char c = grid[j * (cols + 1) + i];
+
+            if (shown != NULL && shown[j * (cols + 1) + i] == c) {
+                continue;
+            }
+
+            const char *g = strchr(ctx->charset, c);
+            const IplImage *t = templates[g != NULL ? g - ctx->charset : 0];
+            for (y = 0; y < char_height; y++) {
+                memcpy(dst->imageData + (j * char_height + y) * dst->widthStep + i * char_width,
+                       t->imageData + y * t->widthStep, char_width);
+            }
+        }
+    }
+}
+
+/* Performs Canny edge detection on an input image, keeping its gradients
+ * around for redetect_edges().  dst is reused if it is already the right size,
+ * and reallocated otherwise; either way, the caller owns the return value.
+ */
+IplImage *
+detect_edges(struct asciimatic *ctx, IplImage *dst, IplImage *src) {
+    TRACE_SCOPE("detect_edges");
+    gradient_compute(&ctx->gradient, src);
+    return gradient_threshold(&ctx->gradient, dst, ctx->thresh1, ctx->thresh2);
+}
+
+/* Re-runs only the hysteresis half of edge detection against the image last
+ * given to detect_edges(), for when just the thresholds have changed.
+ */
+IplImage *
+redetect_edges(struct asciimatic *ctx, IplImage *dst) {
+    TRACE_SCOPE("hysteresis");
+    return gradient_threshold(&ctx->gradient, dst, ctx->thresh1, ctx->thresh2);
+}
+
+/* How many times an image of the given size can be halved before the cells
+ * of a rows x cols grid would fall below the minimum cell size.
+ */
+static int
+downscale_levels(const struct asciimatic *ctx, int width, int height, int rows, int cols) {
+    int levels = 0;
+
+    if (ctx->min_cell_width <= 0 && ctx->min_cell_height <= 0) {
+        return 0;
+    }
+    while (levels < PYRAMID_MAX_LEVELS &&
+            (width + 1) / 2 / cols >= MAX(ctx->min_cell_width, 1) &&
+            (height + 1) / 2 / rows >= MAX(ctx->min_cell_height, 1)) {
+        width = (width + 1) / 2;
+        height = (height + 1) / 2;
+        levels++;
+    }
+    return levels;
+}
+
+/* Returns the smallest level of src's pyramid that still has big enough cells
+ * for a rows x cols grid, built in p; src itself if it can't be halved.  The
+ * level is only good until p is next used.
  */
 IplImage *
-detect_edges(IplImage *dst, IplImage *src) {
-    if (dst != NULL) {
-        cvReleaseImage(&dst);
+downscale_for_grid(const struct asciimatic *ctx, struct pyramid *p, IplImage *src, int rows, int cols) {
+    int levels = downscale_levels(ctx, src->width, src->height, rows, cols);
+
+    if (levels == 0) {
+        return src;
     }
-    dst = cvCreateImage(cvGetSize(src), 8, 1 );
 
-    cvCanny(src, dst, first_thresh, second_thresh, 3);
+    TRACE_SCOPE("downscale");
+    IplImage *dst = pyramid_down(p, src, levels);
+    xlog(LOG_DEBUG, "Downscaled %dx%d to %dx%d for %dx%d pixel cells",
+         src->width, src->height, dst->width, dst->height, dst->width / cols, dst->height / rows);
     return dst;
 }
 
+/* As downscale_for_grid(), but replaces *img, which the caller owns, with its
+ * downscaled copy.
+ */
 void
-init_asciimatic(const char *filename, int r, int c) {
-    if (!config_lookup_int(&config, "threshold1", &first_thresh)) {
-        panic(1, "Missing default threshold1 parameter in config file");
+downscale_image(const struct asciimatic *ctx, IplImage **img, int rows, int cols) {
+    struct pyramid p;
+    int levels = downscale_levels(ctx, (*img)->width, (*img)->height, rows, cols);
+
+    if (levels == 0) {
+        return;
+    }
+    memset(&p, 0, sizeof(p));
+    downscale_for_grid(ctx, &p, *img, rows, cols);
+    cvReleaseImage(img);
+    *img = p.levels[levels - 1];
+    p.levels[levels - 1] = NULL;
+    pyramid_free(&p);
+}
+
+void
+asciimatic_defaults(struct asciimatic_options *o) {
+    memset(o, 0, sizeof(*o));
+    o->font = "sans-serif";
+    o->matcher = "atlas";
+    o->threshold1 = 100;
+    o->threshold2 = 300;
+    o->bitset_shift = 1;
+    o->fft_crossover = -1;
+}
+
+/* Overrides o with whatever the configuration file sets.  Strings point into
+ * cfg, so it must outlive o.
+ */
+void
+asciimatic_options_from_config(const config_t *cfg, struct asciimatic_options *o) {
+    config_lookup_string(cfg, "valid_characters", &o->charset);
+    config_lookup_string(cfg, "font", &o->font);
+    config_lookup_string(cfg, "template_cache", &o->template_cache);
+    config_lookup_int(cfg, "threshold1", &o->threshold1);
+    config_lookup_int(cfg, "threshold2", &o->threshold2);
+    config_lookup_string(cfg, "matcher", &o->matcher);
+    config_lookup_int(cfg, "threads", &o->threads);
+    config_lookup_bool(cfg, "check_matcher", &o->check_matcher);
+    config_lookup_int(cfg, "bitset_shift", &o->bitset_shift);
+    config_lookup_int(cfg, "empty_cell_pixels", &o->empty_cell_pixels);
+    config_lookup_int(cfg, "prune_candidates", &o->prune_candidates);
+    config_lookup_int(cfg, "min_cell_width", &o->min_cell_width);
+    config_lookup_int(cfg, "min_cell_height", &o->min_cell_height);
+    config_lookup_string(cfg, "tree_model", &o->tree_model);
+    config_lookup_float(cfg, "tree_confidence", &o->tree_confidence);
+    config_lookup_int(cfg, "fft_crossover", &o->fft_crossover);
+}
+
+/* Where rendered templates are kept: dir if given ("" for nowhere), or else
+ * $XDG_CACHE_HOME/asciimatic, or ~/.cache/asciimatic.
+ */
+static char *
+template_cache_dir(const char *dir) {
+    char *path = NULL;
+
+    if (dir != NULL) {
+        return xstrdup(dir);
+    }
+    if (getenv("XDG_CACHE_HOME") != NULL) {
+        if (asprintf(&path, "%s/asciimatic", getenv("XDG_CACHE_HOME")) == -1) {
+            panic(1, "Can't allocate space for asprintf()");
+        }
+    } else if (getenv("HOME") != NULL) {
+        if (asprintf(&path, "%s/.cache/asciimatic", getenv("HOME")) == -1) {
+            panic(1, "Can't allocate space for asprintf()");
+        }
+    }
+    return path;
+}
+
+/* Sets up a pipeline with the given options and starts its worker pool.
+ * Returns NULL, having logged why, if the options don't make sense.
+ */
+struct asciimatic *
+asciimatic_create(const struct asciimatic_options *o) {
+    struct asciimatic *ctx;
+    const char *name = o->matcher != NULL ? o->matcher : "atlas";
+    int matcher, threads = o->threads;
+
+    if (o->charset == NULL || *o->charset == '\0') {
+        xlog(LOG_ERR, "No character set to match against (valid_characters)");
+        return NULL;
+    }
+    for (matcher = 0; matcher < NUM_MATCHERS; matcher++) {
+        if (strcmp(name, matcher_names[matcher]) == 0) {
+            break;
+        }
+    }
+    if (matcher == NUM_MATCHERS) {
+        xlog(LOG_ERR, "Unknown matcher \"%s\"", name);
+        return NULL;
+    }
+
+    ctx = xcalloc(1, sizeof(*ctx));
+    ctx->charset = xstrdup(o->charset);
+    ctx->font = xstrdup(o->font != NULL ? o->font : "sans-serif");
+    ctx->template_cache = template_cache_dir(o->template_cache);
+    ctx->thresh1 = o->threshold1;
+    ctx->thresh2 = o->threshold2;
+    ctx->matcher = matcher;
+    ctx->check_matcher = o->check_matcher != 0;
+    ctx->bitset_shift = o->bitset_shift >= 0 ? o->bitset_shift : 1;
+    ctx->empty_cell_pixels = MAX(o->empty_cell_pixels, 0);
+    ctx->prune_keep = MAX(o->prune_candidates, 0);
+    ctx->min_cell_width = MAX(o->min_cell_width, 0);
+    ctx->min_cell_height = MAX(o->min_cell_height, 0);
+    ctx->fft_crossover = o->fft_crossover;
+    gradient_init(&ctx->gradient);
+
+    if (matcher_in_use(ctx, MATCHER_TREE)) {
+        if (o->tree_model == NULL) {
+            xlog(LOG_ERR, "The tree matcher needs a model (tree_model)");
+            asciimatic_destroy(ctx);
+            return NULL;
+        }
+        ctx->tree = tree_load(o->tree_model);
+        if (ctx->tree == NULL) {
+            asciimatic_destroy(ctx);
+            return NULL;
+        }
+        ctx->tree_confidence = o->tree_confidence;
+
+        /* A leaf is output as is, so one outside the character set would put
+         * a character in the output that isn't in valid_characters.
+         */
+        bool_t foreign = ctx->tree->charset != NULL && strcmp(ctx->tree->charset, ctx->charset) != 0;
+        for (int i = 0; i < ctx->tree->nnodes && !foreign; i++) {
+            foreign = ctx->tree->nodes[i].feature < 0 && strchr(ctx->charset, ctx->tree->nodes[i].glyph) == NULL;
+        }
+        if (foreign) {
+            xlog(LOG_ERR, "%s was trained on a different character set; train it again with -L", o->tree_model);
+            asciimatic_destroy(ctx);
+            return NULL;
+        }
+        xlog(LOG_DEBUG, "Loaded a %d node decision tree from %s", ctx->tree->nnodes, o->tree_model);
     }
-    if (!config_lookup_int(&config, "threshold2", &second_thresh)) {
-        panic(1, "Missing default threshold2 parameter in config file");
+
+    /* Measured here, before any request is waiting on it. */
+    if (ctx->fft_crossover < 0) {
+        bool_t wanted = ctx->matcher != MATCHER_FFT &&
+                        (matcher_in_use(ctx, MATCHER_ATLAS) || matcher_in_use(ctx, MATCHER_TREE));
+        ctx->fft_crossover = wanted ? fft_crossover(ctx->template_cache, ctx->charset, ctx->font) : 0;
     }
-    if (!config_lookup_string(&config, "valid_characters", &valid_characters)) {
-        panic(1, "Missing valid character set in config file");
+
+    if (threads < 1) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
     }
+    ctx->pool = workpool_create(threads);
+
+    return ctx;
+}
 
-    src = cvLoadImage(filename, CV_LOAD_IMAGE_GRAYSCALE);
-    if (src == NULL) {
-        panic(1, "Can't load source image \"%s\"", filename);
+void
+asciimatic_destroy(struct asciimatic *ctx) {
+    if (ctx == NULL) {
+        return;
+    }
+    for (int i = 0; i < FRAME_CACHE_SIZE; i++) {
+        if (ctx->frames[i].ctx != NULL) {
+            frame_release(&ctx->frames[i]);
+        }
     }
-    cvSmooth(src, src, CV_GAUSSIAN, 3, 3, 0, 0);
-    output_rows = r;
-    output_cols = c;
+    workpool_destroy(ctx->pool);
+    gradient_free(&ctx->gradient);
+    sat_free(&ctx->sat);
+    pyramid_free(&ctx->pyramid);
+    tree_free(ctx->tree);
+    cvReleaseImage(&ctx->smoothed);
+    cvReleaseImage(&ctx->edges);
+    free(ctx->grid);
+    free(ctx->charset);
+    free(ctx->font);
+    free(ctx->template_cache);
+    free(ctx);
+}
+
+void
+asciimatic_set_thresholds(struct asciimatic *ctx, int threshold1, int threshold2) {
+    ctx->thresh1 = threshold1;
+    ctx->thresh2 = threshold2;
 }
 
+/* Gives every later asciimatic_convert() until ms milliseconds from now to
+ * finish; 0 for no limit.
+ */
 void
-shutdown_asciimatic(void) {
-    cvReleaseImage(&src);
+asciimatic_set_deadline(struct asciimatic *ctx, int ms) {
+    ctx->deadline = ms > 0 ? trace_now() + (uint64_t)ms * 1000000 : 0;
+}
+
+static bool_t
+past_deadline(const struct asciimatic *ctx) {
+    return ctx->deadline != 0 && trace_now() > ctx->deadline;
+}
+
+/* Converts a width x height 8-bit grayscale image whose rows are stride bytes
+ * apart into a rows x cols grid, handing each row to emit in order.  The
+ * pixels are only read.  Returns 0, or ASCIIMATIC_EINVAL if the image is too
+ * small for the grid, or ASCIIMATIC_ETIME if the deadline passed first; the
+ * deadline is checked between stages and before each row is matched.
+ */
+int
+asciimatic_convert(struct asciimatic *ctx, const unsigned char *pixels, int width, int height, int stride,
+                   int cols, int rows, asciimatic_row_fn emit, void *arg) {
+    IplImage header, *img;
+    struct trace_span span;
+    size_t len = (size_t)rows * (cols + 1);
+
+    if (cols < 1 || rows < 1 || width < cols || height < rows) {
+        return ASCIIMATIC_EINVAL;
+    }
+    if (past_deadline(ctx)) {
+        return ASCIIMATIC_ETIME;
+    }
+    cvInitImageHeader(&header, cvSize(width, height), IPL_DEPTH_8U, 1, IPL_ORIGIN_TL, 4);
+    cvSetData(&header, (void *)pixels, stride);
+    img = downscale_for_grid(ctx, &ctx->pyramid, &header, rows, cols);
+
+    if (ctx->smoothed == NULL || ctx->smoothed->width != img->width || ctx->smoothed->height != img->height) {
+        cvReleaseImage(&ctx->smoothed);
+        ctx->smoothed = cvCreateImage(cvGetSize(img), IPL_DEPTH_8U, 1);
+    }
+    span = trace_span_begin("smooth");
+    cvSmooth(img, ctx->smoothed, CV_GAUSSIAN, 3, 3, 0, 0);
+    trace_span_end(&span);
+
+    ctx->edges = detect_edges(ctx, ctx->edges, ctx->smoothed);
+    if (past_deadline(ctx)) {
+        return ASCIIMATIC_ETIME;
+    }
+
+    if (ctx->grid_size < len) {
+        ctx->grid = xrealloc(ctx->grid, len);
+        ctx->grid_size = len;
+    }
+    asciify_grid(ctx, ctx->edges, rows, cols, ctx->grid);
+    if (past_deadline(ctx)) {
+        return ASCIIMATIC_ETIME;
+    }
+
+    for (int j = 0; j < rows; j++) {
+        emit(arg, j, ctx->grid + (size_t)j * (cols + 1), cols);
+    }
+    return 0;
 }
@@ -1,11 +1,49 @@
 #ifndef _ASCIIMATIC_H_
 #define _ASCIIMATIC_H_
 
+#include <stdint.h>
+
 #include <opencv/cv.h>
 
-void init_asciimatic(const char *filename, int r, int c);
-void asciify(IplImage *edges);
-IplImage *detect_edges(IplImage *dst, IplImage *src);
-void shutdown_asciimatic(void);
+#include "edges.h"
+#include "libasciimatic.h"
+#include "tree.h"
+
+/* Remembers a hash and character for every cell of the last frame, so that
+ * cells which haven't changed needn't be matched again.
+ */
+struct cell_cache {
+    int rows, cols;
+    int char_width, char_height;
+    uint64_t *hashes;
+    char *chars;        /* '\0' where nothing is cached yet */
+    char *dirty;        /* cells touched since they were last matched */
+
+    int matched, empty, reused;  /* how the last frame's cells were resolved */
+};
+
+/* One of the grids asciify_grids() fills from a single edge map. */
+struct grid_target {
+    int rows, cols;
+    char *out;          /* rows lines of cols characters, each ending in a newline */
+};
+
+/* The pipeline in pieces, for the front ends that drive it themselves. */
+void asciify_grid(struct asciimatic *ctx, const IplImage *edges, int rows, int cols, char *grid);
+void asciify_grid_cached(struct asciimatic *ctx, const IplImage *edges, int rows, int cols, char *grid,
+                         struct cell_cache *cache);
+void asciify_grid_dirty(struct asciimatic *ctx, const IplImage *edges, int rows, int cols, char *grid,
+                        struct cell_cache *cache);
+void asciify_grids(struct asciimatic *ctx, const IplImage *edges, struct grid_target *targets, int n);
+void asciify_samples(struct asciimatic *ctx, const IplImage *edges, int rows, int cols,
+                     struct tree_samples *samples);
+void cell_cache_init(struct cell_cache *cache);
+void cell_cache_touch(struct cell_cache *cache, CvRect r);
+void cell_cache_free(struct cell_cache *cache);
+void render_grid(struct asciimatic *ctx, IplImage *dst, const char *grid, const char *shown, int rows, int cols);
+IplImage *downscale_for_grid(const struct asciimatic *ctx, struct pyramid *p, IplImage *src, int rows, int cols);
+void downscale_image(const struct asciimatic *ctx, IplImage **img, int rows, int cols);
+IplImage *detect_edges(struct asciimatic *ctx, IplImage *dst, IplImage *src);
+IplImage *redetect_edges(struct asciimatic *ctx, IplImage *dst);
 
 #endif
@@ -0,0 +1,942 @@
+/* batch.c
+ * Headless batch conversion of directories and manifests of images.
+ *
+ * Copyright (c) 2014 Nathan Taylor <nbtaylor@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <libconfig.h>
+#include <opencv/cv.h>
+#include <opencv/highgui.h>
+
+#include "asciimatic.h"
+#include "batch.h"
+#include "edges.h"
+#include "encoder.h"
+#include "logging.h"
+#include "main.h"
+#include "pipeline.h"
+#include "queue.h"
+#include "trace.h"
+#include "tree.h"
+#include "utils.h"
+
+extern config_t config;
+extern FILE *output_file;
+
+extern const char *grid_sizes;
+extern const char *threshold_sweep;
+extern const char *tree_output;
+extern enum output_format output_format;
+
+/* One image on its way through the pipeline, at one pair of thresholds and
+ * one or more grid sizes.  Items that fail at some stage are flagged and
+ * passed along rather than dropped, so that the output stage still sees every
+ * image in manifest order.
+ *
+ * Consecutive items with the same path share one decode and one gradient
+ * computation; only hysteresis is redone for each of them.  All of an item's
+ * grids are matched from its one edge map.  Whatever the stage cache already
+ * has of an item is read back instead: its grids, or else its edge map, or
+ * else its source downscaled and smoothed.
+ */
+struct batch_item {
+    char *path;
+    struct grid_target *grids;  /* out is NULL until matched */
+    unsigned char **colours;    /* per grid, per cell, if the output is coloured */
+    int ngrids;
+    int fit_cols, fit_rows;     /* the most any grid of this source needs */
+    int thresh1, thresh2;
+    bool_t shared;      /* same source as the previous item */
+    bool_t tagged;      /* same source as a neighbour; name outputs by threshold */
+    char *stem;         /* output names start with this, with -O */
+
+    uint64_t source_key;        /* of the source's bytes */
+    IplImage *src;
+    bool_t smoothed;            /* src came smoothed from the stage cache */
+    IplImage *edges;
+    bool_t failed;
+};
+
+struct batch {
+    struct batch_item **items;
+    int nitems;
+
+    int *sweep;         /* threshold pairs from -t, or NULL */
+    int nsweep;
+
+    struct grid_target *sizes;  /* grid sizes from -g, or NULL */
+    int nsizes;
+
+    struct queue *decoded;
+    struct queue *detected;
+    struct queue *matched;
+
+    const char *output_dir;
+    struct encoder out;         /* onto output_file */
+    int written;
+    int grids;                  /* ... and all the grids written for them */
+    int failed;
+};
+
+static const char *image_extensions[] = {
+    ".bmp", ".jpeg", ".jpg", ".pbm", ".pgm", ".png", ".ppm", ".tif", ".tiff", NULL
+};
+
+static bool_t
+is_image(const char *name) {
+    const char *ext = strrchr(name, '.');
+
+    if (ext == NULL) {
+        return false;
+    }
+    for (const char **e = image_extensions; *e != NULL; e++) {
+        if (strcasecmp(ext, *e) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Adds grids to the last item if it is the same image at the same
+ * thresholds, or else as a new item.  Takes ownership of path.
+ */
+static void
+push_item(struct batch *b, char *path, const struct grid_target *grids, int ngrids, int thresh1, int thresh2) {
+    struct batch_item *item = b->nitems > 0 ? b->items[b->nitems - 1] : NULL;
+
+    if (item != NULL && strcmp(item->path, path) == 0 &&
+            item->thresh1 == thresh1 && item->thresh2 == thresh2) {
+        free(path);
+    } else {
+        item = xcalloc(1, sizeof(*item));
+        item->path = path;
+        item->thresh1 = thresh1;
+        item->thresh2 = thresh2;
+
+        b->items = xrealloc(b->items, (b->nitems + 1) * sizeof(*b->items));
+        b->items[b->nitems++] = item;
+    }
+
+    item->grids = xrealloc(item->grids, (item->ngrids + ngrids) * sizeof(*item->grids));
+    memcpy(item->grids + item->ngrids, grids, ngrids * sizeof(*grids));
+    item->ngrids += ngrids;
+}
+
+/* Adds path once, or once per threshold pair if we are sweeping and the
+ * thresholds weren't given explicitly, at the given size or at every -g size
+ * if there are some and the size wasn't given explicitly.  Takes ownership of
+ * path.
+ */
+static void
+add_item(struct batch *b, char *path, int cols, int rows, int thresh1, int thresh2,
+         bool_t explicit_thresholds, bool_t explicit_size) {
+    struct grid_target one = { rows, cols, NULL };
+    const struct grid_target *grids = &one;
+    int ngrids = 1;
+
+    if (b->sizes != NULL && !explicit_size) {
+        grids = b->sizes;
+        ngrids = b->nsizes;
+    }
+    if (b->sweep == NULL || explicit_thresholds) {
+        push_item(b, path, grids, ngrids, thresh1, thresh2);
+        return;
+    }
+    for (int i = 0; i < b->nsweep; i++) {
+        push_item(b, i == 0 ? path : xstrdup(path), grids, ngrids, b->sweep[2 * i], b->sweep[2 * i + 1]);
+    }
+}
+
+/* Parses "t1:t2[,t1:t2...]". */
+static void
+parse_sweep(struct batch *b, const char *spec) {
+    const char *p = spec;
+
+    while (*p != '\0') {
+        int t1, t2, n;
+
+        if (sscanf(p, "%d:%d%n", &t1, &t2, &n) != 2 || (p[n] != ',' && p[n] != '\0')) {
+            panic(1, "Bad threshold sweep \"%s\": expected t1:t2[,t1:t2...]", spec);
+        }
+        b->sweep = xrealloc(b->sweep, (b->nsweep + 1) * 2 * sizeof(int));
+        b->sweep[2 * b->nsweep] = t1;
+        b->sweep[2 * b->nsweep + 1] = t2;
+        b->nsweep++;
+
+        p += n;
+        if (*p == ',') {
+            p++;
+        }
+    }
+}
+
+/* Parses "<cols>x<rows>[,<cols>x<rows>...]". */
+static void
+parse_sizes(struct batch *b, const char *spec) {
+    const char *p = spec;
+
+    while (*p != '\0') {
+        int cols, rows, n;
+
+        if (sscanf(p, "%dx%d%n", &cols, &rows, &n) != 2 || (p[n] != ',' && p[n] != '\0') ||
+                cols <= 0 || rows <= 0) {
+            panic(1, "Bad grid sizes \"%s\": expected <cols>x<rows>[,<cols>x<rows>...]", spec);
+        }
+        b->sizes = xrealloc(b->sizes, (b->nsizes + 1) * sizeof(*b->sizes));
+        b->sizes[b->nsizes++] = (struct grid_target){ rows, cols, NULL };
+
+        p += n;
+        if (*p == ',') {
+            p++;
+        }
+    }
+}
+
+/* Marks runs of items that can share a gradient, and sizes the source each
+ * run is decoded into for the biggest grid any of them wants.
+ */
+static void
+link_items(struct batch *b) {
+    struct batch_item *head = NULL;
+
+    for (int i = 0; i < b->nitems; i++) {
+        struct batch_item *item = b->items[i];
+
+        if (i > 0 && strcmp(item->path, b->items[i - 1]->path) == 0) {
+            item->shared = true;
+            item->tagged = true;
+            b->items[i - 1]->tagged = true;
+        } else {
+            head = item;
+        }
+        for (int k = 0; k < item->ngrids; k++) {
+            head->fit_cols = MAX(head->fit_cols, item->grids[k].cols);
+            head->fit_rows = MAX(head->fit_rows, item->grids[k].rows);
+        }
+    }
+    for (int i = 0; i < b->nitems; i++) {
+        if (b->items[i]->shared) {
+            b->items[i]->fit_cols = b->items[i - 1]->fit_cols;
+            b->items[i]->fit_rows = b->items[i - 1]->fit_rows;
+        }
+    }
+}
+
+static int
+cmp_paths(const void *a, const void *b) {
+    return strcmp(*(char **)a, *(char **)b);
+}
+
+static void
+read_directory(struct batch *b, const char *dir, int cols, int rows) {
+    struct dirent *de;
+    DIR *d;
+    char **paths = NULL;
+    int npaths = 0;
+
+    if ((d = opendir(dir)) == NULL) {
+        panic(1, "Can't open directory %s: %s", dir, strerror(errno));
+    }
+    while ((de = readdir(d)) != NULL) {
+        char *path;
+
+        if (!is_image(de->d_name)) {
+            continue;
+        }
+        if (asprintf(&path, "%s/%s", dir, de->d_name) == -1) {
+            panic(1, "Can't allocate space for asprintf()");
+        }
+        paths = xrealloc(paths, (npaths + 1) * sizeof(*paths));
+        paths[npaths++] = path;
+    }
+    closedir(d);
+
+    /* Sort before expanding any sweep, so that each image's pairs stay
+     * together and in order.
+     */
+    qsort(paths, npaths, sizeof(*paths), cmp_paths);
+    for (int i = 0; i < npaths; i++) {
+        add_item(b, paths[i], cols, rows, first_thresh, second_thresh, false, false);
+    }
+    free(paths);
+}
+
+/* A manifest has one image per line:
+ *
+ *     <path> [<columns> <rows> [<threshold1> <threshold2>]]
+ *
+ * Omitted fields take the values from the command line and config file, or
+ * from the -g sizes and the -t sweep.  Relative paths are relative to the
+ * manifest.  Listing the same image on consecutive lines only decodes it once,
+ * and only detects edges once for lines with the same thresholds.  Blank lines
+ * and lines starting with '#' are ignored.
+ */
+static void
+read_manifest(struct batch *b, const char *manifest, int cols, int rows) {
+    FILE *f = xfopen(manifest, "r");
+    char *line = NULL;
+    size_t len = 0;
+    int lineno = 0;
+
+    const char *slash = strrchr(manifest, '/');
+    int dirlen = slash != NULL ? (int)(slash - manifest) : 0;
+
+    while (xgetline(&line, &len, f) != -1) {
+        char name[4096];
+        int c = cols, r = rows, t1 = first_thresh, t2 = second_thresh;
+        char *path;
+
+        lineno++;
+        char *p = line + strspn(line, " \t");
+        if (*p == '#' || *p == '\n' || *p == '\0') {
+            continue;
+        }
+
+        int n = sscanf(p, "%4095s %d %d %d %d", name, &c, &r, &t1, &t2);
+        if (n == 2 || n == 4 || (n >= 3 && (c <= 0 || r <= 0))) {
+            panic(1, "%s:%d: expected <path> [<columns> <rows> [<threshold1> <threshold2>]]",
+                  manifest, lineno);
+        }
+
+        if (name[0] == '/' || slash == NULL) {
+            path = xstrdup(name);
+        } else if (asprintf(&path, "%.*s/%s", dirlen, manifest, name) == -1) {
+            panic(1, "Can't allocate space for asprintf()");
+        }
+        add_item(b, path, c, r, t1, t2, n == 5, n >= 3);
+    }
+
+    free(line);
+    fclose(f);
+}
+
+/* The item's keys in the stage cache, chained from its source's bytes. */
+static uint64_t
+item_edges_key(const struct batch_item *item) {
+    return edges_key(smooth_key(item->source_key, item->fit_rows, item->fit_cols),
+                     item->thresh1, item->thresh2);
+}
+
+static size_t
+grid_len(const struct grid_target *g) {
+    return (size_t)g->rows * (g->cols + 1);
+}
+
+/* Whether every grid of the item has its characters.  Never when training. */
+static bool_t
+grids_done(const struct batch_item *item) {
+    for (int k = 0; k < item->ngrids; k++) {
+        if (item->grids[k].out == NULL) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Reads back what the stage cache has of the item: its grids, or if any is
+ * missing, its edge map.  Returns whether that is all the item needs.
+ */
+static bool_t
+cached_item(struct batch_item *item) {
+    uint64_t edges = item_edges_key(item);
+
+    if (tree_output == NULL) {
+        for (int k = 0; k < item->ngrids; k++) {
+            struct grid_target *g = &item->grids[k];
+
+            g->out = xmalloc(grid_len(g));
+            if (!stage_cache_get(&stage_cache, "grid", grid_key(edges, g->rows, g->cols), g->out, grid_len(g))) {
+                free(g->out);
+                g->out = NULL;
+            }
+        }
+        if (grids_done(item)) {
+            return true;
+        }
+    }
+    item->edges = stage_cache_get_image(&stage_cache, "edges", edges);
+    return item->edges != NULL;
+}
+
+/* Keys the items from i on that share items[i]'s source, reads back what the
+ * stage cache has of them, and if any of them needs more, gets the source
+ * downscaled into items[i]->src: from the cache if it has it smoothed, or else
+ * by decoding it.
+ */
+static void
+decode_source(struct batch *b, int i, const struct input_file *in) {
+    struct batch_item *head = b->items[i];
+    bool_t needed = false;
+    int j;
+
+    for (j = i; j < b->nitems && (j == i || b->items[j]->shared); j++) {
+        b->items[j]->source_key = in->key;
+        needed |= !cached_item(b->items[j]);
+    }
+    if (!needed) {
+        return;
+    }
+
+    head->src = stage_cache_get_image(&stage_cache, "smooth", smooth_key(in->key, head->fit_rows, head->fit_cols));
+    if (head->src != NULL) {
+        head->smoothed = true;
+    } else if ((head->src = decode_input(in, CV_LOAD_IMAGE_GRAYSCALE)) != NULL) {
+        /* Shrinking here also shrinks what waits in the queues.  The
+         * biggest grid decides, so that every grid keeps big enough cells.
+         */
+        downscale_image(pipeline, &head->src, head->fit_rows, head->fit_cols);
+    } else {
+        xlog(LOG_WARNING, "Can't load source image \"%s\"", head->path);
+        while (--j >= i) {
+            b->items[j]->failed = b->items[j]->edges == NULL && !grids_done(b->items[j]);
+        }
+    }
+}
+
+/* Each grid gets the mean colours of its own cells, from the stage cache or
+ * else from the colour image, which is decoded the first time it is needed
+ * and kept in *colour for the items sharing it.
+ */
+static void
+colour_item(struct batch_item *item, const struct input_file *in, IplImage **colour, bool_t *tried) {
+    item->colours = xcalloc(item->ngrids, sizeof(*item->colours));
+    for (int k = 0; k < item->ngrids; k++) {
+        const struct grid_target *g = &item->grids[k];
+        uint64_t key = colours_key(in->key, g->rows, g->cols);
+        size_t len = (size_t)g->rows * g->cols * 3;
+
+        item->colours[k] = xmalloc(len);
+        if (stage_cache_get(&stage_cache, "colours", key, item->colours[k], len)) {
+            continue;
+        }
+        if (!*tried) {
+            *colour = decode_input(in, CV_LOAD_IMAGE_COLOR);
+            *tried = true;
+        }
+        if (*colour == NULL || (*colour)->width < item->fit_cols || (*colour)->height < item->fit_rows) {
+            for (k = 0; k < item->ngrids; k++) {
+                free(item->colours[k]);
+            }
+            free(item->colours);
+            item->colours = NULL;
+            return;
+        }
+        cell_colours(*colour, g->rows, g->cols, item->colours[k]);
+        stage_cache_put(&stage_cache, "colours", key, item->colours[k], len);
+    }
+}
+
+/* Stage 1: reading, decoding and downscaling, or reading back from the stage
+ * cache.  For coloured output, the colour image is only decoded for colours
+ * the cache doesn't have, and kept only until the items sharing it have
+ * theirs; only grayscale goes down the queues.
+ */
+static void *
+decode_main(void *p) {
+    struct batch *b = p;
+    struct input_file in;
+    IplImage *colour = NULL;
+    bool_t coloured = tree_output == NULL && output_format_coloured(output_format);
+    bool_t readable = false, tried = false;
+
+    memset(&in, 0, sizeof(in));
+    trace_thread_name("decode");
+    for (int i = 0; i < b->nitems; i++) {
+        struct batch_item *item = b->items[i];
+
+        if (!item->shared) {
+            cvReleaseImage(&colour);
+            tried = false;
+            if ((readable = read_input(&in, item->path))) {
+                decode_source(b, i, &in);
+            }
+        }
+        if (!readable) {
+            item->failed = true;
+        } else if (coloured && !item->failed) {
+            colour_item(item, &in, &colour, &tried);
+        }
+        queue_push(b->decoded, item);
+    }
+    cvReleaseImage(&colour);
+    free_input(&in);
+    queue_close(b->decoded);
+
+    return NULL;
+}
+
+/* Stage 2: smoothing and Canny, for items the stage cache couldn't finish.
+ * The gradient outlives its item so that the items sharing its source only
+ * need hysteresis.
+ */
+static void *
+detect_main(void *p) {
+    struct batch *b = p;
+    struct batch_item *item;
+    struct gradient gradient;
+    bool_t have_gradient = false;
+
+    gradient_init(&gradient);
+    trace_thread_name("detect");
+
+    while ((item = queue_pop(b->decoded)) != NULL) {
+        struct trace_span span;
+
+        if (!item->shared) {
+            have_gradient = false;
+        }
+        if (item->src != NULL) {
+            if (!item->smoothed) {
+                span = trace_span_begin("smooth");
+                cvSmooth(item->src, item->src, CV_GAUSSIAN, 3, 3, 0, 0);
+                trace_span_end(&span);
+                stage_cache_put_image(&stage_cache, "smooth",
+                                      smooth_key(item->source_key, item->fit_rows, item->fit_cols), item->src);
+            }
+
+            span = trace_span_begin("gradient");
+            gradient_compute(&gradient, item->src);
+            trace_span_end(&span);
+            cvReleaseImage(&item->src);
+            have_gradient = true;
+        }
+
+        if (!item->failed && item->edges == NULL && !grids_done(item)) {
+            if (have_gradient) {
+                span = trace_span_begin("hysteresis");
+                item->edges = gradient_threshold(&gradient, NULL, item->thresh1, item->thresh2);
+                trace_span_end(&span);
+                stage_cache_put_image(&stage_cache, "edges", item_edges_key(item), item->edges);
+            } else {
+                item->failed = true;
+            }
+        }
+        if (item->edges != NULL &&
+                (item->edges->width < item->fit_cols || item->edges->height < item->fit_rows)) {
+            xlog(LOG_WARNING, "\"%s\" is too small for a %dx%d grid",
+                 item->path, item->fit_cols, item->fit_rows);
+            cvReleaseImage(&item->edges);
+            item->failed = true;
+        }
+        queue_push(b->detected, item);
+    }
+    queue_close(b->detected);
+    gradient_free(&gradient);
+
+    return NULL;
+}
+
+/* Matches whichever of the item's grids the stage cache didn't have. */
+static void
+match_item(struct batch_item *item) {
+    struct grid_target *todo = xmalloc(item->ngrids * sizeof(*todo));
+    int n = 0;
+
+    for (int k = 0; k < item->ngrids; k++) {
+        if (item->grids[k].out == NULL) {
+            item->grids[k].out = xmalloc(grid_len(&item->grids[k]));
+            todo[n++] = item->grids[k];
+        }
+    }
+    if (n > 0) {
+        uint64_t edges = item_edges_key(item);
+
+        asciify_grids(pipeline, item->edges, todo, n);
+        for (int k = 0; k < n; k++) {
+            stage_cache_put(&stage_cache, "grid", grid_key(edges, todo[k].rows, todo[k].cols),
+                            todo[k].out, grid_len(&todo[k]));
+        }
+    }
+    free(todo);
+}
+
+/* The name, without the directory, of one of an item's outputs with -O.
+ * Outputs are told apart by threshold if the image was converted at several,
+ * and by size if at several sizes.
+ */
+static char *
+output_name(const struct batch_item *item, int k) {
+    const struct grid_target *g = &item->grids[k];
+    char thresholds[32] = "", size[32] = "";
+    char *name;
+
+    if (item->tagged) {
+        snprintf(thresholds, sizeof(thresholds), "-%d-%d", item->thresh1, item->thresh2);
+    }
+    if (item->ngrids > 1) {
+        snprintf(size, sizeof(size), "-%dx%d", g->cols, g->rows);
+    }
+    if (asprintf(&name, "%s%s%s%s", item->stem, thresholds, size, output_format_extension(output_format)) == -1) {
+        panic(1, "Can't allocate space for asprintf()");
+    }
+    return name;
+}
+
+struct output_ref {
+    char *name;
+    int item;
+};
+
+static int
+cmp_outputs(const void *a, const void *b) {
+    const struct output_ref *x = a, *y = b;
+    int c = strcmp(x->name, y->name);
+
+    return c != 0 ? c : x->item - y->item;
+}
+
+/* The image's file name without its directory or extension. */
+static char *
+base_stem(const struct batch_item *item) {
+    const char *base = strrchr(item->path, '/');
+    base = base != NULL ? base + 1 : item->path;
+    const char *ext = strrchr(base, '.');
+    char *stem = ext != NULL && ext != base ? strndup(base, ext - base) : strdup(base);
+
+    if (stem == NULL) {
+        panic(1, "Can't allocate space for the output name of %s", item->path);
+    }
+    return stem;
+}
+
+/* Stems outputs by the image's file name without its extension, unless that
+ * would have two images (a/x.png and b/x.png, or x.png and x.jpg, or one image
+ * listed twice apart) write the same file; then the later run of items gets
+ * ".<n>" added to its stem, until every output has a name of its own.
+ */
+static void
+name_outputs(struct batch *b) {
+    int nrefs = 0;
+
+    for (int i = 0; i < b->nitems; i++) {
+        struct batch_item *item = b->items[i];
+
+        item->stem = item->shared ? xstrdup(b->items[i - 1]->stem) : base_stem(item);
+        nrefs += item->ngrids;
+    }
+
+    struct output_ref *refs = xcalloc(MAX(nrefs, 1), sizeof(*refs));
+    for (int round = 2; ; round++) {
+        int n = 0, renamed = 0;
+
+        for (int i = 0; i < b->nitems; i++) {
+            for (int k = 0; k < b->items[i]->ngrids; k++) {
+                refs[n].name = output_name(b->items[i], k);
+                refs[n++].item = i;
+            }
+        }
+        qsort(refs, n, sizeof(*refs), cmp_outputs);
+
+        int last = -1;  /* the last run renamed, so that each is renamed once a round */
+        for (int j = 1; j < n; j++) {
+            int head = refs[j].item, other = refs[j - 1].item;
+
+            while (b->items[head]->shared) {
+                head--;
+            }
+            while (b->items[other]->shared) {
+                other--;
+            }
+            if (strcmp(refs[j].name, refs[j - 1].name) != 0 || head == other || head == last) {
+                continue;
+            }
+            char *base = base_stem(b->items[head]), *stem;
+
+            if (asprintf(&stem, "%s.%d", base, round) == -1) {
+                panic(1, "Can't allocate space for asprintf()");
+            }
+            free(base);
+            for (int i = head; i == head || (i < b->nitems && b->items[i]->shared); i++) {
+                free(b->items[i]->stem);
+                b->items[i]->stem = xstrdup(stem);
+            }
+            free(stem);
+            last = head;
+            renamed++;
+        }
+
+        for (int j = 0; j < n; j++) {
+            free(refs[j].name);
+        }
+        if (renamed == 0) {
+            break;
+        }
+    }
+    free(refs);
+
+    for (int i = 0; i < b->nitems; i++) {
+        char *base = base_stem(b->items[i]);
+
+        if (!b->items[i]->shared && strcmp(base, b->items[i]->stem) != 0) {
+            xlog(LOG_WARNING, "%s would overwrite another image's output in %s; naming it %s.*",
+                 b->items[i]->path, b->output_dir, b->items[i]->stem);
+        }
+        free(base);
+    }
+}
+
+/* Writes one of an item's grids.  Returns false if it couldn't be written. */
+static bool_t
+write_grid(struct batch *b, struct batch_item *item, int k) {
+    const struct grid_target *g = &item->grids[k];
+    const unsigned char *colours = item->colours != NULL ? item->colours[k] : NULL;
+    char thresholds[32] = "", size[32] = "";
+    bool_t ok;
+
+    if (b->output_dir == NULL) {
+        char *title;
+
+        if (item->tagged) {
+            snprintf(thresholds, sizeof(thresholds), " (%d, %d)", item->thresh1, item->thresh2);
+        }
+        if (item->ngrids > 1) {
+            snprintf(size, sizeof(size), " %dx%d", g->cols, g->rows);
+        }
+        if (asprintf(&title, "%s%s%s", item->path, thresholds, size) == -1) {
+            panic(1, "Can't allocate space for asprintf()");
+        }
+        encoder_title(&b->out, title);
+        encoder_grid(&b->out, g->out, colours, g->rows, g->cols);
+        free(title);
+        return true;
+    }
+
+    char *name = output_name(item, k), *path;
+    if (asprintf(&path, "%s/%s", b->output_dir, name) == -1) {
+        panic(1, "Can't allocate space for asprintf()");
+    }
+    free(name);
+
+    struct encoder e;
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        xlog(LOG_WARNING, "Can't write %s: %s", path, strerror(errno));
+        free(path);
+        return false;
+    }
+    encoder_init(&e, f, output_format);
+    encoder_begin(&e);
+    encoder_grid(&e, g->out, colours, g->rows, g->cols);
+    encoder_end(&e);
+    encoder_free(&e);
+    ok = !ferror(f);
+    if (fclose(f) != 0 || !ok) {
+        xlog(LOG_WARNING, "Can't write %s: %s", path, strerror(errno));
+        ok = false;
+    }
+    free(path);
+    return ok;
+}
+
+/* Stage 4: output. */
+static void *
+write_main(void *p) {
+    struct batch *b = p;
+    struct batch_item *item;
+
+    trace_thread_name("write");
+    if (b->output_dir == NULL) {
+        encoder_init(&b->out, output_file, output_format);
+        encoder_begin(&b->out);
+    }
+    while ((item = queue_pop(b->matched)) != NULL) {
+        /* Nothing to write when training. */
+        for (int k = 0; k < item->ngrids && !item->failed; k++) {
+            if (item->grids[k].out != NULL && !write_grid(b, item, k)) {
+                item->failed = true;
+            }
+        }
+        if (item->failed) {
+            b->failed++;
+        } else {
+            b->written++;
+            b->grids += item->ngrids;
+        }
+
+        for (int k = 0; k < item->ngrids; k++) {
+            free(item->grids[k].out);
+            free(item->colours != NULL ? item->colours[k] : NULL);
+        }
+        free(item->grids);
+        free(item->colours);
+        free(item->stem);
+        free(item->path);
+        free(item);
+    }
+    if (b->output_dir == NULL) {
+        encoder_end(&b->out);
+        encoder_free(&b->out);
+    }
+
+    return NULL;
+}
+
+static double
+now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Trains the tree matcher on samples and writes the model to tree_output. */
+static void
+train_tree(const struct tree_samples *samples) {
+    struct asciimatic_options o;
+    int depth, min_leaf, right = 0;
+
+    if (!config_lookup_int(&config, "tree_depth", &depth) || depth < 1) {
+        depth = 10;
+    }
+    if (!config_lookup_int(&config, "tree_min_leaf", &min_leaf) || min_leaf < 1) {
+        min_leaf = 4;
+    }
+
+    double start = now();
+    struct tree_model *m = tree_train(samples, depth, min_leaf);
+    asciimatic_defaults(&o);
+    asciimatic_options_from_config(&config, &o);
+    m->charset = xstrdup(o.charset);
+    for (int i = 0; i < samples->count; i++) {
+        float confidence;
+        right += tree_classify(m, samples->features + (size_t)i * TREE_FEATURES, &confidence) ==
+                 samples->labels[i];
+    }
+    xlog(LOG_INFO, "Trained a %d node tree on %d cells in %.3fs; it agrees with the exact matcher on %.2f%% of them",
+         m->nnodes, samples->count, now() - start, 100.0 * right / samples->count);
+
+    tree_save(m, tree_output);
+    tree_free(m);
+}
+
+/* Converts every image in input, which is either a directory or a manifest
+ * file, without the GUI.  Decoding, edge detection, matching and output run as
+ * overlapped stages joined by bounded queues; matching runs here, on the worker
+ * pool.  With a threshold sweep, each image is converted once per pair but
+ * decoded and differentiated only once; with several grid sizes, each pair's
+ * edge map is detected once and matched at every size.  With -L, cells are collected to train
+ * the tree matcher on instead of being converted.  Returns the number of images
+ * that failed.
+ */
+int
+run_batch(const char *input, const char *output_dir, int cols, int rows) {
+    struct batch b;
+    struct batch_item *item;
+    struct tree_samples samples;
+    pthread_t decoder, detector, writer;
+    struct stat st;
+    int depth;
+
+    memset(&b, 0, sizeof(b));
+    memset(&samples, 0, sizeof(samples));
+    b.output_dir = output_dir;
+    open_stage_cache();
+    if (threshold_sweep != NULL) {
+        parse_sweep(&b, threshold_sweep);
+    }
+    if (grid_sizes != NULL) {
+        parse_sizes(&b, grid_sizes);
+    }
+
+    if (stat(input, &st) == -1) {
+        panic(1, "Can't stat %s: %s", input, strerror(errno));
+    }
+    if (S_ISDIR(st.st_mode)) {
+        read_directory(&b, input, cols, rows);
+    } else {
+        read_manifest(&b, input, cols, rows);
+    }
+    link_items(&b);
+    if (output_dir != NULL && tree_output == NULL) {
+        name_outputs(&b);
+    }
+    if (output_dir != NULL && mkdir(output_dir, 0755) == -1 && errno != EEXIST) {
+        panic(1, "Can't create output directory %s: %s", output_dir, strerror(errno));
+    }
+
+    /* Each queue slot can hold a decoded image, so this bounds memory. */
+    if (!config_lookup_int(&config, "batch_queue_depth", &depth) || depth < 1) {
+        depth = 2;
+    }
+    b.decoded = queue_create(depth);
+    b.detected = queue_create(depth);
+    b.matched = queue_create(depth);
+
+    double start = now();
+    int nitems = b.nitems;
+
+    if (pthread_create(&decoder, NULL, decode_main, &b) != 0 ||
+            pthread_create(&detector, NULL, detect_main, &b) != 0 ||
+            pthread_create(&writer, NULL, write_main, &b) != 0) {
+        panic(1, "Can't start batch pipeline threads");
+    }
+
+    /* Stage 3: matching. */
+    while ((item = queue_pop(b.detected)) != NULL) {
+        if (!item->failed && tree_output != NULL) {
+            TRACE_SCOPE("label");
+            for (int k = 0; k < item->ngrids; k++) {
+                asciify_samples(pipeline, item->edges, item->grids[k].rows, item->grids[k].cols, &samples);
+            }
+        } else if (!item->failed) {
+            TRACE_SCOPE("match");
+            match_item(item);
+        }
+        cvReleaseImage(&item->edges);
+        queue_push(b.matched, item);
+    }
+    queue_close(b.matched);
+
+    pthread_join(decoder, NULL);
+    pthread_join(detector, NULL);
+    pthread_join(writer, NULL);
+
+    double elapsed = now() - start;
+    xlog(LOG_INFO, "%s %d of %d images in %.3fs (%.2f images/s)",
+         tree_output != NULL ? "Labelled" : "Converted",
+         b.written, nitems, elapsed, elapsed > 0 ? b.written / elapsed : 0.0);
+    if (b.grids > b.written) {
+        xlog(LOG_INFO, "%d grids from %d edge maps (%.2f grids/s)",
+             b.grids, b.written, elapsed > 0 ? b.grids / elapsed : 0.0);
+    }
+    if (tree_output != NULL) {
+        train_tree(&samples);
+        tree_samples_free(&samples);
+    }
+    if (b.failed > 0) {
+        xlog(LOG_WARNING, "%d images failed", b.failed);
+    }
+
+    queue_destroy(b.decoded);
+    queue_destroy(b.detected);
+    queue_destroy(b.matched);
+    free(b.items);
+    free(b.sweep);
+    free(b.sizes);
+
+    return b.failed;
+}
@@ -0,0 +1,6 @@
+#ifndef _BATCH_H_
+#define _BATCH_H_
+
+int run_batch(const char *input, const char *output_dir, int cols, int rows);
+
+#endif
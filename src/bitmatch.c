@@ -0,0 +1,338 @@
+/* bitmatch.c
+ * Binary template matching with XOR and popcount.
+ *
+ * Copyright (c) 2014 Nathan Taylor <nbtaylor@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <opencv/cv.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+#include "bitmatch.h"
+#include "kernels.h"
+#include "utils.h"
+
+/* Canny output is strictly 0 or 255, but the templates are anti-aliased; a
+ * template pixel counts as ink from half intensity up.
+ */
+#define INK_THRESHOLD 128
+
+#define WORD_BITS 64
+
+static inline void
+set_bit(uint64_t *row, int x) {
+    row[x / WORD_BITS] |= (uint64_t)1 << (x % WORD_BITS);
+}
+
+static void pick_fixed_kernel(struct bit_bank *bank);
+
+static uint64_t *
+glyph_rows(const struct bit_bank *bank, int g, int dx) {
+    int variants = 2 * bank->radius + 1;
+    size_t rows = (size_t)g * variants + (dx + bank->radius);
+
+    return bank->bits + rows * bank->height * bank->words;
+}
+
+struct bit_bank *
+bitbank_create(IplImage **templates, const char *charset, int w, int h, int radius) {
+    struct bit_bank *bank = xcalloc(1, sizeof(*bank));
+    int g, dx, x, y;
+
+    bank->charset = charset;
+    bank->count = strlen(charset);
+    bank->width = w;
+    bank->height = h;
+    bank->words = (w + WORD_BITS - 1) / WORD_BITS;
+    bank->radius = radius;
+    bank->bits = xcalloc((size_t)bank->count * (2 * radius + 1) * h * bank->words, sizeof(uint64_t));
+    bank->ones = xcalloc(bank->count, sizeof(int));
+
+    for (g = 0; g < bank->count; g++) {
+        const IplImage *t = templates[g];
+
+        for (y = 0; y < h; y++) {
+            const unsigned char *row = (const unsigned char *)t->imageData + y * t->widthStep;
+
+            for (x = 0; x < w; x++) {
+                if (row[x] < INK_THRESHOLD) {
+                    continue;
+                }
+                bank->ones[g]++;
+
+                /* Ink shifted past the edge of the cell can never overlap an
+                 * edge pixel; it still counts towards the glyph's total.
+                 */
+                for (dx = -radius; dx <= radius; dx++) {
+                    if (x + dx >= 0 && x + dx < w) {
+                        set_bit(glyph_rows(bank, g, dx) + y * bank->words, x + dx);
+                    }
+                }
+            }
+        }
+    }
+
+    pick_fixed_kernel(bank);
+    return bank;
+}
+
+void
+bitbank_destroy(struct bit_bank *bank) {
+    if (bank == NULL) {
+        return;
+    }
+    free(bank->bits);
+    free(bank->ones);
+    free(bank);
+}
+
+uint64_t *
+bitbank_scratch(const struct bit_bank *bank, struct arena *arena) {
+    return arena_alloc(arena, (size_t)bank->height * bank->words * sizeof(uint64_t), sizeof(uint64_t));
+}
+
+/* Packs the w x h cell into h rows of nw words, a bit per non-zero pixel. */
+typedef void (*pack_fn)(uint64_t *cellbits, const unsigned char *cell, int step, int w, int h, int nw);
+
+static void
+pack_generic(uint64_t *cellbits, const unsigned char *cell, int step, int w, int h, int nw) {
+    memset(cellbits, 0, (size_t)h * nw * sizeof(uint64_t));
+    for (int y = 0; y < h; y++) {
+        const unsigned char *row = cell + y * step;
+        uint64_t *dst = cellbits + y * nw;
+
+        for (int x = 0; x < w; x++) {
+            if (row[x]) {
+                set_bit(dst, x);
+            }
+        }
+    }
+}
+
+/* Everything outside the cell is background, so the Hamming distance between
+ * the cell and a shifted glyph is |C| + |T| - 2|C & T|; only the overlap has to
+ * be counted.  Returns the glyph among cands (or all of them, if cands is NULL)
+ * with the smallest distance over all shifts, the earliest on ties.
+ *
+ * The fixed-size kernels pass constant w, h and nw (of one word), so that the
+ * packing, counting and overlap loops unroll.
+ */
+static inline __attribute__((always_inline)) int
+match_body(const struct bit_bank *bank, uint64_t *cellbits, const unsigned char *cell, int step,
+           const int *cands, int ncands, const int w, const int h, const int nw, pack_fn pack) {
+    int r = bank->radius;
+    int c, g, dx, dy, y, k;
+    int cell_ones = 0;
+    int best_dist = INT_MAX, best_match = 0;
+
+    pack(cellbits, cell, step, w, h, nw);
+    for (k = 0; k < h * nw; k++) {
+        cell_ones += __builtin_popcountll(cellbits[k]);
+    }
+
+    if (cands == NULL) {
+        ncands = bank->count;
+    }
+    for (c = 0; c < ncands; c++) {
+        int overlap = 0;
+
+        g = cands != NULL ? cands[c] : c;
+
+        for (dx = -r; dx <= r; dx++) {
+            const uint64_t *t = glyph_rows(bank, g, dx);
+
+            for (dy = -r; dy <= r; dy++) {
+                int and = 0;
+                int y0 = MAX(0, dy), y1 = MIN(h, h + dy);
+
+                for (y = y0; y < y1; y++) {
+                    const uint64_t *c = cellbits + y * nw;
+                    const uint64_t *tr = t + (y - dy) * nw;
+
+                    for (k = 0; k < nw; k++) {
+                        and += __builtin_popcountll(c[k] & tr[k]);
+                    }
+                }
+                overlap = MAX(overlap, and);
+            }
+        }
+
+        int dist = cell_ones + bank->ones[g] - 2 * overlap;
+        if (dist < best_dist) {
+            best_dist = dist;
+            best_match = g;
+        }
+    }
+
+    return best_match;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("popcnt")))
+static int
+match_popcnt(const struct bit_bank *bank, uint64_t *cellbits, const unsigned char *cell, int step,
+             const int *cands, int ncands) {
+    return match_body(bank, cellbits, cell, step, cands, ncands,
+                      bank->width, bank->height, bank->words, pack_generic);
+}
+#endif
+
+static int
+match_generic(const struct bit_bank *bank, uint64_t *cellbits, const unsigned char *cell, int step,
+              const int *cands, int ncands) {
+    return match_body(bank, cellbits, cell, step, cands, ncands,
+                      bank->width, bank->height, bank->words, pack_generic);
+}
+
+static bitbank_match_fn generic_kernel = match_generic;
+static pthread_once_t generic_once = PTHREAD_ONCE_INIT;
+
+/* Run once, before any bank exists, however many contexts create banks at the
+ * same time; workers only ever read generic_kernel afterwards.
+ */
+static void
+pick_generic_kernel(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("popcnt")) {
+        generic_kernel = match_popcnt;
+    }
+#endif
+}
+
+/* The kernel for any cell size; see bitbank_match(). */
+int
+bitbank_match_generic(const struct bit_bank *bank, uint64_t *cellbits, const unsigned char *cell, int step,
+                      const int *cands, int ncands) {
+    return generic_kernel(bank, cellbits, cell, step, cands, ncands);
+}
+
+#ifdef HAVE_X86_KERNELS
+/* A row of up to 16 pixels becomes its bits with one compare and one mask
+ * extraction.  Rows are copied out first, since a full 16-byte load could run
+ * past the end of the image at its last cell.
+ */
+__attribute__((target("sse4.2,popcnt")))
+static void
+pack_sse42(uint64_t *cellbits, const unsigned char *cell, int step, int w, int h, int nw) {
+    const __m128i zero = _mm_setzero_si128();
+
+    (void)nw;
+    for (int y = 0; y < h; y++) {
+        unsigned char row[16] = { 0 };
+
+        memcpy(row, cell + y * step, w);
+        __m128i v = _mm_loadu_si128((const __m128i *)row);
+        cellbits[y] = ~_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) & 0xffff;
+    }
+}
+
+/* Masked loads don't fault on the lanes left out, so no copy is needed. */
+__attribute__((target("avx512bw,avx512vl,popcnt")))
+static void
+pack_avx512(uint64_t *cellbits, const unsigned char *cell, int step, int w, int h, int nw) {
+    __mmask16 lanes = (__mmask16)((1u << w) - 1);
+
+    (void)nw;
+    for (int y = 0; y < h; y++) {
+        __m128i v = _mm_maskz_loadu_epi8(lanes, cell + y * step);
+        cellbits[y] = _mm_test_epi8_mask(v, v);
+    }
+}
+#endif
+
+#define FIXED_KERNEL(name, target, pack, w, h)                                                              \
+    target static int                                                                                       \
+    name(const struct bit_bank *bank, uint64_t *cellbits, const unsigned char *cell, int step,              \
+         const int *cands, int ncands) {                                                                    \
+        return match_body(bank, cellbits, cell, step, cands, ncands, w, h, 1, pack);                        \
+    }
+
+#define SCALAR_KERNEL(w, h) FIXED_KERNEL(match_##w##x##h, , pack_generic, w, h)
+FIXED_GEOMETRIES(SCALAR_KERNEL)
+
+#ifdef HAVE_X86_KERNELS
+#define X86_KERNELS(w, h)                                                                                   \
+    FIXED_KERNEL(match_##w##x##h##_sse42, __attribute__((target("sse4.2,popcnt"))), pack_sse42, w, h)      \
+    FIXED_KERNEL(match_##w##x##h##_avx512, __attribute__((target("avx512bw,avx512vl,popcnt"))),            \
+                 pack_avx512, w, h)
+FIXED_GEOMETRIES(X86_KERNELS)
+#endif
+
+struct fixed_kernel {
+    int width, height;
+    enum cpu_level level;
+    const char *name;
+    bitbank_match_fn match;
+};
+
+/* Packing one-word rows gains nothing from AVX2 over SSE4.2, so AVX2 CPUs get
+ * the SSE4.2 kernels.
+ */
+#define SCALAR_ENTRY(w, h) { w, h, CPU_BASELINE, "scalar " #w "x" #h, match_##w##x##h },
+#define X86_ENTRIES(w, h)                                                                                   \
+    { w, h, CPU_SSE42, "sse4.2 " #w "x" #h, match_##w##x##h##_sse42 },                                     \
+    { w, h, CPU_AVX512, "avx512 " #w "x" #h, match_##w##x##h##_avx512 },
+
+static const struct fixed_kernel fixed_kernels[] = {
+    FIXED_GEOMETRIES(SCALAR_ENTRY)
+#ifdef HAVE_X86_KERNELS
+    FIXED_GEOMETRIES(X86_ENTRIES)
+#endif
+};
+
+/* Uses the kernel for the bank's cell size that makes the most of the CPU,
+ * or the generic one if there isn't one for that size.
+ */
+static void
+pick_fixed_kernel(struct bit_bank *bank) {
+    const struct fixed_kernel *best = NULL;
+
+    pthread_once(&generic_once, pick_generic_kernel);
+    bank->match = bitbank_match_generic;
+    bank->kernel = "generic";
+    for (size_t i = 0; i < sizeof(fixed_kernels) / sizeof(fixed_kernels[0]); i++) {
+        const struct fixed_kernel *k = &fixed_kernels[i];
+
+        if (k->width == bank->width && k->height == bank->height && k->level <= cpu_level() &&
+                (best == NULL || k->level > best->level)) {
+            best = k;
+        }
+    }
+    if (best != NULL && bank->words == 1) {
+        bank->match = best->match;
+        bank->kernel = best->name;
+    }
+}
+
+/* Matches the w x h cell at the given address against the ncands glyphs in
+ * cands, or every glyph if cands is NULL.  cellbits must come from
+ * bitbank_scratch().
+ */
+int
+bitbank_match(const struct bit_bank *bank, uint64_t *cellbits, const unsigned char *cell, int step,
+              const int *cands, int ncands) {
+    return bank->match(bank, cellbits, cell, step, cands, ncands);
+}
@@ -0,0 +1,42 @@
+#ifndef _BITMATCH_H_
+#define _BITMATCH_H_
+
+#include <stdint.h>
+
+#include <opencv/cv.h>
+
+#include "utils.h"
+
+/* The template bank thresholded down to one bit per pixel.  Every glyph is
+ * stored pre-shifted horizontally by each dx in [-radius, radius], so that
+ * matching a shifted variant is just a change of row pointer.
+ */
+struct bit_bank;
+
+typedef int (*bitbank_match_fn)(const struct bit_bank *bank, uint64_t *scratch, const unsigned char *cell,
+                                int step, const int *cands, int ncands);
+
+struct bit_bank {
+    const char *charset;
+    int count;
+    int width, height;
+    int words;        /* 64-bit words per row */
+    int radius;       /* largest shift tried, in pixels, along each axis */
+    uint64_t *bits;   /* count * (2 * radius + 1) * height * words */
+    int *ones;        /* set bits in each unshifted glyph */
+
+    /* Picked by bitbank_create() for the cell size and the CPU; see kernels.h. */
+    bitbank_match_fn match;
+    const char *kernel;
+};
+
+struct bit_bank *bitbank_create(IplImage **templates, const char *charset, int w, int h, int radius);
+void bitbank_destroy(struct bit_bank *bank);
+
+uint64_t *bitbank_scratch(const struct bit_bank *bank, struct arena *arena);
+int bitbank_match(const struct bit_bank *bank, uint64_t *scratch, const unsigned char *cell, int step,
+                  const int *cands, int ncands);
+int bitbank_match_generic(const struct bit_bank *bank, uint64_t *scratch, const unsigned char *cell, int step,
+                          const int *cands, int ncands);
+
+#endif
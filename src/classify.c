@@ -0,0 +1,237 @@
+/* classify.c
+ * Cheap per-cell tests run before template matching.
+ *
+ * Copyright (c) 2014 Nathan Taylor <nbtaylor@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <opencv/cv.h>
+
+#include "classify.h"
+#include "utils.h"
+#include "workpool.h"
+
+/* Template pixels count as ink from half intensity up, as in bitmatch.c. */
+#define INK_THRESHOLD 128
+
+/* Columns per item of the SAT's vertical pass. */
+#define SAT_STRIPE 256
+
+struct sat_job {
+    struct edge_sat *sat;
+    const IplImage *edges;
+};
+
+/* First pass: prefix sums along each row, independently. */
+static void
+sat_rows(int y, int worker, void *arg) {
+    struct sat_job *job = arg;
+    int w = job->sat->width;
+    const unsigned char *src = (const unsigned char *)job->edges->imageData + y * job->edges->widthStep;
+    uint32_t *dst = job->sat->sum + (size_t)(y + 1) * (w + 1);
+    uint32_t run = 0;
+
+    (void)worker;
+    dst[0] = 0;
+    for (int x = 0; x < w; x++) {
+        run += src[x] != 0;
+        dst[x + 1] = run;
+    }
+}
+
+/* Second pass: accumulate down a stripe of columns. */
+static void
+sat_columns(int stripe, int worker, void *arg) {
+    struct sat_job *job = arg;
+    int w = job->sat->width, h = job->sat->height;
+    int x0 = stripe * SAT_STRIPE + 1, x1 = MIN(x0 + SAT_STRIPE, w + 1);
+
+    (void)worker;
+    for (int y = 1; y <= h; y++) {
+        uint32_t *row = job->sat->sum + (size_t)y * (w + 1);
+        const uint32_t *above = row - (w + 1);
+
+        for (int x = x0; x < x1; x++) {
+            row[x] += above[x];
+        }
+    }
+}
+
+/* Builds the table for edges on pool, reusing the previous table's memory. */
+void
+sat_build(struct edge_sat *sat, const IplImage *edges, struct workpool *pool) {
+    struct sat_job job = { sat, edges };
+    size_t size = (size_t)(edges->height + 1) * (edges->width + 1);
+
+    if (size > sat->size) {
+        free(sat->sum);
+        sat->sum = xmalloc(size * sizeof(uint32_t));
+        sat->size = size;
+    }
+    sat->width = edges->width;
+    sat->height = edges->height;
+    memset(sat->sum, 0, (sat->width + 1) * sizeof(uint32_t));
+
+    workpool_run(pool, sat->height, sat_rows, &job);
+    workpool_run(pool, (sat->width + SAT_STRIPE - 1) / SAT_STRIPE, sat_columns, &job);
+}
+
+void
+sat_free(struct edge_sat *sat) {
+    free(sat->sum);
+    memset(sat, 0, sizeof(*sat));
+}
+
+static void
+normalise(float *v, int n) {
+    float total = 0;
+
+    for (int i = 0; i < n; i++) {
+        total += v[i];
+    }
+    if (total > 0) {
+        for (int i = 0; i < n; i++) {
+            v[i] /= total;
+        }
+    }
+}
+
+/* Fills sig with the signature of the w x h cell at the given address, where
+ * pixels of at least threshold are ink.
+ */
+void
+cell_signature(const unsigned char *cell, int step, int w, int h, int threshold, float *sig) {
+    float *density = sig, *orientation = sig + SIG_GRID * SIG_GRID;
+    int x, y;
+
+    memset(sig, 0, SIG_LEN * sizeof(float));
+    for (y = 0; y < h; y++) {
+        const unsigned char *row = cell + y * step;
+        const unsigned char *below = y + 1 < h ? row + step : NULL;
+        float *block = density + (y * SIG_GRID / h) * SIG_GRID;
+
+        for (x = 0; x < w; x++) {
+            if (row[x] < threshold) {
+                continue;
+            }
+            block[x * SIG_GRID / w]++;
+
+            orientation[0] += x + 1 < w && row[x + 1] >= threshold;
+            if (below != NULL) {
+                orientation[1] += below[x] >= threshold;
+                orientation[2] += x + 1 < w && below[x + 1] >= threshold;
+                orientation[3] += x > 0 && below[x - 1] >= threshold;
+            }
+        }
+    }
+    normalise(density, SIG_GRID * SIG_GRID);
+    normalise(orientation, SIG_ORIENTATIONS);
+}
+
+struct glyph_signatures *
+signatures_create(IplImage **templates, int count, int w, int h) {
+    struct glyph_signatures *gs = xcalloc(1, sizeof(*gs));
+
+    gs->count = count;
+    gs->sig = xcalloc((size_t)count * SIG_LEN, sizeof(float));
+    gs->blank = xcalloc(count, sizeof(bool_t));
+    for (int g = 0; g < count; g++) {
+        float *sig = gs->sig + g * SIG_LEN;
+
+        cell_signature((const unsigned char *)templates[g]->imageData, templates[g]->widthStep,
+                       w, h, INK_THRESHOLD, sig);
+        gs->blank[g] = true;
+        for (int i = 0; i < SIG_GRID * SIG_GRID; i++) {
+            if (sig[i] > 0) {
+                gs->blank[g] = false;
+            }
+        }
+    }
+
+    return gs;
+}
+
+void
+signatures_destroy(struct glyph_signatures *gs) {
+    if (gs == NULL) {
+        return;
+    }
+    free(gs->sig);
+    free(gs->blank);
+    free(gs);
+}
+
+/* Picks the keep glyphs whose signatures are closest (in L1) to sig, and
+ * writes their indices to cands in ascending order, so that matching among
+ * them breaks ties the same way as matching against every glyph.  Glyphs with
+ * no ink (the space) are left out: this is only used for cells with edges,
+ * and no matcher scores a blank glyph above one with ink there.  Returns how
+ * many were picked.
+ */
+int
+prune_candidates(const struct glyph_signatures *gs, const float *sig, int keep, int *cands) {
+    float dist[gs->count];
+    int g, i, n = 0, inked = 0;
+
+    for (g = 0; g < gs->count; g++) {
+        const float *t = gs->sig + g * SIG_LEN;
+
+        if (gs->blank[g]) {
+            dist[g] = FLT_MAX;
+            continue;
+        }
+        dist[g] = 0;
+        for (i = 0; i < SIG_LEN; i++) {
+            dist[g] += fabsf(sig[i] - t[i]);
+        }
+        inked++;
+    }
+    if (inked == 0) {
+        cands[0] = 0;
+        return 1;
+    }
+    keep = MIN(keep, inked);
+
+    /* Selection of the keep nearest; there are only a handful of glyphs. */
+    for (n = 0; n < keep; n++) {
+        int best = -1;
+
+        for (g = 0; g < gs->count; g++) {
+            if (dist[g] < FLT_MAX && (best < 0 || dist[g] < dist[best])) {
+                best = g;
+            }
+        }
+        cands[n] = best;
+        dist[best] = FLT_MAX;
+    }
+
+    /* Insertion sort back into glyph order. */
+    for (i = 1; i < n; i++) {
+        int v = cands[i], j = i;
+
+        for (; j > 0 && cands[j - 1] > v; j--) {
+            cands[j] = cands[j - 1];
+        }
+        cands[j] = v;
+    }
+
+    return n;
+}
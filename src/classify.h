@@ -0,0 +1,52 @@
+#ifndef _CLASSIFY_H_
+#define _CLASSIFY_H_
+
+#include <stdint.h>
+
+#include <opencv/cv.h>
+
+#include "main.h"
+#include "workpool.h"
+
+/* A summed-area table of edge pixels: sum[y][x] is the number of lit pixels
+ * above and to the left of (x, y), so any rectangle's count is four lookups.
+ */
+struct edge_sat {
+    int width, height;
+    uint32_t *sum;          /* (height + 1) x (width + 1) */
+    size_t size;
+};
+
+void sat_build(struct edge_sat *sat, const IplImage *edges, struct workpool *pool);
+void sat_free(struct edge_sat *sat);
+
+static inline uint32_t
+sat_count(const struct edge_sat *sat, int x, int y, int w, int h) {
+    const uint32_t *top = sat->sum + (size_t)y * (sat->width + 1);
+    const uint32_t *bot = sat->sum + (size_t)(y + h) * (sat->width + 1);
+
+    return bot[x + w] - bot[x] - top[x + w] + top[x];
+}
+
+/* Coarse descriptions of what a cell or glyph looks like: how its ink is
+ * spread over a SIG_GRID x SIG_GRID grid of blocks, and which way its strokes
+ * run (counts of horizontally, vertically and diagonally adjacent ink).  Both
+ * halves are normalised, so thin edges and thick glyph strokes compare fairly.
+ */
+#define SIG_GRID 4
+#define SIG_ORIENTATIONS 4
+#define SIG_LEN (SIG_GRID * SIG_GRID + SIG_ORIENTATIONS)
+
+struct glyph_signatures {
+    int count;
+    float *sig;             /* count x SIG_LEN */
+    bool_t *blank;          /* glyphs without any ink */
+};
+
+struct glyph_signatures *signatures_create(IplImage **templates, int count, int w, int h);
+void signatures_destroy(struct glyph_signatures *gs);
+
+void cell_signature(const unsigned char *cell, int step, int w, int h, int threshold, float *sig);
+int prune_candidates(const struct glyph_signatures *gs, const float *sig, int keep, int *cands);
+
+#endif
@@ -0,0 +1,414 @@
+/* daemon.c
+ * A long-lived conversion server on a Unix domain socket.
+ *
+ * Copyright (c) 2014 Nathan Taylor <nbtaylor@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <libconfig.h>
+#include <opencv/cv.h>
+#include <opencv/highgui.h>
+
+#include "daemon.h"
+#include "libasciimatic.h"
+#include "logging.h"
+#include "main.h"
+#include "queue.h"
+#include "templates.h"
+#include "trace.h"
+#include "utils.h"
+
+extern config_t config;
+
+/* The protocol: one request per connection.  The client sends a header line
+ *
+ *     <columns> <rows> <threshold1> <threshold2> <deadline ms> <length>\n
+ *
+ * then length bytes of an image in any format OpenCV reads; a deadline of 0
+ * means the daemon's default.  The daemon answers with
+ *
+ *     OK <columns> <rows>\n
+ *
+ * and the grid, rows newline-terminated lines, or with ERR and a reason on
+ * one line, and closes the connection.
+ */
+#define HEADER_MAX 128
+
+static volatile sig_atomic_t stop_requested;
+
+static void
+on_signal(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+struct daemon_conn {
+    int fd;
+    uint64_t accepted;  /* trace_now() */
+};
+
+struct daemon_stats {
+    unsigned long served, failed, late;
+};
+
+struct daemon {
+    struct queue *conns;
+    struct asciimatic_options options;
+    int default_deadline;       /* ms */
+    size_t max_bytes;
+
+    pthread_mutex_t lock;
+    struct daemon_stats stats;
+};
+
+/* One worker's things: its own pipeline, and the response being built. */
+struct daemon_worker {
+    struct daemon *d;
+    pthread_t thread;
+    struct asciimatic *ctx;
+    char *out;
+    size_t len, size;
+    unsigned char *body;
+    size_t body_size;
+};
+
+static void
+set_timeout(int fd, uint64_t deadline) {
+    uint64_t now = trace_now(), left = deadline > now ? deadline - now : 0;
+    struct timeval tv;
+
+    /* A zero timeval means no timeout at all, so a deadline that has passed,
+     * or is less than the 1us resolution away, still gets the shortest one.
+     */
+    if (left < 1000) {
+        left = 1000;
+    }
+    tv.tv_sec = left / 1000000000;
+    tv.tv_usec = left % 1000000000 / 1000;
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static bool_t
+read_all(int fd, void *buf, size_t len) {
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t n = read(fd, (char *)buf + done, len - done);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+static bool_t
+write_all(int fd, const void *buf, size_t len) {
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t n = write(fd, (const char *)buf + done, len - done);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+/* Reads the header a byte at a time, so that nothing of the body is consumed
+ * along with it.
+ */
+static bool_t
+read_header(int fd, char *line) {
+    int i;
+
+    for (i = 0; i < HEADER_MAX - 1; i++) {
+        if (!read_all(fd, line + i, 1)) {
+            return false;
+        }
+        if (line[i] == '\n') {
+            line[i] = '\0';
+            return true;
+        }
+    }
+    return false;
+}
+
+static void
+append(struct daemon_worker *w, const char *text, size_t len) {
+    if (w->len + len > w->size) {
+        w->size = MAX(w->size * 2, w->len + len);
+        w->out = xrealloc(w->out, w->size);
+    }
+    memcpy(w->out + w->len, text, len);
+    w->len += len;
+}
+
+static void
+emit_row(void *arg, int row, const char *text, int len) {
+    (void)row;
+    append(arg, text, len + 1);
+}
+
+static void
+reply_error(struct daemon_worker *w, int fd, const char *reason) {
+    char line[HEADER_MAX];
+    int n = snprintf(line, sizeof(line), "ERR %s\n", reason);
+
+    write_all(fd, line, n);
+    pthread_mutex_lock(&w->d->lock);
+    w->d->stats.failed++;
+    w->d->stats.late += strcmp(reason, "deadline") == 0;
+    pthread_mutex_unlock(&w->d->lock);
+}
+
+/* Reads, converts and answers one request; returns why it failed, or NULL. */
+static const char *
+serve(struct daemon_worker *w, struct daemon_conn *c) {
+    char line[HEADER_MAX], head[HEADER_MAX];
+    int cols, rows, t1, t2, deadline_ms, status;
+    unsigned long length;
+    IplImage *img;
+    CvMat buf;
+
+    /* Until the header says otherwise, the default deadline applies. */
+    set_timeout(c->fd, c->accepted + (uint64_t)w->d->default_deadline * 1000000);
+    if (!read_header(c->fd, line) ||
+            sscanf(line, "%d %d %d %d %d %lu", &cols, &rows, &t1, &t2, &deadline_ms, &length) != 6 ||
+            cols < 1 || rows < 1 || cols > 4096 || rows > 1024 || deadline_ms < 0) {
+        return "bad request";
+    }
+    if (length == 0 || length > w->d->max_bytes) {
+        return "image too large";
+    }
+
+    uint64_t deadline = c->accepted + (uint64_t)(deadline_ms > 0 ? deadline_ms : w->d->default_deadline) * 1000000;
+    set_timeout(c->fd, deadline);
+
+    if (w->body_size < length) {
+        w->body = xrealloc(w->body, length);
+        w->body_size = length;
+    }
+    if (!read_all(c->fd, w->body, length)) {
+        return trace_now() > deadline ? "deadline" : "short read";
+    }
+    if (trace_now() > deadline) {
+        return "deadline";
+    }
+
+    {
+        TRACE_SCOPE("decode");
+        cvInitMatHeader(&buf, 1, length, CV_8UC1, w->body, CV_AUTOSTEP);
+        img = cvDecodeImage(&buf, CV_LOAD_IMAGE_GRAYSCALE);
+    }
+    if (img == NULL) {
+        return "unreadable image";
+    }
+
+    asciimatic_set_thresholds(w->ctx, t1, t2);
+    asciimatic_set_deadline(w->ctx, MAX((int)((deadline - MIN(trace_now(), deadline)) / 1000000), 1));
+
+    w->len = 0;
+    append(w, head, snprintf(head, sizeof(head), "OK %d %d\n", cols, rows));
+    status = asciimatic_convert(w->ctx, (unsigned char *)img->imageData, img->width, img->height,
+                                img->widthStep, cols, rows, emit_row, w);
+    cvReleaseImage(&img);
+
+    if (status == ASCIIMATIC_EINVAL) {
+        return "image too small";
+    }
+    if (status == ASCIIMATIC_ETIME) {
+        return "deadline";
+    }
+    if (!write_all(c->fd, w->out, w->len)) {
+        return "short write";
+    }
+    return NULL;
+}
+
+static void *
+worker_main(void *arg) {
+    struct daemon_worker *w = arg;
+    struct daemon_conn *c;
+
+    trace_thread_name("daemon");
+    while ((c = queue_pop(w->d->conns)) != NULL) {
+        const char *failure;
+        uint64_t start = trace_now();
+
+        if ((failure = serve(w, c)) != NULL) {
+            xlog(LOG_DEBUG, "Request failed after %.2fms: %s", (trace_now() - c->accepted) / 1e6, failure);
+            reply_error(w, c->fd, failure);
+        } else {
+            xlog(LOG_DEBUG, "Served in %.2fms (%.2fms queued)",
+                 (trace_now() - c->accepted) / 1e6, (start - c->accepted) / 1e6);
+            pthread_mutex_lock(&w->d->lock);
+            w->d->stats.served++;
+            pthread_mutex_unlock(&w->d->lock);
+        }
+        close(c->fd);
+        free(c);
+    }
+    return NULL;
+}
+
+static int
+listen_on(const char *path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        panic(1, "Socket path %s is too long", path);
+    }
+    strcpy(addr.sun_path, path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        panic(1, "Can't create socket: %s", strerror(errno));
+    }
+    /* A socket left behind by a daemon that died is in the way. */
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, SOMAXCONN) == -1) {
+        panic(1, "Can't listen on %s: %s", path, strerror(errno));
+    }
+    return fd;
+}
+
+/* Serves conversions on a Unix socket at path until SIGINT or SIGTERM.  Every
+ * worker has a pipeline of its own, so requests are converted concurrently;
+ * template banks are shared between them, and idle ones kept warm for the
+ * next request with the same cell size.
+ */
+int
+run_daemon(const char *path) {
+    struct daemon d;
+    struct daemon_worker *workers;
+    int nworkers, match_threads, backlog, banks, max_mb, i;
+    int fd;
+
+    memset(&d, 0, sizeof(d));
+    asciimatic_defaults(&d.options);
+    asciimatic_options_from_config(&config, &d.options);
+
+    if (!config_lookup_int(&config, "daemon_workers", &nworkers) || nworkers < 1) {
+        nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (!config_lookup_int(&config, "daemon_match_threads", &match_threads) || match_threads < 1) {
+        match_threads = 1;
+    }
+    if (!config_lookup_int(&config, "daemon_backlog", &backlog) || backlog < 1) {
+        backlog = 64;
+    }
+    if (!config_lookup_int(&config, "daemon_banks", &banks) || banks < 0) {
+        banks = 32;
+    }
+    if (!config_lookup_int(&config, "daemon_deadline", &d.default_deadline) || d.default_deadline < 1) {
+        d.default_deadline = 5000;
+    }
+    if (!config_lookup_int(&config, "daemon_max_mb", &max_mb) || max_mb < 1) {
+        max_mb = 64;
+    }
+    d.max_bytes = (size_t)max_mb << 20;
+    d.options.threads = match_threads;
+
+    template_bank_keep(banks);
+    d.conns = queue_create(backlog);
+    pthread_mutex_init(&d.lock, NULL);
+
+    workers = xcalloc(nworkers, sizeof(*workers));
+    for (i = 0; i < nworkers; i++) {
+        workers[i].d = &d;
+        if ((workers[i].ctx = asciimatic_create(&d.options)) == NULL) {
+            panic(1, "Bad pipeline settings in config file");
+        }
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+            panic(1, "Can't start daemon worker %d", i);
+        }
+    }
+
+    fd = listen_on(path);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+    xlog(LOG_INFO, "Listening on %s with %d workers of %d threads", path, nworkers, match_threads);
+
+    while (!stop_requested) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        struct daemon_conn *c;
+        int cfd;
+
+        /* Poll rather than block in accept(), so a signal is noticed. */
+        if (poll(&pfd, 1, 200) <= 0) {
+            continue;
+        }
+        if ((cfd = accept(fd, NULL, NULL)) == -1) {
+            if (errno != EINTR && errno != EAGAIN && errno != ECONNABORTED) {
+                xlog(LOG_WARNING, "accept: %s", strerror(errno));
+            }
+            continue;
+        }
+        c = xmalloc(sizeof(*c));
+        c->fd = cfd;
+        c->accepted = trace_now();
+        /* Blocks while the workers are backlog requests behind, which leaves
+         * further clients waiting in the listen queue.
+         */
+        if (!queue_push(d.conns, c)) {
+            close(cfd);
+            free(c);
+        }
+    }
+
+    close(fd);
+    unlink(path);
+    queue_close(d.conns);
+    for (i = 0; i < nworkers; i++) {
+        pthread_join(workers[i].thread, NULL);
+        asciimatic_destroy(workers[i].ctx);
+        free(workers[i].out);
+        free(workers[i].body);
+    }
+    /* Only now that every worker has finished are the totals final. */
+    xlog(LOG_INFO, "Shut down: %lu requests served, %lu failed (%lu past their deadline)",
+         d.stats.served, d.stats.failed, d.stats.late);
+    free(workers);
+    queue_destroy(d.conns);
+    pthread_mutex_destroy(&d.lock);
+    template_bank_keep(0);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+
+    return 0;
+}
@@ -0,0 +1,6 @@
+#ifndef _DAEMON_H_
+#define _DAEMON_H_
+
+int run_daemon(const char *path);
+
+#endif
@@ -0,0 +1,192 @@
+/* descriptor.c
+ * Orientation-descriptor matching through a precomputed nearest-glyph table.
+ *
+ * Copyright (c) 2014 Nathan Taylor <nbtaylor@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <opencv/cv.h>
+
+#include "descriptor.h"
+#include "utils.h"
+
+/* Stroke directions, in the order of the block codes that follow CODE_EMPTY. */
+enum { DIR_HORIZONTAL, DIR_VERTICAL, DIR_DIAGONAL, DIR_ANTIDIAGONAL, NUM_DIRS };
+
+/* Canny thresholds for the glyph templates. */
+#define GLYPH_THRESH1 50
+#define GLYPH_THRESH2 150
+
+#define CODE_EMPTY 0
+#define CODE_MIXED (1 + NUM_DIRS)
+
+/* How far apart two block codes are.  Strokes 45 degrees apart are closer
+ * than strokes at right angles, a mixed block is close to any direction, and
+ * ink where there should be none (or vice versa) is worst of all.
+ */
+static const unsigned char code_distance[DESC_CODES][DESC_CODES] = {
+    /*            empty  -   |   \   /  mixed */
+    /* empty */ {   0,   4,  4,  4,  4,  4 },
+    /* -     */ {   4,   0,  3,  2,  2,  1 },
+    /* |     */ {   4,   3,  0,  2,  2,  1 },
+    /* \     */ {   4,   2,  2,  0,  3,  1 },
+    /* /     */ {   4,   2,  2,  3,  0,  1 },
+    /* mixed */ {   4,   1,  1,  1,  1,  0 },
+};
+
+/* Reads the strokes in the w x h edge map at the given address and returns
+ * its key.  Canny edges are a pixel wide, so the direction of a stroke through
+ * a pixel is the direction of its lit neighbours (which is also the edge
+ * direction Canny quantised its gradients to); each block takes a direction if
+ * it has more than half of the block's neighbour pairs.
+ */
+static int
+cell_key(const unsigned char *cell, int step, int w, int h, unsigned char *codes) {
+    int hist[DESC_BLOCKS][NUM_DIRS], ink[DESC_BLOCKS];
+    int x, y, b, d, key = 0;
+
+    memset(hist, 0, sizeof(hist));
+    memset(ink, 0, sizeof(ink));
+    for (y = 0; y < h; y++) {
+        const unsigned char *row = cell + y * step;
+        const unsigned char *below = y + 1 < h ? row + step : NULL;
+        int by = y * DESC_ROWS / h;
+
+        for (x = 0; x < w; x++) {
+            if (!row[x]) {
+                continue;
+            }
+            int *bin = hist[by * DESC_COLS + x * DESC_COLS / w];
+
+            /* Only look right and down, so each pair is counted once. */
+            bin[DIR_HORIZONTAL] += x + 1 < w && row[x + 1];
+            if (below != NULL) {
+                bin[DIR_VERTICAL] += below[x] != 0;
+                bin[DIR_DIAGONAL] += x + 1 < w && below[x + 1];
+                bin[DIR_ANTIDIAGONAL] += x > 0 && below[x - 1];
+            }
+            ink[by * DESC_COLS + x * DESC_COLS / w]++;
+        }
+    }
+
+    for (b = 0; b < DESC_BLOCKS; b++) {
+        int total = 0, best = 0;
+        unsigned char code;
+
+        for (d = 0; d < NUM_DIRS; d++) {
+            total += hist[b][d];
+            if (hist[b][d] > hist[b][best]) {
+                best = d;
+            }
+        }
+        /* Lone pixels have no direction, but are still ink. */
+        if (ink[b] == 0) {
+            code = CODE_EMPTY;
+        } else if (2 * hist[b][best] > total && total > 0) {
+            code = 1 + best;
+        } else {
+            code = CODE_MIXED;
+        }
+
+        if (codes != NULL) {
+            codes[b] = code;
+        }
+        key = key * DESC_CODES + code;
+    }
+
+    return key;
+}
+
+/* Builds the index for templates of w x h pixels.  Each template is put
+ * through Canny first, so that glyphs are described by the same kind of thin
+ * edges as the cells they'll be compared with.  Rendered glyphs are clean, so
+ * fixed thresholds do; using the user's would tie the index to them.
+ */
+struct descriptor_index *
+descriptor_index_create(IplImage **templates, int count, int w, int h) {
+    struct descriptor_index *ix = xcalloc(1, sizeof(*ix));
+    IplImage *padded = cvCreateImage(cvSize(w + 2, h + 2), IPL_DEPTH_8U, 1);
+    IplImage *edges = cvCreateImage(cvSize(w + 2, h + 2), IPL_DEPTH_8U, 1);
+    int g, b, key;
+
+    ix->width = w;
+    ix->height = h;
+    ix->count = count;
+    ix->codes = xcalloc((size_t)count * DESC_BLOCKS, 1);
+    ix->nearest = xcalloc(DESC_KEYS, sizeof(uint16_t));
+
+    /* A blank border, so that strokes touching the edge of a glyph still get
+     * both their edges.
+     */
+    cvSetZero(padded);
+    for (g = 0; g < count; g++) {
+        cvSetImageROI(padded, cvRect(1, 1, w, h));
+        cvCopy(templates[g], padded, NULL);
+        cvResetImageROI(padded);
+
+        cvCanny(padded, edges, GLYPH_THRESH1, GLYPH_THRESH2, 3);
+        cell_key((const unsigned char *)edges->imageData + edges->widthStep + 1, edges->widthStep,
+                 w, h, ix->codes + g * DESC_BLOCKS);
+    }
+    cvReleaseImage(&padded);
+    cvReleaseImage(&edges);
+
+    /* Nearest glyph for every possible key; the earliest on ties, as with the
+     * other matchers.
+     */
+    for (key = 0; key < DESC_KEYS; key++) {
+        unsigned char codes[DESC_BLOCKS];
+        int k = key, best = INT_MAX;
+
+        for (b = DESC_BLOCKS - 1; b >= 0; b--) {
+            codes[b] = k % DESC_CODES;
+            k /= DESC_CODES;
+        }
+        for (g = 0; g < count; g++) {
+            const unsigned char *gc = ix->codes + g * DESC_BLOCKS;
+            int dist = 0;
+
+            for (b = 0; b < DESC_BLOCKS; b++) {
+                dist += code_distance[codes[b]][gc[b]];
+            }
+            if (dist < best) {
+                best = dist;
+                ix->nearest[key] = g;
+            }
+        }
+    }
+
+    return ix;
+}
+
+void
+descriptor_index_destroy(struct descriptor_index *ix) {
+    if (ix == NULL) {
+        return;
+    }
+    free(ix->codes);
+    free(ix->nearest);
+    free(ix);
+}
+
+int
+descriptor_match(const struct descriptor_index *ix, const unsigned char *cell, int step) {
+    return ix->nearest[cell_key(cell, step, ix->width, ix->height, NULL)];
+}
@@ -0,0 +1,33 @@
+#ifndef _DESCRIPTOR_H_
+#define _DESCRIPTOR_H_
+
+#include <stdint.h>
+
+#include <opencv/cv.h>
+
+/* Matching by edge orientation rather than by pixels.  A cell is split into a
+ * DESC_ROWS x DESC_COLS grid of blocks, and each block is reduced to one code:
+ * empty, one of four stroke directions, or mixed.  The codes of all blocks
+ * together form a key, and a table built up front maps every possible key to
+ * its nearest glyph, so matching a cell is one pass to read its strokes and
+ * one lookup, whatever the cell size or number of glyphs.
+ */
+#define DESC_ROWS 3
+#define DESC_COLS 2
+#define DESC_BLOCKS (DESC_ROWS * DESC_COLS)
+#define DESC_CODES 6
+#define DESC_KEYS (6 * 6 * 6 * 6 * 6 * 6)       /* DESC_CODES ^ DESC_BLOCKS */
+
+struct descriptor_index {
+    int width, height;
+    int count;
+    unsigned char *codes;   /* count x DESC_BLOCKS, each glyph's blocks */
+    uint16_t *nearest;      /* DESC_KEYS, the glyph for every key */
+};
+
+struct descriptor_index *descriptor_index_create(IplImage **templates, int count, int w, int h);
+void descriptor_index_destroy(struct descriptor_index *ix);
+
+int descriptor_match(const struct descriptor_index *ix, const unsigned char *cell, int step);
+
+#endif
@@ -0,0 +1,246 @@
+/* edges.c
+ * Canny edge detection with a reusable gradient stage.
+ *
+ * Copyright (c) 2014 Nathan Taylor <nbtaylor@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <opencv/cv.h>
+
+#include "edges.h"
+#include "main.h"
+#include "utils.h"
+
+/* tan(22.5 degrees) in 15-bit fixed point, as cvCanny uses. */
+#define CANNY_SHIFT 15
+#define TG22 ((int)(0.4142135623730950488016887242097 * (1 << CANNY_SHIFT) + 0.5))
+
+/* Hysteresis map states, again as in cvCanny. */
+#define MAP_CANDIDATE 0
+#define MAP_NONE 1
+#define MAP_EDGE 2
+
+void
+gradient_init(struct gradient *g) {
+    memset(g, 0, sizeof(*g));
+}
+
+void
+gradient_free(struct gradient *g) {
+    cvReleaseImage(&g->dx);
+    cvReleaseImage(&g->dy);
+    free(g->mag);
+    for (int i = 0; i < 3; i++) {
+        free(g->rows[i]);
+    }
+    free(g->map);
+    free(g->stack);
+    gradient_init(g);
+}
+
+static void
+gradient_resize(struct gradient *g, int w, int h) {
+    size_t padded = (size_t)(w + 2) * (h + 2);
+
+    if (g->dx != NULL && g->width == w && g->height == h) {
+        return;
+    }
+    gradient_free(g);
+
+    g->width = w;
+    g->height = h;
+    g->dx = cvCreateImage(cvSize(w, h), IPL_DEPTH_16S, 1);
+    g->dy = cvCreateImage(cvSize(w, h), IPL_DEPTH_16S, 1);
+    g->mag = xcalloc(padded, sizeof(int));
+    for (int i = 0; i < 3; i++) {
+        g->rows[i] = xcalloc(w + 2, sizeof(int));
+    }
+    g->map = xmalloc(padded);
+}
+
+/* L1 gradient magnitude of row y into out[1, w], or zeros outside the image. */
+static void
+magnitude_row(const struct gradient *g, int y, int *out) {
+    if (y < 0 || y >= g->height) {
+        memset(out, 0, (g->width + 2) * sizeof(int));
+        return;
+    }
+
+    const short *dx = (const short *)(g->dx->imageData + y * g->dx->widthStep);
+    const short *dy = (const short *)(g->dy->imageData + y * g->dy->widthStep);
+    for (int x = 0; x < g->width; x++) {
+        out[x + 1] = abs(dx[x]) + abs(dy[x]);
+    }
+}
+
+/* Runs the threshold-independent half of cvCanny(src, ..., 3) over src: Sobel,
+ * magnitude and non-maximum suppression.  Suppression decisions are made with
+ * the same fixed-point sectors and tie-breaking as OpenCV, so thresholding the
+ * result gives the same edges cvCanny would.
+ */
+void
+gradient_compute(struct gradient *g, const IplImage *src) {
+    int w = src->width, h = src->height;
+    int stride = w + 2;
+    int x, y;
+
+    gradient_resize(g, w, h);
+
+    cvSobel(src, g->dx, 1, 0, 3);
+    cvSobel(src, g->dy, 0, 1, 3);
+
+    int *prev = g->rows[0], *cur = g->rows[1], *next = g->rows[2];
+    magnitude_row(g, -1, prev);
+    magnitude_row(g, 0, cur);
+
+    for (y = 0; y < h; y++) {
+        const short *dxr = (const short *)(g->dx->imageData + y * g->dx->widthStep);
+        const short *dyr = (const short *)(g->dy->imageData + y * g->dy->widthStep);
+        int *out = g->mag + (y + 1) * stride + 1;
+
+        magnitude_row(g, y + 1, next);
+
+        for (x = 0; x < w; x++) {
+            int m = cur[x + 1];
+            int xs = dxr[x], ys = dyr[x];
+            int ax = abs(xs), ay = abs(ys) << CANNY_SHIFT;
+            int tg22x = ax * TG22;
+            bool_t keep;
+
+            if (ay < tg22x) {
+                keep = m > cur[x] && m >= cur[x + 2];
+            } else {
+                int tg67x = tg22x + (ax << (CANNY_SHIFT + 1));
+                if (ay > tg67x) {
+                    keep = m > prev[x + 1] && m >= next[x + 1];
+                } else {
+                    int s = (xs ^ ys) < 0 ? -1 : 1;
+                    keep = m > prev[x + 1 - s] && m > next[x + 1 + s];
+                }
+            }
+            out[x] = keep ? m : 0;
+        }
+
+        int *t = prev;
+        prev = cur;
+        cur = next;
+        next = t;
+    }
+}
+
+static inline void
+push(struct gradient *g, int *top, int idx) {
+    if (*top == g->stack_size) {
+        g->stack_size = g->stack_size ? 2 * g->stack_size : 4096;
+        g->stack = xrealloc(g->stack, g->stack_size * sizeof(int));
+    }
+    g->stack[(*top)++] = idx;
+}
+
+/* The cheap half of Canny: keeps every suppressed maximum above high, plus
+ * everything above low that is 8-connected to one.  dst is reused if it is
+ * already the right size; either way, the caller owns the return value.
+ */
+IplImage *
+gradient_threshold(struct gradient *g, IplImage *dst, int low, int high) {
+    int w = g->width, h = g->height;
+    int stride = w + 2;
+    int x, y, top = 0;
+
+    if (low > high) {
+        int t = low;
+        low = high;
+        high = t;
+    }
+
+    if (dst != NULL && (dst->width != w || dst->height != h)) {
+        cvReleaseImage(&dst);
+    }
+    if (dst == NULL) {
+        dst = cvCreateImage(cvSize(w, h), IPL_DEPTH_8U, 1);
+    }
+
+    memset(g->map, MAP_NONE, (size_t)stride * (h + 2));
+    for (y = 1; y <= h; y++) {
+        const int *m = g->mag + y * stride;
+        unsigned char *map = g->map + y * stride;
+
+        for (x = 1; x <= w; x++) {
+            if (m[x] > high) {
+                map[x] = MAP_EDGE;
+                push(g, &top, y * stride + x);
+            } else if (m[x] > low) {
+                map[x] = MAP_CANDIDATE;
+            }
+        }
+    }
+
+    /* The map's border is never a candidate, so there's no bounds checking. */
+    static const int dy8[] = {-1, -1, -1, 0, 0, 1, 1, 1};
+    static const int dx8[] = {-1, 0, 1, -1, 1, -1, 0, 1};
+    while (top > 0) {
+        int idx = g->stack[--top];
+
+        for (int k = 0; k < 8; k++) {
+            int n = idx + dy8[k] * stride + dx8[k];
+            if (g->map[n] == MAP_CANDIDATE) {
+                g->map[n] = MAP_EDGE;
+                push(g, &top, n);
+            }
+        }
+    }
+
+    for (y = 0; y < h; y++) {
+        const unsigned char *map = g->map + (y + 1) * stride + 1;
+        unsigned char *out = (unsigned char *)dst->imageData + y * dst->widthStep;
+
+        for (x = 0; x < w; x++) {
+            out[x] = map[x] == MAP_EDGE ? 255 : 0;
+        }
+    }
+
+    return dst;
+}
+
+/* Returns src halved levels times.  The result belongs to p and is good until
+ * the next call; with no levels, it is src itself.
+ */
+IplImage *
+pyramid_down(struct pyramid *p, IplImage *src, int levels) {
+    IplImage *prev = src;
+
+    for (int i = 0; i < levels && i < PYRAMID_MAX_LEVELS; i++) {
+        CvSize size = cvSize((prev->width + 1) / 2, (prev->height + 1) / 2);
+        IplImage *level = p->levels[i];
+
+        if (level == NULL || level->width != size.width || level->height != size.height) {
+            cvReleaseImage(&p->levels[i]);
+            level = p->levels[i] = cvCreateImage(size, IPL_DEPTH_8U, 1);
+        }
+        cvPyrDown(prev, level, CV_GAUSSIAN_5x5);
+        prev = level;
+    }
+    return prev;
+}
+
+void
+pyramid_free(struct pyramid *p) {
+    for (int i = 0; i < PYRAMID_MAX_LEVELS; i++) {
+        cvReleaseImage(&p->levels[i]);
+    }
+}
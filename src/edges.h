@@ -0,0 +1,39 @@
+#ifndef _EDGES_H_
+#define _EDGES_H_
+
+#include <opencv/cv.h>
+
+/* Canny edge detection split at the point where the thresholds come in.  The
+ * expensive half (Sobel, gradient magnitude and non-maximum suppression) only
+ * depends on the image, so it is computed once and kept here; hysteresis can
+ * then be re-run cheaply for as many threshold pairs as we like.
+ */
+struct gradient {
+    int width, height;
+    IplImage *dx, *dy;      /* 16-bit Sobel responses */
+    int *mag;               /* (h + 2) x (w + 2), zero border: L1 magnitude of
+                               local maxima along the gradient, 0 elsewhere */
+    int *rows[3];           /* ring of magnitude rows used during suppression */
+    unsigned char *map;     /* (h + 2) x (w + 2) hysteresis state */
+    int *stack;
+    int stack_size;
+};
+
+void gradient_init(struct gradient *g);
+void gradient_compute(struct gradient *g, const IplImage *src);
+IplImage *gradient_threshold(struct gradient *g, IplImage *dst, int low, int high);
+void gradient_free(struct gradient *g);
+
+/* Successive halvings of an image through cvPyrDown(), kept between calls so
+ * that frames of the same size reuse them.
+ */
+#define PYRAMID_MAX_LEVELS 8
+
+struct pyramid {
+    IplImage *levels[PYRAMID_MAX_LEVELS];   /* levels[0] is half size */
+};
+
+IplImage *pyramid_down(struct pyramid *p, IplImage *src, int levels);
+void pyramid_free(struct pyramid *p);
+
+#endif
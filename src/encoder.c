@@ -0,0 +1,557 @@
+/* encoder.c
+ * Output encoders: plain text, ANSI truecolour and HTML, written with writev().
+ *
+ * Copyright (c) 2014 Nathan Taylor <nbtaylor@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <opencv/cv.h>
+
+#include "encoder.h"
+#include "logging.h"
+#include "trace.h"
+#include "utils.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/* Past this much buffered output, a grid is written out before it is done. */
+#define ENCODER_FLUSH_BYTES (256 * 1024)
+
+static const char *format_names[NUM_OUTPUT_FORMATS] = {"plain", "ansi", "html"};
+static const char *format_extensions[NUM_OUTPUT_FORMATS] = {".txt", ".ans", ".html"};
+
+/* Returns the format called name, or -1. */
+int
+output_format_named(const char *name) {
+    for (int f = 0; f < NUM_OUTPUT_FORMATS; f++) {
+        if (strcmp(name, format_names[f]) == 0) {
+            return f;
+        }
+    }
+    return -1;
+}
+
+const char *
+output_format_extension(enum output_format format) {
+    return format_extensions[format];
+}
+
+bool_t
+output_format_coloured(enum output_format format) {
+    return format != OUTPUT_PLAIN;
+}
+
+/* Fills rgb with the mean colour of each cell of a rows x cols grid over img,
+ * three bytes a cell; grayscale images give grays.  Each row of cells is
+ * summed through an integral image of just that strip, which keeps the sums
+ * in 32 bits and the scratch image small however big img is.
+ */
+void
+cell_colours(const IplImage *img, int rows, int cols, unsigned char *rgb) {
+    int char_width = img->width / cols, char_height = img->height / rows;
+    int nch = img->nChannels, area = char_width * char_height;
+    IplImage strip, *sum;
+
+    if (area == 0) {
+        memset(rgb, 0, (size_t)rows * cols * 3);
+        return;
+    }
+
+    TRACE_SCOPE("colours");
+    sum = cvCreateImage(cvSize(img->width + 1, char_height + 1), IPL_DEPTH_32S, nch);
+    for (int j = 0; j < rows; j++) {
+        cvInitImageHeader(&strip, cvSize(img->width, char_height), IPL_DEPTH_8U, nch, IPL_ORIGIN_TL, 4);
+        cvSetData(&strip, img->imageData + (size_t)j * char_height * img->widthStep, img->widthStep);
+        cvIntegral(&strip, sum, NULL, NULL);
+
+        /* The strip's bottom row of sums is all a row of cells needs. */
+        const int *bottom = (const int *)(sum->imageData + char_height * sum->widthStep);
+        for (int i = 0; i < cols; i++) {
+            unsigned char *out = rgb + ((size_t)j * cols + i) * 3;
+            int mean[3];
+
+            for (int c = 0; c < nch && c < 3; c++) {
+                int s = bottom[(i + 1) * char_width * nch + c] - bottom[i * char_width * nch + c];
+                mean[c] = (s + area / 2) / area;
+            }
+            if (nch >= 3) {
+                /* OpenCV's images are BGR. */
+                out[0] = mean[2];
+                out[1] = mean[1];
+                out[2] = mean[0];
+            } else {
+                out[0] = out[1] = out[2] = mean[0];
+            }
+        }
+    }
+    cvReleaseImage(&sum);
+}
+
+void
+encoder_init(struct encoder *e, FILE *stream, enum output_format format) {
+    memset(e, 0, sizeof(*e));
+    e->stream = stream;
+    e->fd = fileno(stream);
+    e->format = format;
+}
+
+void
+encoder_free(struct encoder *e) {
+    free(e->buf);
+    free(e->segs);
+    memset(e, 0, sizeof(*e));
+}
+
+static void
+add_segment(struct encoder *e, const char *ext, size_t off, size_t len) {
+    struct encoder_segment *last = e->nsegs > 0 ? &e->segs[e->nsegs - 1] : NULL;
+
+    if (len == 0) {
+        return;
+    }
+    /* Consecutive stretches of the buffer are one segment. */
+    if (ext == NULL && last != NULL && last->ext == NULL && last->off + last->len == off) {
+        last->len += len;
+        return;
+    }
+    if (e->nsegs == e->maxsegs) {
+        e->maxsegs = e->maxsegs ? e->maxsegs * 2 : 64;
+        e->segs = xrealloc(e->segs, e->maxsegs * sizeof(*e->segs));
+    }
+    e->segs[e->nsegs++] = (struct encoder_segment){ ext, off, len };
+}
+
+/* Makes room for at least n more bytes in the buffer and returns where they go. */
+static char *
+reserve(struct encoder *e, size_t n) {
+    if (e->len + n > e->size) {
+        e->size = MAX(e->size * 2, e->len + n);
+        e->buf = xrealloc(e->buf, e->size);
+    }
+    return e->buf + e->len;
+}
+
+/* Appends the n bytes just written at reserve()'s pointer. */
+static void
+commit(struct encoder *e, size_t n) {
+    add_segment(e, NULL, e->len, n);
+    e->len += n;
+}
+
+static void
+append(struct encoder *e, const char *text, size_t n) {
+    memcpy(reserve(e, n), text, n);
+    commit(e, n);
+}
+
+/* Writes out everything queued, IOV_MAX segments per writev(). */
+void
+encoder_flush(struct encoder *e) {
+    struct iovec iov[IOV_MAX];
+    int first = 0;
+
+    if (e->nsegs == 0) {
+        return;
+    }
+
+    TRACE_SCOPE("write");
+    fflush(e->stream);
+    while (first < e->nsegs) {
+        int n = MIN(e->nsegs - first, IOV_MAX), k = 0;
+
+        for (int i = 0; i < n; i++) {
+            const struct encoder_segment *s = &e->segs[first + i];
+            iov[i].iov_base = (void *)(s->ext != NULL ? s->ext : e->buf + s->off);
+            iov[i].iov_len = s->len;
+        }
+        while (k < n) {
+            ssize_t done = writev(e->fd, iov + k, n - k);
+
+            if (done == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                xlog(LOG_ERR, "Can't write output: %s", strerror(errno));
+                k = n;
+                break;
+            }
+            e->written += done;
+            /* Skip whatever was written in full, and trim what wasn't. */
+            while (k < n && (size_t)done >= iov[k].iov_len) {
+                done -= iov[k++].iov_len;
+            }
+            if (k < n) {
+                iov[k].iov_base = (char *)iov[k].iov_base + done;
+                iov[k].iov_len -= done;
+            }
+        }
+        first += n;
+    }
+    e->nsegs = 0;
+    e->len = 0;
+}
+
+static void
+maybe_flush(struct encoder *e) {
+    if (e->len >= ENCODER_FLUSH_BYTES || e->nsegs >= IOV_MAX) {
+        encoder_flush(e);
+    }
+}
+
+/* Escapes are built by hand rather than with printf. */
+static char *
+put_decimal(char *p, unsigned v) {
+    char digits[10];
+    int n = 0;
+
+    do {
+        digits[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v > 0);
+    while (n > 0) {
+        *p++ = digits[--n];
+    }
+    return p;
+}
+
+/* "\033[38;2;r;g;bm", at most 19 bytes. */
+static char *
+put_colour(char *p, const unsigned char *c) {
+    memcpy(p, "\033[38;2;", 7);
+    p = put_decimal(p + 7, c[0]);
+    *p++ = ';';
+    p = put_decimal(p, c[1]);
+    *p++ = ';';
+    p = put_decimal(p, c[2]);
+    *p++ = 'm';
+    return p;
+}
+
+static const char hex[] = "0123456789abcdef";
+
+/* One row in ANSI colour.  Escapes are only emitted when the colour changes,
+ * and blanks, whose colour can't be seen, don't change it.
+ */
+static void
+ansi_row(struct encoder *e, const char *line, const unsigned char *rgb, int cols) {
+    /* Worst case "\033[38;2;255;255;255m" and the glyph per cell. */
+    char *start = reserve(e, (size_t)cols * 20 + 8), *p = start;
+    int last = -1;
+
+    for (int i = 0; i < cols; i++) {
+        const unsigned char *c = rgb + i * 3;
+        int packed = c[0] << 16 | c[1] << 8 | c[2];
+
+        if (line[i] != ' ' && packed != last) {
+            p = put_colour(p, c);
+            last = packed;
+        }
+        *p++ = line[i];
+    }
+    memcpy(p, "\033[0m\n", 5);
+    commit(e, p + 5 - start);
+}
+
+/* One row of HTML, a span per run of cells of the same colour. */
+static void
+html_row(struct encoder *e, const char *line, const unsigned char *rgb, int cols) {
+    /* Worst case a span ("<span style=\"color:#rrggbb\">" and "</span>") and
+     * an escaped glyph per cell.
+     */
+    char *start = reserve(e, (size_t)cols * 40 + 8), *p = start;
+    int last = -1;
+
+    for (int i = 0; i < cols; i++) {
+        if (rgb != NULL && line[i] != ' ') {
+            const unsigned char *c = rgb + i * 3;
+            int packed = c[0] << 16 | c[1] << 8 | c[2];
+
+            if (packed != last) {
+                if (last != -1) {
+                    memcpy(p, "</span>", 7);
+                    p += 7;
+                }
+                memcpy(p, "<span style=\"color:#", 20);
+                p += 20;
+                for (int k = 0; k < 3; k++) {
+                    *p++ = hex[c[k] >> 4];
+                    *p++ = hex[c[k] & 15];
+                }
+                memcpy(p, "\">", 2);
+                p += 2;
+                last = packed;
+            }
+        }
+        switch (line[i]) {
+            case '&':
+                memcpy(p, "&amp;", 5);
+                p += 5;
+                break;
+            case '<':
+                memcpy(p, "&lt;", 4);
+                p += 4;
+                break;
+            case '>':
+                memcpy(p, "&gt;", 4);
+                p += 4;
+                break;
+            default:
+                *p++ = line[i];
+        }
+    }
+    if (last != -1) {
+        memcpy(p, "</span>", 7);
+        p += 7;
+    }
+    *p++ = '\n';
+    commit(e, p - start);
+}
+
+static void
+append_escaped(struct encoder *e, const char *text) {
+    for (; *text != '\0'; text++) {
+        const char *entity = *text == '&' ? "&amp;" : *text == '<' ? "&lt;" : *text == '>' ? "&gt;" : NULL;
+
+        if (entity != NULL) {
+            append(e, entity, strlen(entity));
+        } else {
+            append(e, text, 1);
+        }
+    }
+}
+
+/* Starts a document; only HTML has anything to say here. */
+void
+encoder_begin(struct encoder *e) {
+    static const char prologue[] =
+        "<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\"><title>asciimatic</title></head>\n"
+        "<body style=\"background:#000;color:#ccc\">\n";
+
+    if (e->format == OUTPUT_HTML) {
+        add_segment(e, prologue, 0, sizeof(prologue) - 1);
+    }
+}
+
+/* Runs of changed cells at most this far apart are drawn as one, unchanged
+ * cells and all, since moving the cursor over them costs about as much.
+ */
+#define SCREEN_MERGE_GAP 4
+
+static bool_t
+cell_changed(const struct screen *s, size_t idx, char c, const unsigned char *rgb) {
+    if (s->chars[idx] != c) {
+        return true;
+    }
+    /* A blank looks the same in any colour. */
+    return rgb != NULL && c != ' ' && memcmp(s->rgb + idx * 3, rgb + idx * 3, 3) != 0;
+}
+
+/* Moves the cursor to row, col: forward along the row if it's already on it,
+ * or else to an absolute position.
+ */
+static char *
+put_move(char *p, struct screen *s, int row, int col) {
+    if (row == s->row && col == s->col) {
+        return p;
+    }
+    memcpy(p, "\033[", 2);
+    if (row == s->row && col > s->col && s->col < s->cols) {
+        p = put_decimal(p + 2, col - s->col);
+        *p++ = 'C';
+    } else {
+        p = put_decimal(p + 2, row + 1);
+        *p++ = ';';
+        p = put_decimal(p, col + 1);
+        *p++ = 'H';
+    }
+    s->row = row;
+    s->col = col;
+    return p;
+}
+
+/* Draws a grid on a terminal showing s, as cursor moves and the runs of cells
+ * that changed, coloured from rgb in ANSI format.  The first frame, and any
+ * frame of a different size, clears the terminal first.  The whole frame goes
+ * out in one write; e->written says how big it was, and s->changed how many
+ * cells it redrew.
+ */
+void
+encoder_frame(struct encoder *e, struct screen *s, const char *grid, const unsigned char *rgb,
+              int rows, int cols) {
+    size_t stride = cols + 1;
+
+    TRACE_SCOPE("output");
+    if (e->format != OUTPUT_ANSI) {
+        rgb = NULL;
+    }
+    if (s->rows != rows || s->cols != cols) {
+        s->chars = xrealloc(s->chars, (size_t)rows * cols);
+        s->rgb = xrealloc(s->rgb, (size_t)rows * cols * 3);
+        memset(s->chars, ' ', (size_t)rows * cols);
+        memset(s->rgb, 0, (size_t)rows * cols * 3);
+        s->rows = rows;
+        s->cols = cols;
+        s->fg = -1;
+        s->row = s->col = 0;
+        encoder_text(e, "\033[?25l\033[0m\033[H\033[2J");
+    }
+
+    s->changed = 0;
+    for (int j = 0; j < rows; j++) {
+        const char *line = grid + j * stride;
+        const unsigned char *rowrgb = rgb != NULL ? rgb + (size_t)j * cols * 3 : NULL;
+        size_t base = (size_t)j * cols;
+        int i = 0;
+
+        for (;;) {
+            while (i < cols && !cell_changed(s, base + i, line[i], rgb)) {
+                i++;
+            }
+            if (i == cols) {
+                break;
+            }
+
+            /* Extend the run over changes no more than SCREEN_MERGE_GAP apart. */
+            int end = i + 1, gap = 0;
+            for (int k = i + 1; k < cols && gap < SCREEN_MERGE_GAP; k++) {
+                if (cell_changed(s, base + k, line[k], rgb)) {
+                    end = k + 1;
+                    gap = 0;
+                } else {
+                    gap++;
+                }
+            }
+
+            /* Worst case a move, and a colour and a glyph per cell. */
+            char *start = reserve(e, (size_t)(end - i) * 20 + 32), *p = start;
+            p = put_move(p, s, j, i);
+            for (int k = i; k < end; k++) {
+                size_t idx = base + k;
+
+                s->changed += cell_changed(s, idx, line[k], rgb);
+                if (rowrgb != NULL && line[k] != ' ') {
+                    const unsigned char *c = rowrgb + k * 3;
+                    int packed = c[0] << 16 | c[1] << 8 | c[2];
+
+                    if (packed != s->fg) {
+                        p = put_colour(p, c);
+                        s->fg = packed;
+                    }
+                    memcpy(s->rgb + idx * 3, c, 3);
+                }
+                *p++ = line[k];
+                s->chars[idx] = line[k];
+            }
+            commit(e, p - start);
+            s->col = end;
+            i = end;
+        }
+    }
+    encoder_flush(e);
+}
+
+/* Leaves the terminal as it was found, with the cursor under the grid, and
+ * frees s.
+ */
+void
+encoder_screen_end(struct encoder *e, struct screen *s) {
+    if (s->rows > 0) {
+        char *start = reserve(e, 32), *p = start;
+
+        memcpy(p, "\033[0m\033[", 6);
+        p = put_decimal(p + 6, s->rows + 1);
+        memcpy(p, ";1H\033[?25h", 9);
+        commit(e, p + 9 - start);
+        encoder_flush(e);
+    }
+    free(s->chars);
+    free(s->rgb);
+    memset(s, 0, sizeof(*s));
+}
+
+void
+encoder_end(struct encoder *e) {
+    static const char epilogue[] = "</body></html>\n";
+
+    if (e->format == OUTPUT_HTML) {
+        add_segment(e, epilogue, 0, sizeof(epilogue) - 1);
+    }
+    encoder_flush(e);
+}
+
+/* Names the grid that follows, as "==> title <==" or an HTML heading. */
+void
+encoder_title(struct encoder *e, const char *title) {
+    if (e->format == OUTPUT_HTML) {
+        append(e, "<h3>", 4);
+        append_escaped(e, title);
+        append(e, "</h3>\n", 6);
+    } else {
+        append(e, "==> ", 4);
+        append(e, title, strlen(title));
+        append(e, " <==\n", 5);
+    }
+}
+
+/* Queues text as is, e.g. a terminal escape between frames. */
+void
+encoder_text(struct encoder *e, const char *text) {
+    append(e, text, strlen(text));
+}
+
+/* Writes a grid of rows newline-terminated lines of cols characters, coloured
+ * from rgb (three bytes a cell, as from cell_colours()) if the format is and
+ * rgb isn't NULL.  grid need only last the call: it is written before this
+ * returns.
+ */
+void
+encoder_grid(struct encoder *e, const char *grid, const unsigned char *rgb, int rows, int cols) {
+    size_t stride = cols + 1;
+
+    TRACE_SCOPE("output");
+    switch (e->format) {
+        case OUTPUT_ANSI:
+            if (rgb != NULL) {
+                for (int j = 0; j < rows; j++) {
+                    ansi_row(e, grid + j * stride, rgb + (size_t)j * cols * 3, cols);
+                    maybe_flush(e);
+                }
+                break;
+            }
+            /* FALLTHROUGH: nothing to colour with */
+        case OUTPUT_PLAIN:
+        default:
+            add_segment(e, grid, 0, rows * stride);
+            break;
+        case OUTPUT_HTML:
+            encoder_text(e, "<pre style=\"font-family:monospace;line-height:1\">\n");
+            for (int j = 0; j < rows; j++) {
+                html_row(e, grid + j * stride, rgb != NULL ? rgb + (size_t)j * cols * 3 : NULL, cols);
+                maybe_flush(e);
+            }
+            encoder_text(e, "</pre>\n");
+            break;
+    }
+    encoder_flush(e);
+}
@@ -0,0 +1,67 @@
+#ifndef _ENCODER_H_
+#define _ENCODER_H_
+
+#include <stdio.h>
+
+#include <opencv/cv.h>
+
+#include "main.h"
+
+enum output_format {
+    OUTPUT_PLAIN,
+    OUTPUT_ANSI,        /* 24-bit colour escapes, a cell's mean colour per glyph */
+    OUTPUT_HTML,        /* a <pre> of coloured spans per grid */
+    NUM_OUTPUT_FORMATS
+};
+
+/* Builds output in a buffer of its own and writes it straight to a stream's
+ * file descriptor with writev(), a grid or more at a time, rather than going
+ * through stdio a character at a time.  Plain grids aren't copied at all.
+ */
+struct encoder_segment {
+    const char *ext;    /* the caller's bytes, or NULL for buf + off */
+    size_t off, len;
+};
+
+struct encoder {
+    FILE *stream;       /* flushed before each write, to keep stdio output in order */
+    int fd;
+    enum output_format format;
+    char *buf;
+    size_t len, size;
+    struct encoder_segment *segs;
+    int nsegs, maxsegs;
+    size_t written;     /* bytes written so far */
+};
+
+/* What a terminal is showing, so that each frame can be drawn as just the
+ * cells that changed since the last one.
+ */
+struct screen {
+    int rows, cols;         /* 0 until the first frame clears the terminal */
+    char *chars;            /* rows x cols glyphs, without newlines */
+    unsigned char *rgb;     /* the colour each was drawn in */
+    int fg;                 /* the terminal's current colour, or -1 for its default */
+    int row, col;           /* where the cursor is */
+    int changed;            /* cells that differed in the last frame */
+};
+
+int output_format_named(const char *name);
+const char *output_format_extension(enum output_format format);
+bool_t output_format_coloured(enum output_format format);
+
+void cell_colours(const IplImage *img, int rows, int cols, unsigned char *rgb);
+
+void encoder_init(struct encoder *e, FILE *stream, enum output_format format);
+void encoder_begin(struct encoder *e);
+void encoder_title(struct encoder *e, const char *title);
+void encoder_text(struct encoder *e, const char *text);
+void encoder_grid(struct encoder *e, const char *grid, const unsigned char *rgb, int rows, int cols);
+void encoder_frame(struct encoder *e, struct screen *s, const char *grid, const unsigned char *rgb,
+                   int rows, int cols);
+void encoder_screen_end(struct encoder *e, struct screen *s);
+void encoder_end(struct encoder *e);
+void encoder_flush(struct encoder *e);
+void encoder_free(struct encoder *e);
+
+#endif
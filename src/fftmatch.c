@@ -0,0 +1,432 @@
+/* fftmatch.c
+ * Template matching through spectral products of cells and glyphs.
+ *
+ * Copyright (c) 2014 Nathan Taylor <nbtaylor@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <opencv/cv.h>
+
+#include "fftmatch.h"
+#include "kernels.h"
+#include "logging.h"
+#include "matcher.h"
+#include "templates.h"
+#include "trace.h"
+#include "utils.h"
+
+#define ALIGNMENT 32
+
+struct fft_bank *
+fft_bank_create(IplImage **templates, const char *charset, int w, int h) {
+    struct fft_bank *bank = xcalloc(1, sizeof(*bank));
+    CvMat *padded;
+    int g, x, y;
+
+    bank->count = strlen(charset);
+    bank->width = w;
+    bank->height = h;
+    bank->rows = cvGetOptimalDFTSize(2 * h);
+    bank->cols = cvGetOptimalDFTSize(2 * w);
+
+    size_t glyph_doubles = (size_t)bank->rows * bank->cols;
+    bank->pixels = xaligned_alloc(ALIGNMENT, bank->count * glyph_doubles * sizeof(double));
+    bank->spectra = xcalloc(bank->count, sizeof(CvMat));
+    bank->sqsum = xcalloc(bank->count, sizeof(double));
+
+    /* Glyphs sit in the top left corner; only their first h rows are nonzero,
+     * which saves the transform half its row passes.
+     */
+    padded = cvCreateMat(bank->rows, bank->cols, CV_64FC1);
+    cvSetZero(padded);
+    for (g = 0; g < bank->count; g++) {
+        const IplImage *t = templates[g];
+
+        for (y = 0; y < h; y++) {
+            const unsigned char *row = (const unsigned char *)t->imageData + y * t->widthStep;
+            double *dst = padded->data.db + y * bank->cols;
+
+            for (x = 0; x < w; x++) {
+                dst[x] = row[x];
+                bank->sqsum[g] += (double)row[x] * row[x];
+            }
+        }
+        cvInitMatHeader(&bank->spectra[g], bank->rows, bank->cols, CV_64FC1,
+                        bank->pixels + g * glyph_doubles, CV_AUTOSTEP);
+        cvDFT(padded, &bank->spectra[g], CV_DXT_FORWARD, h);
+    }
+    cvReleaseMat(&padded);
+
+    return bank;
+}
+
+void
+fft_bank_destroy(struct fft_bank *bank) {
+    if (bank == NULL) {
+        return;
+    }
+    free(bank->pixels);
+    free(bank->spectra);
+    free(bank->sqsum);
+    free(bank);
+}
+
+static void
+scratch_mat(CvMat *m, const struct fft_bank *bank, struct arena *arena) {
+    void *data = arena_alloc(arena, (size_t)bank->rows * bank->cols * sizeof(double), ALIGNMENT);
+
+    cvInitMatHeader(m, bank->rows, bank->cols, CV_64FC1, data, CV_AUTOSTEP);
+}
+
+/* As with match_scratch_init(), everything comes back zeroed and only the
+ * cell's interior is written afterwards, so the padding stays zero.
+ */
+void
+fft_scratch_init(struct fft_scratch *s, const struct fft_bank *bank, struct arena *arena) {
+    int w = bank->width, h = bank->height;
+
+    scratch_mat(&s->cell, bank, arena);
+    scratch_mat(&s->spectrum, bank, arena);
+    scratch_mat(&s->product, bank, arena);
+    scratch_mat(&s->corr, bank, arena);
+    s->sqint = arena_alloc(arena, (size_t)(2 * h + 1) * (2 * w + 1) * sizeof(double), sizeof(double));
+}
+
+/* Picks the same glyph as atlas_match() does: the cell is bordered the same
+ * way, and each glyph's cross-correlation at every offset is scored and
+ * reduced with the same sqdiff_normed() and glyph_score().  Where the atlas
+ * spends a multiply-add per lit template pixel per offset, this transforms the
+ * cell once and then costs one spectral product and one inverse transform per
+ * glyph, which wins once cells are big enough.
+ *
+ * Pixels are integers, so every true cross-correlation is too; rounding the
+ * transform's result recovers it exactly.
+ */
+int
+fft_match(const struct fft_bank *bank, struct fft_scratch *s, const unsigned char *cell, int step,
+          const int *cands, int ncands) {
+    int w = bank->width, h = bank->height;
+    int cw = 2 * w + 1;
+    int c, g, x, y;
+
+    if (cands == NULL) {
+        ncands = bank->count;
+    }
+
+    for (y = 0; y < h; y++) {
+        const unsigned char *row = cell + y * step;
+        double *dst = s->cell.data.db + (y + h / 2) * bank->cols + w / 2;
+
+        for (x = 0; x < w; x++) {
+            dst[x] = row[x];
+        }
+    }
+    for (y = 0; y < 2 * h; y++) {
+        const double *row = s->cell.data.db + y * bank->cols;
+        double *ip = s->sqint + (y + 1) * cw;
+        double rowsum = 0;
+
+        for (x = 0; x < 2 * w; x++) {
+            rowsum += row[x] * row[x];
+            ip[x + 1] = ip[x + 1 - cw] + rowsum;
+        }
+    }
+
+    /* Nothing below the cell's last row is nonzero. */
+    cvDFT(&s->cell, &s->spectrum, CV_DXT_FORWARD, h / 2 + h);
+
+    for (c = 0; c < ncands; c++) {
+        g = cands != NULL ? cands[c] : c;
+        double tsq = bank->sqsum[g];
+        double tnorm = sqrt(tsq);
+        float lo = FLT_MAX, hi = -FLT_MAX;
+
+        /* A blank glyph's response is 1 everywhere, so it never scores. */
+        if (tsq == 0) {
+            continue;
+        }
+
+        /* Correlation is the product with the glyph's conjugate; only the
+         * first h + 1 rows of offsets are wanted back.
+         */
+        cvMulSpectrums(&s->spectrum, &bank->spectra[g], &s->product, CV_DXT_MUL_CONJ);
+        cvDFT(&s->product, &s->corr, CV_DXT_INV_SCALE, h + 1);
+
+        for (y = 0; y <= h; y++) {
+            const double *top = s->sqint + y * cw;
+            const double *bot = s->sqint + (y + h) * cw;
+            const double *corr = s->corr.data.db + y * bank->cols;
+
+            for (x = 0; x <= w; x++) {
+                double wnd = bot[x + w] - bot[x] - top[x + w] + top[x];
+                float r = sqdiff_normed(wnd, rint(corr[x]), tsq, tnorm);
+
+                lo = MIN(lo, r);
+                hi = MAX(hi, r);
+            }
+        }
+
+        if (glyph_score(lo, hi) > 0) {
+            return g;
+        }
+    }
+
+    return cands != NULL ? cands[0] : 0;
+}
+
+/* Cell sizes the calibration times, smallest first. */
+static const int ladder[][2] = {
+    {8, 16}, {12, 24}, {16, 32}, {24, 48}, {32, 64}, {48, 96}, {64, 128}
+};
+#define LADDER_SIZE (int)(sizeof(ladder) / sizeof(ladder[0]))
+
+/* Long enough per matcher per size for the clock to mean something. */
+#define CALIBRATION_NS 4000000
+
+/* Nanoseconds per cell for one matcher, matching every glyph of the bank as a
+ * cell in turn until CALIBRATION_NS have passed.  Glyphs are edge-like, and
+ * like real cells most of them stop at the first glyph with any contrast.
+ */
+static double
+time_matcher(const struct template_bank *bank, int count, const struct glyph_atlas *atlas,
+             struct match_scratch *ms, const struct fft_bank *fft, struct fft_scratch *fs) {
+    uint64_t start = trace_now(), elapsed;
+    long cells = 0;
+
+    do {
+        for (int g = 0; g < count; g++) {
+            const IplImage *t = bank->templates[g];
+
+            if (atlas != NULL) {
+                atlas_match(atlas, ms, (const unsigned char *)t->imageData, t->widthStep, NULL, 0);
+            } else {
+                fft_match(fft, fs, (const unsigned char *)t->imageData, t->widthStep, NULL, 0);
+            }
+        }
+        cells += count;
+        elapsed = trace_now() - start;
+    } while (elapsed < CALIBRATION_NS);
+
+    return (double)elapsed / cells;
+}
+
+/* Crossovers measured so far, one per character set and font. */
+struct calibration {
+    struct calibration *next;
+    char *charset, *font;
+    int crossover;
+};
+
+static pthread_mutex_t calibration_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct calibration *calibrations;
+
+/* Saved crossovers are ignored unless they were measured by this version of
+ * the calibration; bump it whenever either matcher gets faster or slower.
+ */
+#define CALIBRATION_VERSION 1
+#define CALIBRATION_MAGIC "asciimatic-fft-crossover"
+
+/* Crossovers are saved next to the template banks, one file per character
+ * set, font and CPU level; the name only needs to tell those apart, since
+ * the file is checked in full on load.
+ */
+static char *
+calibration_path(const char *cache_dir, const char *charset, const char *font) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    const char *parts[] = {charset, font};
+    char *path;
+
+    for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+        for (const char *p = parts[i]; ; p++) {
+            hash = (hash ^ (unsigned char)*p) * 0x100000001b3ULL;
+            if (*p == '\0') {
+                break;
+            }
+        }
+    }
+    if (asprintf(&path, "%s/fft-%s-%016llx.crossover", cache_dir, cpu_level_name(cpu_level()),
+                 (unsigned long long)hash) == -1) {
+        panic(1, "Can't allocate space for asprintf()");
+    }
+    return path;
+}
+
+/* Reads a line into buf, without its newline; false at EOF or if it's too
+ * long.
+ */
+static bool_t
+read_line(FILE *f, char *buf, size_t size) {
+    size_t len;
+
+    if (fgets(buf, size, f) == NULL || (len = strlen(buf)) == 0 || buf[len - 1] != '\n') {
+        return false;
+    }
+    buf[len - 1] = '\0';
+    return true;
+}
+
+/* The crossover saved at path for this character set, font and CPU level, or
+ * -1 if there's none or it was measured for something else.
+ */
+static int
+calibration_load(const char *path, const char *charset, const char *font) {
+    char level[32], saved_charset[1024], saved_font[1024];
+    int version, crossover;
+    FILE *f;
+
+    if ((f = fopen(path, "r")) == NULL) {
+        return -1;
+    }
+    bool_t ok = fscanf(f, CALIBRATION_MAGIC " %d %31s %d", &version, level, &crossover) == 3 &&
+                fgetc(f) == '\n' &&
+                read_line(f, saved_charset, sizeof(saved_charset)) &&
+                read_line(f, saved_font, sizeof(saved_font));
+    fclose(f);
+
+    if (!ok || version != CALIBRATION_VERSION || crossover < FFT_MIN_AREA ||
+            strcmp(level, cpu_level_name(cpu_level())) != 0 ||
+            strcmp(saved_charset, charset) != 0 || strcmp(saved_font, font) != 0) {
+        xlog(LOG_WARNING, "Ignoring stale or mismatched FFT calibration %s", path);
+        return -1;
+    }
+    return crossover;
+}
+
+/* Writes the crossover out under a temporary name and renames it into place,
+ * so a concurrent reader never sees a partial file.
+ */
+static void
+calibration_save(const char *cache_dir, const char *path, const struct calibration *c) {
+    char *tmp_path;
+    FILE *f;
+
+    if (make_dirs(cache_dir) == -1) {
+        xlog(LOG_WARNING, "Can't create template cache %s: %s", cache_dir, strerror(errno));
+        return;
+    }
+    if (asprintf(&tmp_path, "%s.%d.tmp", path, getpid()) == -1) {
+        panic(1, "Can't allocate space for asprintf()");
+    }
+    if ((f = fopen(tmp_path, "w")) == NULL) {
+        xlog(LOG_WARNING, "Can't write FFT calibration %s: %s", tmp_path, strerror(errno));
+        free(tmp_path);
+        return;
+    }
+
+    bool_t ok = fprintf(f, CALIBRATION_MAGIC " %d %s %d\n%s\n%s\n", CALIBRATION_VERSION,
+                        cpu_level_name(cpu_level()), c->crossover, c->charset, c->font) > 0;
+
+    if (fclose(f) != 0 || !ok || rename(tmp_path, path) == -1) {
+        xlog(LOG_WARNING, "Can't write FFT calibration %s: %s", path, strerror(errno));
+        unlink(tmp_path);
+    }
+    free(tmp_path);
+}
+
+/* Times both matchers over the ladder of cell sizes with this character set
+ * and font, and returns the smallest area from which the FFT is faster at that
+ * size and every bigger one.  This takes a good fraction of a second, so it
+ * belongs where a pipeline is set up; it runs once per process for each
+ * character set and font, and later calls get the first answer.  With a cache
+ * directory, the answer is also saved there for this CPU level, and later
+ * processes read it back instead of measuring again.
+ */
+int
+fft_crossover(const char *cache_dir, const char *charset, const char *font) {
+    double atlas_ns[LADDER_SIZE], fft_ns[LADDER_SIZE];
+    int count = strlen(charset);
+    struct calibration *c;
+    char *path = NULL;
+    int i;
+
+    pthread_mutex_lock(&calibration_lock);
+    for (c = calibrations; c != NULL; c = c->next) {
+        if (strcmp(c->charset, charset) == 0 && strcmp(c->font, font) == 0) {
+            pthread_mutex_unlock(&calibration_lock);
+            return c->crossover;
+        }
+    }
+
+    c = xmalloc(sizeof(*c));
+    c->charset = xstrdup(charset);
+    c->font = xstrdup(font);
+    c->next = calibrations;
+
+    if (cache_dir != NULL && *cache_dir != '\0') {
+        path = calibration_path(cache_dir, charset, font);
+        if ((c->crossover = calibration_load(path, charset, font)) != -1) {
+            xlog(LOG_DEBUG, "Read the FFT crossover from %s", path);
+            free(path);
+            calibrations = c;
+            pthread_mutex_unlock(&calibration_lock);
+            return c->crossover;
+        }
+    }
+
+    TRACE_SCOPE("fft calibration");
+    for (i = 0; i < LADDER_SIZE; i++) {
+        int w = ladder[i][0], h = ladder[i][1];
+        struct template_bank *bank = template_bank_get(cache_dir, charset, font, w, h);
+        struct glyph_atlas *atlas = atlas_create(bank->templates, charset, w, h);
+        struct fft_bank *fft = fft_bank_create(bank->templates, charset, w, h);
+        struct match_scratch ms;
+        struct fft_scratch fs;
+        struct arena arena;
+
+        arena_init(&arena);
+        match_scratch_init(&ms, atlas, &arena);
+        fft_scratch_init(&fs, fft, &arena);
+
+        atlas_ns[i] = time_matcher(bank, count, atlas, &ms, NULL, NULL);
+        fft_ns[i] = time_matcher(bank, count, NULL, NULL, fft, &fs);
+        xlog(LOG_DEBUG, "%dx%d cells: %.1fus with the atlas, %.1fus through the FFT",
+             w, h, atlas_ns[i] / 1000, fft_ns[i] / 1000);
+
+        arena_free(&arena);
+        fft_bank_destroy(fft);
+        atlas_destroy(atlas);
+        template_bank_free(bank);
+    }
+
+    c->crossover = INT_MAX;
+    for (i = LADDER_SIZE - 1; i >= 0 && fft_ns[i] < atlas_ns[i]; i--) {
+        c->crossover = ladder[i][0] * ladder[i][1];
+    }
+    if (c->crossover == INT_MAX) {
+        xlog(LOG_INFO, "The FFT matcher is slower at every cell size up to %dx%d",
+             ladder[LADDER_SIZE - 1][0], ladder[LADDER_SIZE - 1][1]);
+    } else {
+        xlog(LOG_INFO, "Matching cells of %d pixels or more through the FFT", c->crossover);
+    }
+    if (path != NULL) {
+        calibration_save(cache_dir, path, c);
+        free(path);
+    }
+    calibrations = c;
+
+    pthread_mutex_unlock(&calibration_lock);
+    return c->crossover;
+}
@@ -0,0 +1,51 @@
+#ifndef _FFTMATCH_H_
+#define _FFTMATCH_H_
+
+#include <opencv/cv.h>
+
+#include "utils.h"
+
+/* Every glyph's spectrum, computed once per template bank.  Each template is
+ * zero-padded to rows x cols, at least 2h x 2w so that no offset the matcher
+ * scores wraps around, and transformed into OpenCV's packed (CCS) layout.
+ */
+struct fft_bank {
+    int count;
+    int width, height;
+    int rows, cols;          /* DFT size */
+    double *pixels;          /* count spectra of rows * cols, back to back */
+    CvMat *spectra;          /* a header over each */
+    double *sqsum;           /* sum of squared pixels, per glyph */
+};
+
+/* Per-worker state for matching one cell at a time through the FFT.  The
+ * matrices are headers over arena memory.
+ */
+struct fft_scratch {
+    CvMat cell;              /* the cell, zero-padded to rows x cols */
+    CvMat spectrum;          /* ... and its transform */
+    CvMat product;           /* the cell's spectrum times one glyph's */
+    CvMat corr;              /* ... transformed back */
+    double *sqint;           /* (2h + 1) x (2w + 1) integral of squared cell */
+};
+
+struct fft_bank *fft_bank_create(IplImage **templates, const char *charset, int w, int h);
+void fft_bank_destroy(struct fft_bank *bank);
+
+void fft_scratch_init(struct fft_scratch *s, const struct fft_bank *bank, struct arena *arena);
+
+int fft_match(const struct fft_bank *bank, struct fft_scratch *s, const unsigned char *cell, int step,
+              const int *cands, int ncands);
+
+/* Cells smaller than this are never worth transforming, and don't trigger a
+ * calibration run.
+ */
+#define FFT_MIN_AREA (8 * 16)
+
+/* The smallest cell area, in pixels, from which fft_match() beats
+ * atlas_match(), or INT_MAX if it never does.  Measured once per process, and
+ * kept in cache_dir (if not NULL or "") for later ones.
+ */
+int fft_crossover(const char *cache_dir, const char *charset, const char *font);
+
+#endif
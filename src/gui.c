@@ -27,29 +27,42 @@
 #include "asciimatic.h"
 #include "logging.h"
 #include "main.h"
+#include "pipeline.h"
 #include "utils.h"
 
 /* Clobal config stuff */
 extern config_t config;
 
-extern IplImage *src;
-extern int first_thresh;
-extern int second_thresh;
+extern int output_rows;
+extern int output_cols;
 
-/* GUI painting state */
+/* GUI painting state.  Nothing is recomputed or redrawn unless one of these
+ * says it has to be.
+ */
 static int lbutton_down = 0; //default to up
-static int dirty = 1; /* Only repaint if there's something to repaint */
+static int edges_dirty = 1;     /* thresholds changed; rerun hysteresis */
+static int cells_dirty = 0;     /* the eraser touched some cells */
+static int window_dirty = 1;    /* edges changed; show them again */
+static bool_t edges_edited = false;     /* erased since they were detected */
 
 static const char *window_name = "Asciimatic";
+static const char *preview_name = "Asciimatic preview";
 
-IplImage *edges;
-
+static IplImage *edges;
 
+/* The live ASCII preview: the grid as of the last update, as last drawn, and
+ * drawn with the glyph templates.
+ */
+static struct cell_cache cells;
+static char *grid;
+static char *shown;
+static IplImage *preview;
+static bool_t preview_drawn;
 
 static void
 on_trackbar(int val) {
     (void)val;
-    dirty = 1;
+    edges_dirty = 1;
 }
 
 static void
@@ -64,12 +77,10 @@ on_mouse(int event, int x, int y, int flags, void *p) {
         lbutton_down = 0;
     }
 
-    if (!lbutton_down) {
+    if (!lbutton_down || edges == NULL) {
         return;
     }
 
-    dirty = 0;
-
     CvRect roi = cvRect(
             MAX(x-11, 0), 
             MAX(y-11, 0), 
@@ -77,6 +88,11 @@ on_mouse(int event, int x, int y, int flags, void *p) {
     cvSetImageROI(edges, roi);
     cvSetZero(edges);
     cvResetImageROI(edges);
+
+    cell_cache_touch(&cells, roi);
+    edges_edited = true;
+    cells_dirty = 1;
+    window_dirty = 1;
 }
 
 void
@@ -94,24 +110,74 @@ init_gui() {
     cvCreateTrackbar("low_th", window_name, &first_thresh, max_thresh1, on_trackbar);
     cvCreateTrackbar("high_th", window_name, &second_thresh, max_thresh2, on_trackbar);
     cvSetMouseCallback(window_name, on_mouse, NULL);
+    cvNamedWindow(preview_name, CV_WINDOW_NORMAL);
+
+    cell_cache_init(&cells);
+    grid = xmalloc(output_rows * (output_cols + 1));
+    shown = xmalloc(output_rows * (output_cols + 1));
+    preview = cvCreateImage(cvSize(src->width / output_cols * output_cols,
+                                   src->height / output_rows * output_rows),
+                            IPL_DEPTH_8U, 1);
+}
+
+/* Brings the preview up to date with edges, matching only the cells that may
+ * have changed and drawing only the cells whose characters did.
+ */
+static void
+update_preview(bool_t rethresholded) {
+    if (rethresholded) {
+        /* Hysteresis can move edges anywhere, so let the hashes decide. */
+        asciify_grid_cached(pipeline, edges, output_rows, output_cols, grid, &cells);
+    } else {
+        asciify_grid_dirty(pipeline, edges, output_rows, output_cols, grid, &cells);
+    }
+    xlog(LOG_DEBUG, "Preview: %d cells matched, %d empty, %d reused", cells.matched, cells.empty, cells.reused);
+
+    render_grid(pipeline, preview, grid, preview_drawn ? shown : NULL, output_rows, output_cols);
+    preview_drawn = true;
+    memcpy(shown, grid, output_rows * (output_cols + 1));
+    cvShowImage(preview_name, preview);
 }
 
+/* cvWaitKey() is what runs the callbacks, so it still has to be called
+ * regularly; but work is only done when a callback has asked for it.
+ */
 void
 gui_loop() {
     char c;
 
     while ((c = cvWaitKey(50)) != 27) {
-        if (dirty) {
-            edges = detect_edges(edges, src);
+        bool_t rethresholded = edges_dirty;
+
+        /* The source never changes, only the thresholds, so only the
+         * first pass needs the full gradient computation.
+         */
+        if (edges_dirty) {
+            asciimatic_set_thresholds(pipeline, first_thresh, second_thresh);
+            edges = edges == NULL ? detect_edges(pipeline, edges, src) : redetect_edges(pipeline, edges);
+            edges_dirty = 0;
+            edges_edited = false;
+            window_dirty = 1;
+        }
+        if (rethresholded || cells_dirty) {
+            update_preview(rethresholded);
+            cells_dirty = 0;
+        }
+        if (window_dirty) {
+            cvShowImage(window_name, edges);
+            window_dirty = 0;
         }
-        cvShowImage(window_name, edges);
     }
     //TODO: make this nicer than just as we exit the loop
-    asciify(edges);
+    asciify(edges, edges_edited);
     cvReleaseImage(&edges);
 }
 
 void
 shutdown_gui() {
+    cell_cache_free(&cells);
+    free(grid);
+    free(shown);
+    cvReleaseImage(&preview);
     cvDestroyAllWindows();
 }
@@ -0,0 +1,56 @@
+/* kernels.c
+ * Which instruction set extensions the matching kernels may use.
+ *
+ * Copyright (c) 2014 Nathan Taylor <nbtaylor@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <pthread.h>
+
+#include "kernels.h"
+
+static enum cpu_level level = CPU_BASELINE;
+static pthread_once_t level_once = PTHREAD_ONCE_INIT;
+
+static void
+detect_level(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (!__builtin_cpu_supports("sse4.2") || !__builtin_cpu_supports("popcnt")) {
+        return;
+    }
+    level = CPU_SSE42;
+    if (!__builtin_cpu_supports("avx2")) {
+        return;
+    }
+    level = CPU_AVX2;
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+            __builtin_cpu_supports("avx512vl")) {
+        level = CPU_AVX512;
+    }
+#endif
+}
+
+enum cpu_level
+cpu_level(void) {
+    pthread_once(&level_once, detect_level);
+    return level;
+}
+
+const char *
+cpu_level_name(enum cpu_level l) {
+    static const char *names[] = {"scalar", "sse4.2", "avx2", "avx512"};
+
+    return names[l];
+}
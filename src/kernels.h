@@ -0,0 +1,28 @@
+#ifndef _KERNELS_H_
+#define _KERNELS_H_
+
+/* Cell geometries, as X(width, height), common enough to get matching kernels
+ * of their own with the cell size fixed at compile time: the usual terminal
+ * font cell sizes at typical output widths.  Any other size goes through the
+ * generic kernels.  Widths must stay below 16, so that a row of offsets fits in
+ * one AVX-512 register and a row of cell pixels in one 16-bit mask.
+ */
+#define FIXED_GEOMETRIES(X) \
+    X(6, 12)                \
+    X(8, 16)                \
+    X(10, 20)
+
+/* What the CPU can run, in increasing order; each level implies the ones
+ * below it.
+ */
+enum cpu_level {
+    CPU_BASELINE,       /* whatever the compiler targets by default */
+    CPU_SSE42,          /* SSE4.2 and POPCNT */
+    CPU_AVX2,
+    CPU_AVX512,         /* AVX-512 F, BW and VL */
+};
+
+enum cpu_level cpu_level(void);
+const char *cpu_level_name(enum cpu_level level);
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef _LIBASCIIMATIC_H_
+#define _LIBASCIIMATIC_H_
+
+#include <libconfig.h>
+
+/* libasciimatic: the edge detection and glyph matching pipeline, without the
+ * command line around it.
+ *
+ * Everything a pipeline keeps (its settings, worker pool, template banks and
+ * scratch buffers) hangs off a struct asciimatic.  Separate contexts share
+ * nothing and may be used concurrently from separate threads; any one context
+ * must only be used by one thread at a time.  Logging and tracing are
+ * process-wide, as are panics on running out of memory or on a corrupt tree
+ * model.
+ */
+struct asciimatic;
+
+struct asciimatic_options {
+    const char *charset;        /* glyphs to match against; required */
+    const char *font;           /* "sans-serif" if NULL */
+    const char *template_cache; /* NULL for the default, "" for none */
+    int threshold1, threshold2; /* Canny hysteresis thresholds */
+    const char *matcher;        /* opencv, atlas, bitset, descriptor, tree or fft */
+    int threads;                /* < 1 for one per online CPU */
+    int check_matcher;
+    int bitset_shift;
+    int empty_cell_pixels;
+    int prune_candidates;
+    int min_cell_width, min_cell_height;
+    const char *tree_model;     /* required by the tree matcher */
+    double tree_confidence;
+    int fft_crossover;          /* cell area from which atlas matching uses the
+                                 * FFT; 0 for never, < 0 (the default) to
+                                 * measure it when the pipeline is created, or
+                                 * read it from the template cache */
+};
+
+/* Receives a converted image a row at a time, in order.  text is len
+ * characters long and followed by a newline; it is only valid for the call.
+ */
+typedef void (*asciimatic_row_fn)(void *arg, int row, const char *text, int len);
+
+/* asciimatic_convert()'s failures. */
+#define ASCIIMATIC_EINVAL   -1  /* the image is too small for the grid */
+#define ASCIIMATIC_ETIME    -2  /* the deadline passed; nothing was emitted */
+
+void asciimatic_defaults(struct asciimatic_options *o);
+void asciimatic_options_from_config(const config_t *cfg, struct asciimatic_options *o);
+
+struct asciimatic *asciimatic_create(const struct asciimatic_options *o);
+void asciimatic_destroy(struct asciimatic *ctx);
+
+void asciimatic_set_thresholds(struct asciimatic *ctx, int threshold1, int threshold2);
+void asciimatic_set_deadline(struct asciimatic *ctx, int ms);
+int asciimatic_convert(struct asciimatic *ctx, const unsigned char *pixels, int width, int height, int stride,
+                       int cols, int rows, asciimatic_row_fn emit, void *arg);
+
+#endif
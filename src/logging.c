@@ -16,6 +16,7 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
@@ -30,21 +31,227 @@
 #include "utils.h"
 
 extern const char *__progname;
-extern config_t config;
-extern bool_t verbose_mode;
+
+bool_t verbose_mode; /* Log LOG_DEBUG messages, bounds checking, etc? */
 
 bool_t syslog_enabled;
 static FILE *logf = NULL;
 static bool_t initialised = false;
 
-bool_t init_logging() {
+/* Asynchronous logging.  Each thread formats its messages into a ring of its
+ * own, which only it writes and only the writer thread reads, so logging never
+ * takes a lock.  If a thread logs faster than the writer keeps up, its ring
+ * fills and further messages are dropped and counted rather than blocking it.
+ * Errors, and anything logged while the writer isn't running, are written
+ * synchronously, after everything queued before them.  A thread's ring is
+ * written out and freed when the thread exits.
+ */
+#define LOG_LINE_MAX 512
+#define WRITER_PERIOD_MS 20
+
+struct log_record {
+    unsigned long seq;
+    time_t when;
+    int prio;
+    char msg[LOG_LINE_MAX];
+};
+
+struct log_ring {
+    struct log_ring *next;
+    unsigned head;              /* next record to write out; the writer's */
+    unsigned tail;              /* next free record; the producer's */
+    unsigned long dropped;
+    struct log_record *records;
+};
+
+static bool_t async_running = false;
+static unsigned ring_size = 256;        /* a power of two */
+static struct log_ring *rings;
+static __thread struct log_ring *my_ring;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static unsigned long next_seq;
+static volatile time_t log_clock;       /* refreshed by the writer */
+static int log_pid;
+
+/* Serialises everything that writes to logf or syslog. */
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t writer;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_wake = PTHREAD_COND_INITIALIZER;
+static bool_t writer_quit;
+
+/* ctime() of the last timestamp written, so it's only formatted once a second. */
+static char *getlogdate(time_t tm) {
+    static time_t cached = -1;
+    static char date[32];
+
+    if (tm != cached) {
+        ctime_r(&tm, date);
+        stripnl(date);
+        cached = tm;
+    }
+    return date;
+}
+
+/* Called with drain_lock held. */
+static void write_line(int prio, time_t when, const char *msg) {
+    if (log_pid == 0)
+        log_pid = getpid();
+
+    if (syslog_enabled) {
+        syslog(prio, "%s", msg);
+    } else {
+        fprintf(logf, "%s [%d]: %s: %s\n", getlogdate(when), log_pid, __progname, msg);
+    }
+}
+
+/* Writes out everything queued so far, oldest first across all threads.
+ * Called with drain_lock held, which also keeps rings from being unlinked.
+ */
+static void drain_rings_locked() {
+    struct log_ring *r, *oldest;
+
+    for (;;) {
+        oldest = NULL;
+        for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+            unsigned long dropped = __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED);
+            if (dropped > 0) {
+                char msg[64];
+                snprintf(msg, sizeof(msg), "(%lu log messages dropped)", dropped);
+                write_line(LOG_WARNING, log_clock, msg);
+            }
+
+            if (r->head != __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) &&
+                    (oldest == NULL ||
+                     r->records[r->head & (ring_size - 1)].seq <
+                     oldest->records[oldest->head & (ring_size - 1)].seq)) {
+                oldest = r;
+            }
+        }
+        if (oldest == NULL) {
+            break;
+        }
+
+        struct log_record *rec = &oldest->records[oldest->head & (ring_size - 1)];
+        write_line(rec->prio, rec->when, rec->msg);
+        __atomic_store_n(&oldest->head, oldest->head + 1, __ATOMIC_RELEASE);
+    }
+    if (!syslog_enabled) {
+        fflush(logf);
+    }
+}
+
+static void drain_rings() {
+    pthread_mutex_lock(&drain_lock);
+    drain_rings_locked();
+    pthread_mutex_unlock(&drain_lock);
+}
+
+static void *writer_main(void *p) {
+    (void)p;
+
+    pthread_mutex_lock(&writer_lock);
+    while (!writer_quit) {
+        struct timespec deadline;
+
+        pthread_mutex_unlock(&writer_lock);
+        log_clock = time(NULL);
+        drain_rings();
+        pthread_mutex_lock(&writer_lock);
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += WRITER_PERIOD_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        if (!writer_quit) {
+            pthread_cond_timedwait(&writer_wake, &writer_lock, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&writer_lock);
+
+    drain_rings();
+    return NULL;
+}
+
+/* Key destructor: runs as a thread exits, writes out what it left queued and
+ * frees its ring.
+ */
+static void retire_ring(void *p) {
+    struct log_ring *r = p, **rp;
+
+    pthread_mutex_lock(&drain_lock);
+    drain_rings_locked();
+
+    pthread_mutex_lock(&rings_lock);
+    for (rp = &rings; *rp != NULL; rp = &(*rp)->next) {
+        if (*rp == r) {
+            __atomic_store_n(rp, r->next, __ATOMIC_RELEASE);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&rings_lock);
+    pthread_mutex_unlock(&drain_lock);
+
+    my_ring = NULL;
+    free(r->records);
+    free(r);
+}
+
+static void make_ring_key() {
+    if (pthread_key_create(&ring_key, retire_ring) != 0) {
+        panic(1, "Can't create the logging thread key");
+    }
+}
+
+/* The calling thread's ring, or NULL if there's no memory for one.  These are
+ * allocated with plain calloc() so they stay out of the allocation count.
+ */
+static struct log_ring *thread_ring() {
+    struct log_ring *r = my_ring;
+
+    if (r != NULL)
+        return r;
+
+    pthread_once(&ring_key_once, make_ring_key);
+
+    r = calloc(1, sizeof(*r));
+    if (r == NULL)
+        return NULL;
+    r->records = calloc(ring_size, sizeof(struct log_record));
+    if (r->records == NULL) {
+        free(r);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&rings_lock);
+    r->next = rings;
+    __atomic_store_n(&rings, r, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&rings_lock);
+
+    pthread_setspecific(ring_key, r);
+    return my_ring = r;
+}
+
+/* Writes everything queued by any thread, then returns. */
+void log_flush() {
+    if (async_running)
+        drain_rings();
+}
+
+bool_t init_logging(const config_t *cfg) {
     if (initialised)
         return false;
 
-    config_lookup_bool(&config, "syslog", (int *)&syslog_enabled);
+    config_lookup_bool(cfg, "syslog", (int *)&syslog_enabled);
 
     const char *log_path = NULL;
-    config_lookup_string(&config, "logfile", &log_path);
+    config_lookup_string(cfg, "logfile", &log_path);
 
     if (syslog_enabled && log_path != NULL) {
         panic(1, "Error in configuration file: both syslog logging and file logging are specified.");
@@ -58,7 +265,24 @@ bool_t init_logging() {
         logf = stderr;
     }
 
+    log_pid = getpid();
+    log_clock = time(NULL);
     initialised = true;
+
+    int async = true, depth;
+    config_lookup_bool(cfg, "log_async", &async);
+    if (config_lookup_int(cfg, "log_queue_depth", &depth) && depth > 0) {
+        for (ring_size = 1; ring_size < (unsigned)depth; ring_size <<= 1)
+            ;
+    }
+    if (async) {
+        writer_quit = false;
+        if (pthread_create(&writer, NULL, writer_main, NULL) != 0) {
+            panic(1, "Can't start the logging thread");
+        }
+        async_running = true;
+    }
+
     return true;
 }
 
@@ -66,21 +290,27 @@ bool_t shutdown_logging() {
     if (!initialised)
         return false;
 
+    /* panic() can get here from the writer thread itself, which mustn't join
+     * itself; whatever it has queued is flushed below all the same.
+     */
+    if (async_running && !pthread_equal(pthread_self(), writer)) {
+        pthread_mutex_lock(&writer_lock);
+        writer_quit = true;
+        pthread_cond_signal(&writer_wake);
+        pthread_mutex_unlock(&writer_lock);
+        pthread_join(writer, NULL);
+    }
+    async_running = false;
+    drain_rings();
+
     if (logf && logf != stderr) 
         fclose(logf);
+    logf = stderr;
+    initialised = false;
 
     return true;
 }
 
-char *getlogdate() {
-    char *tp;
-    time_t tm = time(NULL);
-
-    tp = ctime(&tm);
-    stripnl(tp);
-    return(tp);
-}
-
 void xlog(int prio, char *fmt, ...) {
     va_list ap;
 
@@ -97,13 +327,38 @@ void vxlog(int prio, const char *fmt, va_list ap) {
         logf = stderr;
     }
 
-    if (syslog_enabled) {
-        vsyslog(prio, fmt, ap);
-    } else {
-        fprintf(logf, "%s [%d]: %s: ", getlogdate(), getpid(), __progname);
-        vfprintf(logf, fmt, ap);
-        fprintf(logf, "\n");
+    struct log_ring *r;
+    if (async_running && prio > LOG_ERR && (r = thread_ring()) != NULL) {
+        unsigned tail = r->tail;
+        unsigned queued = tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+        if (queued == ring_size) {
+            __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        if (queued == ring_size / 2) {
+            /* Don't wait out the period if we're filling up. */
+            pthread_cond_signal(&writer_wake);
+        }
+
+        struct log_record *rec = &r->records[tail & (ring_size - 1)];
+        rec->seq = __atomic_fetch_add(&next_seq, 1, __ATOMIC_RELAXED);
+        rec->when = log_clock;
+        rec->prio = prio;
+        vsnprintf(rec->msg, LOG_LINE_MAX, fmt, ap);
+        __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+        return;
+    }
+
+    /* Synchronous: errors go out now, but after everything logged before. */
+    char msg[LOG_LINE_MAX];
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+
+    log_flush();
+    pthread_mutex_lock(&drain_lock);
+    write_line(prio, time(NULL), msg);
+    if (!syslog_enabled) {
         fflush(logf);
     }
+    pthread_mutex_unlock(&drain_lock);
 }
-
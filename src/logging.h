@@ -4,10 +4,13 @@
 #include <stdarg.h>
 #include <syslog.h>
 
+#include <libconfig.h>
+
 #include "main.h"
 
-bool_t init_logging();
+bool_t init_logging(const config_t *cfg);
 bool_t shutdown_logging();
+void log_flush();
 
 void xlog(int prio, char *fmt, ...);
 void vxlog(int prio, const char *fmt, va_list ap);
@@ -23,18 +23,38 @@
 #include <libconfig.h>
 
 #include "asciimatic.h"
+#include "batch.h"
+#include "daemon.h"
+#include "encoder.h"
 #include "gui.h"
 #include "logging.h"
+#include "pipeline.h"
+#include "stream.h"
+#include "stripe.h"
+#include "trace.h"
 #include "utils.h"
+#include "watch.h"
 
 config_t config;
-
-bool_t verbose_mode; /* Log LOG_DEBUG messages, bounds checking, etc? */
+char *config_path;
+FILE *output_file;
 
 extern const char *__progname;
 const char *input_filename;
+const char *batch_input;      /* directory or manifest for headless runs */
+const char *batch_output_dir;
+const char *daemon_socket;    /* Unix socket to serve conversions on */
+const char *grid_sizes;       /* batch mode grid sizes, all from one edge pass */
+const char *threshold_sweep;  /* batch mode Canny threshold pairs */
+const char *stream_source;    /* video file, image sequence or camera index */
+bool_t play_stream;           /* pace the stream and draw only what changes */
+const char *stripe_input;     /* PGM to convert a stripe at a time */
+const char *trace_output;     /* Chrome trace file, if tracing */
+const char *tree_output;      /* model to train from the batch, if training */
+const char *watch_input;      /* image to re-render whenever it or the config changes */
 int output_rows;
 int output_cols;
+enum output_format output_format;
 
 static void validate_config(int argc, char **argv) {
     char optch;
@@ -43,18 +63,57 @@ static void validate_config(int argc, char **argv) {
     bool_t show_usage = false;
     bool_t show_version = false;
     bool_t valid_usage = true;
+    const char *format = "plain";
+
+    config_lookup_string(&config, "output_format", &format);
 
 
-    extern FILE *output_file;
     output_file = stdout;
 
-    while ((optch = getopt(argc, argv, "ho:v")) != EOF) {
+    while ((optch = getopt(argc, argv, "b:D:f:g:hL:O:o:PS:s:T:t:vw:")) != EOF) {
         switch (optch) {
+            case 'b':
+                batch_input = optarg;
+                break;
+            case 'D':
+                daemon_socket = optarg;
+                break;
+            case 'f':
+                format = optarg;
+                break;
+            case 'g':
+                grid_sizes = optarg;
+                break;
+            case 'L':
+                tree_output = optarg;
+                break;
+            case 'O':
+                batch_output_dir = optarg;
+                break;
             case 'o':
                 output_file = xfopen(optarg, "w");
+                break;
+            case 'P':
+                play_stream = true;
+                break;
+            case 'S':
+                stripe_input = optarg;
+                break;
+            case 's':
+                stream_source = optarg;
+                break;
+            case 'T':
+                trace_output = optarg;
+                break;
+            case 't':
+                threshold_sweep = optarg;
+                break;
             case 'v':
                 show_version = true;
                 break;
+            case 'w':
+                watch_input = optarg;
+                break;
             default:
                 valid_usage = false; /* FALLTHROUGH */
             case 'h':
@@ -71,8 +130,26 @@ static void validate_config(int argc, char **argv) {
     argc -= optind;
     argv += optind;
 
-    if (argc != 3) {
+    if (output_format_named(format) == -1) {
+        fprintf(stderr, "Unknown output format \"%s\"\n", format);
         show_usage = true;
+        valid_usage = false;
+        goto done;
+    }
+    output_format = output_format_named(format);
+
+    int modes = (batch_input != NULL) + (stream_source != NULL) + (stripe_input != NULL) + (daemon_socket != NULL) +
+        (watch_input != NULL);
+    bool_t headless = modes > 0;
+    /* With -g, batch mode needs no size of its own. */
+    bool_t sized = grid_sizes != NULL && argc == 0;
+    if (modes > 1 || (tree_output != NULL && batch_input == NULL) || (play_stream && stream_source == NULL) ||
+            (grid_sizes != NULL && batch_input == NULL) ||
+            (argc != (daemon_socket != NULL ? 0 : headless ? 2 : 3) && !sized)) {
+        show_usage = true;
+        goto done;
+    }
+    if (daemon_socket != NULL || sized) {
         goto done;
     }
 
@@ -84,14 +161,41 @@ static void validate_config(int argc, char **argv) {
     if (output_cols == 0 || output_cols > 4096) {
         panic(1, "Bad row count size");
     }
-    input_filename = argv[2];
+    if (!headless) {
+        input_filename = argv[2];
+    }
     
 done:
     if (show_usage) {
         fprintf(stderr, "usage: %s [options] <columns> <rows> <input file>\n", __progname);
+        fprintf(stderr, "       %s [options] -b <directory|manifest> <columns> <rows>\n", __progname);
+        fprintf(stderr, "       %s [options] -s <video|sequence|camera> <columns> <rows>\n", __progname);
+        fprintf(stderr, "       %s [options] -S <pgm> <columns> <rows>\n", __progname);
+        fprintf(stderr, "       %s [options] -w <image> <columns> <rows>\n", __progname);
+        fprintf(stderr, "       %s [options] -D <socket>\n", __progname);
+        fprintf(stderr, "    -b <directory|manifest>: convert every image without the GUI\n");
+        fprintf(stderr, "    -D <socket>: serve conversion requests on a Unix socket until interrupted\n");
+        fprintf(stderr, "    -f <plain|ansi|html>: output format; ansi and html colour each character\n");
+        fprintf(stderr, "                          with the mean colour of its cell\n");
+        fprintf(stderr, "    -g <cols>x<rows>[,<cols>x<rows>...]: in batch mode, convert each image at\n");
+        fprintf(stderr, "                every size from one edge detection pass; <columns> <rows>\n");
+        fprintf(stderr, "                may then be left out\n");
         fprintf(stderr, "    -h: display this message\n");
+        fprintf(stderr, "    -L <model>: in batch mode, train the tree matcher on what the exact matcher\n");
+        fprintf(stderr, "                makes of every image, and write the model to file\n");
+        fprintf(stderr, "    -O <directory>: in batch mode, write one <image>.txt per image here\n");
         fprintf(stderr, "    -o <file>: output ASCII image to file rather than stdout\n");
+        fprintf(stderr, "    -P: with -s, play at the source's frame rate, dropping frames to keep up,\n");
+        fprintf(stderr, "        and redraw only the cells that change even if output isn't a terminal\n");
+        fprintf(stderr, "    -S <pgm>: convert a huge binary PGM a stripe at a time, in bounded memory\n");
+        fprintf(stderr, "    -s <source>: convert a video file, image sequence (e.g. frames/%%04d.png)\n");
+        fprintf(stderr, "                 or camera index frame by frame, without the GUI\n");
+        fprintf(stderr, "    -T <file>: write a Chrome trace of each stage to file, and log a summary\n");
+        fprintf(stderr, "    -t <t1:t2[,t1:t2...]>: in batch mode, convert each image once per pair\n");
+        fprintf(stderr, "                           of Canny thresholds\n");
         fprintf(stderr, "    -v: show version\n");
+        fprintf(stderr, "    -w <image>: convert image, then again whenever it or the configuration\n");
+        fprintf(stderr, "                file changes, redoing only the stages that changed\n");
         exit(valid_usage ? 0 : 1);
     }
     
@@ -103,35 +207,58 @@ done:
 static bool_t read_config() {
     config_init(&config);
 
-    char *cf_path;
-    if (asprintf(&cf_path, "config/%s.cfg", __progname) == -1) {
+    if (asprintf(&config_path, "config/%s.cfg", __progname) == -1) {
         panic(1, "Can't allocate space for asprintf()");
     }
 
-    FILE *cfile = xfopen(cf_path, "r");
+    FILE *cfile = xfopen(config_path, "r");
     if (config_read(&config, cfile) == CONFIG_FALSE) {
         panic(1, "Can't parse %s:%d : %s", 
                 config_error_file(&config), config_error_line(&config), 
                 (config_error_text(&config) ? config_error_text(&config) : "<unknown>"));
     }
 
-    free(cf_path);
+    fclose(cfile);
     return true;
 }
 
 int main(int argc, char **argv) {
+    int status = 0;
+
     read_config();
     validate_config(argc, argv);
     
-    init_logging();
-    init_asciimatic(input_filename, output_rows, output_cols);
-    init_gui();
+    init_logging(&config);
+    trace_init(trace_output);
 
-    gui_loop();
+    if (batch_input != NULL) {
+        init_pipeline();
+        status = run_batch(batch_input, batch_output_dir, output_cols, output_rows) == 0 ? 0 : 2;
+    } else if (stream_source != NULL) {
+        init_pipeline();
+        status = run_stream(stream_source, output_cols, output_rows, play_stream);
+    } else if (daemon_socket != NULL) {
+        status = run_daemon(daemon_socket);
+    } else if (stripe_input != NULL) {
+        init_pipeline();
+        status = run_striped(stripe_input, output_cols, output_rows);
+    } else if (watch_input != NULL) {
+        init_pipeline();
+        status = run_watch(watch_input, output_cols, output_rows);
+    } else {
+        init_asciimatic(input_filename, output_rows, output_cols);
+        init_gui();
+
+        gui_loop();
+
+        shutdown_gui();
+    }
 
-    shutdown_gui();
+    trace_shutdown();
     shutdown_asciimatic();
     shutdown_logging();
 
     config_destroy(&config);
+    free(config_path);
+    return status;
 }
@@ -0,0 +1,501 @@
+/* matcher.c
+ * Batched template matching against a contiguous glyph atlas.
+ *
+ * Copyright (c) 2014 Nathan Taylor <nbtaylor@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <float.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <opencv/cv.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+#include "kernels.h"
+#include "matcher.h"
+#include "utils.h"
+
+/* Everything is padded out to this many floats (one AVX register) so that the
+ * kernels never need a scalar tail loop.
+ */
+#define LANES 8
+#define ALIGNMENT 32
+
+#define PAD(n) (((n) + LANES - 1) & ~(LANES - 1))
+
+/* acc[0, n) += v * row[0, n), with n a multiple of LANES. */
+typedef void (*axpy_fn)(float *acc, const float *row, float v, int n);
+
+static void
+axpy_scalar(float *acc, const float *row, float v, int n) {
+    for (int i = 0; i < n; i++) {
+        acc[i] += v * row[i];
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("sse2")))
+static void
+axpy_sse2(float *acc, const float *row, float v, int n) {
+    __m128 vv = _mm_set1_ps(v);
+    for (int i = 0; i < n; i += 4) {
+        __m128 a = _mm_load_ps(acc + i);
+        a = _mm_add_ps(a, _mm_mul_ps(vv, _mm_loadu_ps(row + i)));
+        _mm_store_ps(acc + i, a);
+    }
+}
+
+__attribute__((target("avx2")))
+static void
+axpy_avx2(float *acc, const float *row, float v, int n) {
+    __m256 vv = _mm256_set1_ps(v);
+    for (int i = 0; i < n; i += 8) {
+        __m256 a = _mm256_load_ps(acc + i);
+        a = _mm256_add_ps(a, _mm256_mul_ps(vv, _mm256_loadu_ps(row + i)));
+        _mm256_store_ps(acc + i, a);
+    }
+}
+#endif
+
+static axpy_fn axpy = NULL;
+static const char *axpy_isa = "scalar";
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+/* Run once, however many contexts build atlases at the same time. */
+static void
+pick_kernel(void) {
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        axpy_isa = "avx2";
+        axpy = axpy_avx2;
+        return;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        axpy_isa = "sse2";
+        axpy = axpy_sse2;
+        return;
+    }
+#endif
+    axpy = axpy_scalar;
+}
+
+static void
+select_kernel(void) {
+    pthread_once(&kernel_once, pick_kernel);
+}
+
+const char *
+matcher_isa(void) {
+    select_kernel();
+    return axpy_isa;
+}
+
+static void pick_fixed_kernel(struct glyph_atlas *atlas);
+
+struct glyph_atlas *
+atlas_create(IplImage **templates, const char *charset, int w, int h) {
+    struct glyph_atlas *atlas = xcalloc(1, sizeof(*atlas));
+    int g, x, y, ntaps = 0;
+
+    select_kernel();
+
+    atlas->charset = charset;
+    atlas->count = strlen(charset);
+    atlas->width = w;
+    atlas->height = h;
+    atlas->stride = PAD(w);
+
+    size_t glyph_floats = (size_t)atlas->stride * h;
+    atlas->pixels = xaligned_alloc(ALIGNMENT, atlas->count * glyph_floats * sizeof(float));
+    memset(atlas->pixels, 0, atlas->count * glyph_floats * sizeof(float));
+    atlas->sqsum = xcalloc(atlas->count, sizeof(double));
+    atlas->first_tap = xcalloc(atlas->count + 1, sizeof(int));
+
+    for (g = 0; g < atlas->count; g++) {
+        const IplImage *t = templates[g];
+        float *dst = atlas->pixels + g * glyph_floats;
+
+        for (y = 0; y < h; y++) {
+            const unsigned char *row = (const unsigned char *)t->imageData + y * t->widthStep;
+            for (x = 0; x < w; x++) {
+                dst[y * atlas->stride + x] = row[x];
+                atlas->sqsum[g] += (double)row[x] * row[x];
+                ntaps += row[x] != 0;
+            }
+        }
+    }
+
+    atlas->taps = xmalloc(MAX(ntaps, 1) * sizeof(struct glyph_tap));
+    ntaps = 0;
+    for (g = 0; g < atlas->count; g++) {
+        const float *src = atlas->pixels + g * glyph_floats;
+
+        atlas->first_tap[g] = ntaps;
+        for (y = 0; y < h; y++) {
+            for (x = 0; x < w; x++) {
+                float v = src[y * atlas->stride + x];
+                if (v != 0) {
+                    atlas->taps[ntaps].y = y;
+                    atlas->taps[ntaps].x = x;
+                    atlas->taps[ntaps].v = v;
+                    ntaps++;
+                }
+            }
+        }
+    }
+    atlas->first_tap[atlas->count] = ntaps;
+
+    pick_fixed_kernel(atlas);
+    return atlas;
+}
+
+void
+atlas_destroy(struct glyph_atlas *atlas) {
+    if (atlas == NULL) {
+        return;
+    }
+    free(atlas->pixels);
+    free(atlas->sqsum);
+    free(atlas->taps);
+    free(atlas->first_tap);
+    free(atlas);
+}
+
+/* Carves one worker's scratch out of the arena.  Everything comes back zeroed,
+ * and nothing but the cell's interior is ever written afterwards, so the
+ * border of the padded cell stays zero for the life of the scratch.
+ */
+void
+match_scratch_init(struct match_scratch *s, const struct glyph_atlas *atlas, struct arena *arena) {
+    int w = atlas->width, h = atlas->height;
+
+    /* Offsets run over [0, w], and the kernels read a whole padded row of them
+     * starting at any template column, so leave room past the 2w cell.
+     */
+    s->cell_stride = PAD(2 * w + LANES);
+    s->cell = arena_alloc(arena, (size_t)s->cell_stride * 2 * h * sizeof(float), ALIGNMENT);
+    s->sqint = arena_alloc(arena, (size_t)(2 * h + 1) * (2 * w + 1) * sizeof(double), sizeof(double));
+    s->acc = arena_alloc(arena, PAD(w + 1) * sizeof(float), ALIGNMENT);
+}
+
+/* The kernel for any cell size; see atlas_match(). */
+int
+atlas_match_generic(const struct glyph_atlas *atlas, struct match_scratch *s, const unsigned char *cell, int step,
+            const int *cands, int ncands) {
+    int w = atlas->width, h = atlas->height;
+    int cw = 2 * w + 1;
+    int nacc = PAD(w + 1);
+    int c, g, x, y;
+
+    if (cands == NULL) {
+        ncands = atlas->count;
+    }
+
+    /* Convert the cell once into the middle of the padded buffer, and build
+     * the integral of its squares so that any window's energy is four lookups.
+     */
+    for (y = 0; y < h; y++) {
+        const unsigned char *row = cell + y * step;
+        float *dst = s->cell + (y + h / 2) * s->cell_stride + w / 2;
+
+        for (x = 0; x < w; x++) {
+            dst[x] = row[x];
+        }
+    }
+    for (y = 0; y < 2 * h; y++) {
+        const float *row = s->cell + y * s->cell_stride;
+        double *ip = s->sqint + (y + 1) * cw;
+        double rowsum = 0;
+
+        for (x = 0; x < 2 * w; x++) {
+            rowsum += (double)row[x] * row[x];
+            ip[x + 1] = ip[x + 1 - cw] + rowsum;
+        }
+    }
+
+    for (c = 0; c < ncands; c++) {
+        g = cands != NULL ? cands[c] : c;
+        const struct glyph_tap *tap, *end = atlas->taps + atlas->first_tap[g + 1];
+        double tsq = atlas->sqsum[g];
+        double tnorm = sqrt(tsq);
+        float lo = FLT_MAX, hi = -FLT_MAX;
+
+        for (y = 0; y <= h; y++) {
+            const double *top = s->sqint + y * cw;
+            const double *bot = s->sqint + (y + h) * cw;
+
+            memset(s->acc, 0, nacc * sizeof(float));
+            for (tap = atlas->taps + atlas->first_tap[g]; tap < end; tap++) {
+                axpy(s->acc, s->cell + (y + tap->y) * s->cell_stride + tap->x, tap->v, nacc);
+            }
+
+            for (x = 0; x <= w; x++) {
+                double wnd = bot[x + w] - bot[x] - top[x + w] + top[x];
+                float r = sqdiff_normed(wnd, s->acc[x], tsq, tnorm);
+
+                lo = MIN(lo, r);
+                hi = MAX(hi, r);
+            }
+        }
+
+        if (glyph_score(lo, hi) > 0) {
+            return g;
+        }
+    }
+
+    return cands != NULL ? cands[0] : 0;
+}
+
+/* The fixed-size kernels below keep a whole row of offsets' correlations in
+ * registers while running through a glyph's taps, rather than reading and
+ * writing acc once per tap, and with the cell size a constant the compiler
+ * unrolls the conversion, integral and scoring loops around them.  They make
+ * the same float operations in the same order as the generic kernel (the
+ * AVX-512 one uses explicitly rounded operations so that nothing is fused into
+ * an FMA), so they pick the same glyphs.
+ *
+ * out[0, n) = the sum over taps of tap->v * base[tap->y * stride + tap->x + i],
+ * for n of 8 or 16.
+ */
+typedef void (*correlate_fn)(const struct glyph_tap *tap, const struct glyph_tap *end, const float *base,
+                             int stride, float *out, int n);
+
+static void
+correlate_scalar(const struct glyph_tap *tap, const struct glyph_tap *end, const float *base, int stride,
+                 float *out, int n) {
+    float acc[2 * LANES] = { 0 };
+
+    for (; tap < end; tap++) {
+        const float *row = base + tap->y * stride + tap->x;
+
+        for (int i = 0; i < n; i++) {
+            acc[i] += tap->v * row[i];
+        }
+    }
+    memcpy(out, acc, n * sizeof(float));
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("sse4.2")))
+static void
+correlate_sse42(const struct glyph_tap *tap, const struct glyph_tap *end, const float *base, int stride,
+                float *out, int n) {
+    __m128 a0 = _mm_setzero_ps(), a1 = _mm_setzero_ps(), a2 = _mm_setzero_ps(), a3 = _mm_setzero_ps();
+
+    for (; tap < end; tap++) {
+        const float *row = base + tap->y * stride + tap->x;
+        __m128 v = _mm_set1_ps(tap->v);
+
+        a0 = _mm_add_ps(a0, _mm_mul_ps(v, _mm_loadu_ps(row)));
+        a1 = _mm_add_ps(a1, _mm_mul_ps(v, _mm_loadu_ps(row + 4)));
+        if (n > LANES) {
+            a2 = _mm_add_ps(a2, _mm_mul_ps(v, _mm_loadu_ps(row + 8)));
+            a3 = _mm_add_ps(a3, _mm_mul_ps(v, _mm_loadu_ps(row + 12)));
+        }
+    }
+    _mm_store_ps(out, a0);
+    _mm_store_ps(out + 4, a1);
+    if (n > LANES) {
+        _mm_store_ps(out + 8, a2);
+        _mm_store_ps(out + 12, a3);
+    }
+}
+
+__attribute__((target("avx2")))
+static void
+correlate_avx2(const struct glyph_tap *tap, const struct glyph_tap *end, const float *base, int stride,
+               float *out, int n) {
+    __m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps();
+
+    for (; tap < end; tap++) {
+        const float *row = base + tap->y * stride + tap->x;
+        __m256 v = _mm256_set1_ps(tap->v);
+
+        a0 = _mm256_add_ps(a0, _mm256_mul_ps(v, _mm256_loadu_ps(row)));
+        if (n > LANES) {
+            a1 = _mm256_add_ps(a1, _mm256_mul_ps(v, _mm256_loadu_ps(row + 8)));
+        }
+    }
+    _mm256_store_ps(out, a0);
+    if (n > LANES) {
+        _mm256_store_ps(out + 8, a1);
+    }
+}
+
+#define ROUND_EXACT (_MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)
+
+__attribute__((target("avx512f")))
+static void
+correlate_avx512(const struct glyph_tap *tap, const struct glyph_tap *end, const float *base, int stride,
+                 float *out, int n) {
+    __mmask16 lanes = (__mmask16)((1u << n) - 1);
+    __m512 a = _mm512_setzero_ps();
+
+    for (; tap < end; tap++) {
+        const float *row = base + tap->y * stride + tap->x;
+        __m512 p = _mm512_mul_round_ps(_mm512_set1_ps(tap->v), _mm512_maskz_loadu_ps(lanes, row), ROUND_EXACT);
+
+        a = _mm512_add_round_ps(a, p, ROUND_EXACT);
+    }
+    _mm512_mask_storeu_ps(out, lanes, a);
+}
+#endif
+
+/* atlas_match_generic() for a w x h cell, with w and h constants. */
+static inline __attribute__((always_inline)) int
+match_fixed(const struct glyph_atlas *atlas, struct match_scratch *s, const unsigned char *cell, int step,
+            const int *cands, int ncands, const int w, const int h, correlate_fn correlate) {
+    const int stride = PAD(2 * w + LANES);
+    const int cw = 2 * w + 1;
+    float acc[2 * LANES] __attribute__((aligned(ALIGNMENT)));
+    int c, g, x, y;
+
+    if (cands == NULL) {
+        ncands = atlas->count;
+    }
+
+    for (y = 0; y < h; y++) {
+        const unsigned char *row = cell + y * step;
+        float *dst = s->cell + (y + h / 2) * stride + w / 2;
+
+        for (x = 0; x < w; x++) {
+            dst[x] = row[x];
+        }
+    }
+    for (y = 0; y < 2 * h; y++) {
+        const float *row = s->cell + y * stride;
+        double *ip = s->sqint + (y + 1) * cw;
+        double rowsum = 0;
+
+        for (x = 0; x < 2 * w; x++) {
+            rowsum += (double)row[x] * row[x];
+            ip[x + 1] = ip[x + 1 - cw] + rowsum;
+        }
+    }
+
+    for (c = 0; c < ncands; c++) {
+        g = cands != NULL ? cands[c] : c;
+        const struct glyph_tap *first = atlas->taps + atlas->first_tap[g];
+        const struct glyph_tap *end = atlas->taps + atlas->first_tap[g + 1];
+        double tsq = atlas->sqsum[g];
+        double tnorm = sqrt(tsq);
+        float lo = FLT_MAX, hi = -FLT_MAX;
+
+        for (y = 0; y <= h; y++) {
+            const double *top = s->sqint + y * cw;
+            const double *bot = s->sqint + (y + h) * cw;
+
+            correlate(first, end, s->cell + y * stride, stride, acc, PAD(w + 1));
+
+            for (x = 0; x <= w; x++) {
+                double wnd = bot[x + w] - bot[x] - top[x + w] + top[x];
+                float r = sqdiff_normed(wnd, acc[x], tsq, tnorm);
+
+                lo = MIN(lo, r);
+                hi = MAX(hi, r);
+            }
+        }
+
+        if (glyph_score(lo, hi) > 0) {
+            return g;
+        }
+    }
+
+    return cands != NULL ? cands[0] : 0;
+}
+
+#define FIXED_KERNEL(name, target, correlate, w, h)                                                         \
+    target static int                                                                                       \
+    name(const struct glyph_atlas *atlas, struct match_scratch *s, const unsigned char *cell, int step,     \
+         const int *cands, int ncands) {                                                                    \
+        return match_fixed(atlas, s, cell, step, cands, ncands, w, h, correlate);                           \
+    }
+
+#define SCALAR_KERNEL(w, h) FIXED_KERNEL(match_##w##x##h, , correlate_scalar, w, h)
+FIXED_GEOMETRIES(SCALAR_KERNEL)
+
+#ifdef HAVE_X86_KERNELS
+#define X86_KERNELS(w, h)                                                                                   \
+    FIXED_KERNEL(match_##w##x##h##_sse42, __attribute__((target("sse4.2"))), correlate_sse42, w, h)         \
+    FIXED_KERNEL(match_##w##x##h##_avx2, __attribute__((target("avx2"))), correlate_avx2, w, h)            \
+    FIXED_KERNEL(match_##w##x##h##_avx512, __attribute__((target("avx512f"))), correlate_avx512, w, h)
+FIXED_GEOMETRIES(X86_KERNELS)
+#endif
+
+struct fixed_kernel {
+    int width, height;
+    enum cpu_level level;
+    const char *name;
+    atlas_match_fn match;
+};
+
+#define SCALAR_ENTRY(w, h) { w, h, CPU_BASELINE, "scalar " #w "x" #h, match_##w##x##h },
+#define X86_ENTRIES(w, h)                                                                                   \
+    { w, h, CPU_SSE42, "sse4.2 " #w "x" #h, match_##w##x##h##_sse42 },                                     \
+    { w, h, CPU_AVX2, "avx2 " #w "x" #h, match_##w##x##h##_avx2 },                                         \
+    { w, h, CPU_AVX512, "avx512 " #w "x" #h, match_##w##x##h##_avx512 },
+
+static const struct fixed_kernel fixed_kernels[] = {
+    FIXED_GEOMETRIES(SCALAR_ENTRY)
+#ifdef HAVE_X86_KERNELS
+    FIXED_GEOMETRIES(X86_ENTRIES)
+#endif
+};
+
+/* Uses the kernel for the atlas's cell size that makes the most of the CPU,
+ * or the generic one if there isn't one for that size.
+ */
+static void
+pick_fixed_kernel(struct glyph_atlas *atlas) {
+    const struct fixed_kernel *best = NULL;
+
+    atlas->match = atlas_match_generic;
+    atlas->kernel = matcher_isa();
+    for (size_t i = 0; i < sizeof(fixed_kernels) / sizeof(fixed_kernels[0]); i++) {
+        const struct fixed_kernel *k = &fixed_kernels[i];
+
+        if (k->width == atlas->width && k->height == atlas->height && k->level <= cpu_level() &&
+                (best == NULL || k->level > best->level)) {
+            best = k;
+        }
+    }
+    if (best != NULL) {
+        atlas->match = best->match;
+        atlas->kernel = best->name;
+    }
+}
+
+/* Scores glyphs at every offset of the w x h cell at the given address,
+ * bordered by w/2 and h/2 pixels of zeros, exactly as
+ * cvMatchTemplate(CV_TM_SQDIFF_NORMED) would over the bordered copy
+ * char_for_subimage() is given.  Returns the index of the chosen glyph.
+ *
+ * Only the ncands glyphs listed in cands, in ascending order, are considered;
+ * cands may be NULL to consider them all.  Since the first glyph scoring 1
+ * wins outright, scoring stops as soon as one does.
+ */
+int
+atlas_match(const struct glyph_atlas *atlas, struct match_scratch *s, const unsigned char *cell, int step,
+            const int *cands, int ncands) {
+    return atlas->match(atlas, s, cell, step, cands, ncands);
+}
@@ -0,0 +1,93 @@
+#ifndef _MATCHER_H_
+#define _MATCHER_H_
+
+#include <float.h>
+#include <math.h>
+
+#include <opencv/cv.h>
+
+#include "utils.h"
+
+/* Every template in the bank laid out back to back in one aligned block, plus
+ * the list of lit pixels in each (most of a glyph is background, and a zero
+ * template pixel contributes nothing to the cross-correlation).
+ */
+struct glyph_tap {
+    int y, x;
+    float v;
+};
+
+struct glyph_atlas;
+struct match_scratch;
+
+typedef int (*atlas_match_fn)(const struct glyph_atlas *atlas, struct match_scratch *s, const unsigned char *cell,
+                              int step, const int *cands, int ncands);
+
+struct glyph_atlas {
+    const char *charset;
+    int count;
+    int width, height;
+    int stride;              /* floats per glyph row */
+    float *pixels;           /* count * height * stride */
+    double *sqsum;           /* sum of squared pixels, per glyph */
+    struct glyph_tap *taps;  /* lit pixels of every glyph, in glyph order */
+    int *first_tap;          /* count + 1 offsets into taps */
+
+    /* Picked by atlas_create() for the cell size and the CPU; see kernels.h. */
+    atlas_match_fn match;
+    const char *kernel;
+};
+
+/* Per-worker state for matching one cell at a time against an atlas. */
+struct match_scratch {
+    int cell_stride;         /* floats per padded cell row */
+    float *cell;             /* the cell, zero-padded to 2w x 2h */
+    double *sqint;           /* (2h + 1) x (2w + 1) integral of squared cell */
+    float *acc;              /* one row of offsets' cross-correlations */
+};
+
+/* char_for_subimage() cubes each glyph's response map and min-max normalises
+ * it into [0, 1] before taking its maximum, so a glyph scores 1 when its map
+ * has any contrast at all and 0 when it is flat, and the first glyph with the
+ * highest score wins.  Reduce the extremes the same way so that every matcher
+ * picks the same glyph as OpenCV does.
+ */
+static inline double
+glyph_score(float lo, float hi) {
+    float lo3 = lo * lo * lo;
+    float hi3 = hi * hi * hi;
+
+    return ((double)hi3 - lo3 > DBL_EPSILON) ? 1.0 : 0.0;
+}
+
+/* cvMatchTemplate(CV_TM_SQDIFF_NORMED)'s response at one offset, given the
+ * energy of the window there, its cross-correlation with the template and the
+ * template's energy and norm.
+ */
+static inline float
+sqdiff_normed(double wnd, double corr, double tsq, double tnorm) {
+    double num = wnd - 2 * corr + tsq;
+    double t = sqrt(MAX(wnd, 0)) * tnorm;
+
+    /* Same clamping as OpenCV's normalised methods. */
+    if (fabs(num) < t) {
+        return num / t;
+    } else if (fabs(num) < t * 1.125) {
+        return num > 0 ? 1 : -1;
+    }
+    return 1;
+}
+
+struct glyph_atlas *atlas_create(IplImage **templates, const char *charset, int w, int h);
+void atlas_destroy(struct glyph_atlas *atlas);
+
+void match_scratch_init(struct match_scratch *s, const struct glyph_atlas *atlas, struct arena *arena);
+
+int atlas_match(const struct glyph_atlas *atlas, struct match_scratch *s, const unsigned char *cell, int step,
+                const int *cands, int ncands);
+int atlas_match_generic(const struct glyph_atlas *atlas, struct match_scratch *s, const unsigned char *cell, int step,
+                        const int *cands, int ncands);
+
+const char *matcher_isa(void);
+
+#endif
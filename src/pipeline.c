@@ -0,0 +1,375 @@
+/* pipeline.c
+ * The command line's pipeline: libasciimatic, set up from the config file.
+ *
+ * Copyright (c) 2014 Nathan Taylor <nbtaylor@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <libconfig.h>
+#include <opencv/cv.h>
+#include <opencv/highgui.h>
+
+#include "asciimatic.h"
+#include "encoder.h"
+#include "logging.h"
+#include "pipeline.h"
+#include "stagecache.h"
+#include "trace.h"
+#include "utils.h"
+
+extern config_t config;
+extern FILE *output_file;
+extern int output_rows;
+extern int output_cols;
+extern enum output_format output_format;
+
+struct asciimatic *pipeline;
+IplImage *src;
+int first_thresh;
+int second_thresh;
+
+struct stage_cache stage_cache;
+
+static char *grid;
+static size_t grid_size;
+static unsigned char *colours;  /* of src's cells, if the output is coloured */
+static uint64_t src_key;        /* src's, in the stage cache */
+
+/* Hashes of the settings that the smoothing and matching stages depend on,
+ * taken whenever the pipeline is set up.  Anything that doesn't change the
+ * output (the thread count, the FFT crossover, checking) is left out.
+ */
+static uint64_t smooth_settings, match_settings;
+
+static void
+hash_settings(const struct asciimatic_options *o) {
+    int smooth[] = { o->min_cell_width, o->min_cell_height };
+    int match[] = { o->bitset_shift, o->empty_cell_pixels, o->prune_candidates };
+    uint64_t key;
+
+    smooth_settings = stage_key(STAGE_KEY_SEED, smooth, sizeof(smooth));
+
+    key = stage_key(STAGE_KEY_SEED, match, sizeof(match));
+    key = stage_key_string(key, o->charset);
+    key = stage_key_string(key, o->font);
+    key = stage_key_string(key, o->matcher);
+    if (o->matcher != NULL && strcmp(o->matcher, "tree") == 0) {
+        struct input_file model;
+
+        /* By what the model says rather than where it is, so that training
+         * it again into the same file doesn't bring back the old grids.
+         */
+        memset(&model, 0, sizeof(model));
+        if (read_input(&model, o->tree_model)) {
+            key = stage_key(key, &model.key, sizeof(model.key));
+        } else {
+            key = stage_key_string(key, o->tree_model);
+        }
+        free_input(&model);
+        key = stage_key(key, &o->tree_confidence, sizeof(o->tree_confidence));
+    }
+    match_settings = key;
+}
+
+/* Reads the pipeline's configuration and starts the worker pool; everything
+ * but loading an input image.
+ */
+void
+init_pipeline(void) {
+    struct asciimatic_options o;
+
+    if (!config_lookup_int(&config, "threshold1", &first_thresh)) {
+        panic(1, "Missing default threshold1 parameter in config file");
+    }
+    if (!config_lookup_int(&config, "threshold2", &second_thresh)) {
+        panic(1, "Missing default threshold2 parameter in config file");
+    }
+
+    asciimatic_defaults(&o);
+    asciimatic_options_from_config(&config, &o);
+    if ((pipeline = asciimatic_create(&o)) == NULL) {
+        panic(1, "Bad pipeline settings in config file");
+    }
+    hash_settings(&o);
+}
+
+/* Swaps the pipeline for one set up from cfg, e.g. a freshly re-read copy of
+ * the configuration file.  If cfg's settings are bad, the old pipeline stays
+ * and false is returned.
+ */
+bool_t
+reconfigure_pipeline(const config_t *cfg) {
+    struct asciimatic_options o;
+    struct asciimatic *ctx;
+    int t1, t2;
+
+    if (!config_lookup_int(cfg, "threshold1", &t1) || !config_lookup_int(cfg, "threshold2", &t2)) {
+        xlog(LOG_WARNING, "Missing threshold1 or threshold2; keeping the old settings");
+        return false;
+    }
+    asciimatic_defaults(&o);
+    asciimatic_options_from_config(cfg, &o);
+    if ((ctx = asciimatic_create(&o)) == NULL) {
+        xlog(LOG_WARNING, "Bad pipeline settings; keeping the old ones");
+        return false;
+    }
+    asciimatic_destroy(pipeline);
+    pipeline = ctx;
+    first_thresh = t1;
+    second_thresh = t2;
+    hash_settings(&o);
+    return true;
+}
+
+static char *
+stage_cache_dir(void) {
+    const char *dir;
+    char *path = NULL;
+
+    if (config_lookup_string(&config, "stage_cache", &dir)) {
+        return xstrdup(dir);
+    }
+    if (getenv("XDG_CACHE_HOME") != NULL) {
+        if (asprintf(&path, "%s/asciimatic/stages", getenv("XDG_CACHE_HOME")) == -1) {
+            panic(1, "Can't allocate space for asprintf()");
+        }
+    } else if (getenv("HOME") != NULL) {
+        if (asprintf(&path, "%s/.cache/asciimatic/stages", getenv("HOME")) == -1) {
+            panic(1, "Can't allocate space for asprintf()");
+        }
+    }
+    return path;
+}
+
+/* Opens the stage cache that stage_cache and stage_cache_mb configure.
+ * shutdown_asciimatic() closes it.
+ */
+void
+open_stage_cache(void) {
+    char *dir = stage_cache_dir();
+    int mb;
+
+    if (!config_lookup_int(&config, "stage_cache_mb", &mb) || mb < 1) {
+        mb = 256;
+    }
+    stage_cache_open(&stage_cache, dir, mb);
+    free(dir);
+}
+
+/* Reads path into in, reusing its buffer, and hashes it.  Returns false,
+ * having logged why, if there is nothing to read.
+ */
+bool_t
+read_input(struct input_file *in, const char *path) {
+    struct stat st;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+        xlog(LOG_WARNING, "Can't read %s: %s", path, strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        return false;
+    }
+    if ((size_t)st.st_size > in->size) {
+        in->size = st.st_size;
+        in->bytes = xrealloc(in->bytes, in->size);
+    }
+    in->len = 0;
+    while (in->len < (size_t)st.st_size) {
+        ssize_t n = read(fd, in->bytes + in->len, st.st_size - in->len);
+
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        in->len += n;
+    }
+    close(fd);
+    if (in->len == 0) {
+        xlog(LOG_WARNING, "%s is empty", path);
+        return false;
+    }
+    in->key = stage_key(STAGE_KEY_SEED, in->bytes, in->len);
+    return true;
+}
+
+/* Decodes in with cvLoadImage()'s flags, e.g. CV_LOAD_IMAGE_GRAYSCALE. */
+IplImage *
+decode_input(const struct input_file *in, int flags) {
+    CvMat buf;
+
+    TRACE_SCOPE("load");
+    cvInitMatHeader(&buf, 1, in->len, CV_8UC1, in->bytes, CV_AUTOSTEP);
+    return cvDecodeImage(&buf, flags);
+}
+
+void
+free_input(struct input_file *in) {
+    free(in->bytes);
+    memset(in, 0, sizeof(*in));
+}
+
+/* The downscaled, smoothed input for a rows x cols grid. */
+uint64_t
+smooth_key(uint64_t input, int rows, int cols) {
+    int grid[] = { rows, cols };
+
+    return stage_key(stage_key(input, grid, sizeof(grid)), &smooth_settings, sizeof(smooth_settings));
+}
+
+uint64_t
+edges_key(uint64_t smooth, int threshold1, int threshold2) {
+    int thresholds[] = { threshold1, threshold2 };
+
+    return stage_key(smooth, thresholds, sizeof(thresholds));
+}
+
+uint64_t
+grid_key(uint64_t edges, int rows, int cols) {
+    int grid[] = { rows, cols };
+
+    return stage_key(stage_key(edges, grid, sizeof(grid)), &match_settings, sizeof(match_settings));
+}
+
+/* The mean colours of a rows x cols grid's cells, which come straight from
+ * the input.
+ */
+uint64_t
+colours_key(uint64_t input, int rows, int cols) {
+    int grid[] = { rows, cols };
+
+    return stage_key(input, grid, sizeof(grid));
+}
+
+/* Loads filename, downscaled and smoothed, into src, and its cells' colours
+ * if the output is coloured; from the stage cache if they are there.
+ */
+void
+init_asciimatic(const char *filename, int r, int c) {
+    struct input_file in;
+    struct trace_span span;
+
+    init_pipeline();
+    open_stage_cache();
+
+    memset(&in, 0, sizeof(in));
+    if (!read_input(&in, filename)) {
+        panic(1, "Can't load source image \"%s\"", filename);
+    }
+
+    src_key = smooth_key(in.key, r, c);
+    if ((src = stage_cache_get_image(&stage_cache, "smooth", src_key)) == NULL) {
+        if ((src = decode_input(&in, CV_LOAD_IMAGE_GRAYSCALE)) == NULL) {
+            panic(1, "Can't load source image \"%s\"", filename);
+        }
+        downscale_image(pipeline, &src, r, c);
+
+        span = trace_span_begin("smooth");
+        cvSmooth(src, src, CV_GAUSSIAN, 3, 3, 0, 0);
+        trace_span_end(&span);
+        stage_cache_put_image(&stage_cache, "smooth", src_key, src);
+    }
+
+    /* The grayscale is decoded on its own, so that it doesn't depend on the
+     * output format; the colour image only ever gives the cells' colours.
+     */
+    if (output_format_coloured(output_format)) {
+        uint64_t key = colours_key(in.key, r, c);
+        size_t len = (size_t)r * c * 3;
+        IplImage *colour;
+
+        colours = xmalloc(len);
+        if (!stage_cache_get(&stage_cache, "colours", key, colours, len)) {
+            if ((colour = decode_input(&in, CV_LOAD_IMAGE_COLOR)) == NULL) {
+                free(colours);
+                colours = NULL;
+            } else {
+                cell_colours(colour, r, c, colours);
+                cvReleaseImage(&colour);
+                stage_cache_put(&stage_cache, "colours", key, colours, len);
+            }
+        }
+    }
+    free_input(&in);
+
+    output_rows = r;
+    output_cols = c;
+}
+
+/* An edge map that no longer matches its thresholds, keyed by its pixels. */
+static uint64_t
+edited_edges_key(uint64_t smooth, const IplImage *edges) {
+    uint64_t key = stage_key(smooth, "edited", sizeof("edited"));
+
+    for (int y = 0; y < edges->height; y++) {
+        key = stage_key(key, edges->imageData + y * edges->widthStep, edges->width);
+    }
+    return key;
+}
+
+void
+asciify(IplImage *edges, bool_t edited) {
+    size_t len = output_rows * (output_cols + 1);
+
+    xlog(LOG_INFO, "Characters correspond to %dx%d pixel blocks\n",
+         edges->width / output_cols, edges->height / output_rows);
+
+    if (grid_size < len) {
+        grid = xrealloc(grid, len);
+        grid_size = len;
+    }
+    /* edges are src's, at the current thresholds, unless the GUI's eraser
+     * has been at them.
+     */
+    uint64_t key = grid_key(edited ? edited_edges_key(src_key, edges)
+                                   : edges_key(src_key, first_thresh, second_thresh),
+                            output_rows, output_cols);
+    if (!stage_cache_get(&stage_cache, "grid", key, grid, len)) {
+        asciify_grid(pipeline, edges, output_rows, output_cols, grid);
+        stage_cache_put(&stage_cache, "grid", key, grid, len);
+    }
+
+    struct encoder e;
+    encoder_init(&e, output_file, output_format);
+    encoder_begin(&e);
+    encoder_grid(&e, grid, colours, output_rows, output_cols);
+    encoder_end(&e);
+    encoder_free(&e);
+}
+
+void
+shutdown_asciimatic(void) {
+    asciimatic_destroy(pipeline);
+    pipeline = NULL;
+    free(grid);
+    grid = NULL;
+    grid_size = 0;
+    free(colours);
+    colours = NULL;
+    cvReleaseImage(&src);
+    stage_cache_close(&stage_cache);
+}
@@ -0,0 +1,54 @@
+#ifndef _PIPELINE_H_
+#define _PIPELINE_H_
+
+#include <stdint.h>
+
+#include <libconfig.h>
+#include <opencv/cv.h>
+
+#include "libasciimatic.h"
+#include "main.h"
+#include "stagecache.h"
+
+/* The command line's one pipeline, set up from the configuration file. */
+extern struct asciimatic *pipeline;
+
+/* The GUI's source image, loaded, downscaled and smoothed. */
+extern IplImage *src;
+
+/* The GUI's trackbars write these; the modes start from them. */
+extern int first_thresh;
+extern int second_thresh;
+
+/* The stage cache, once open_stage_cache() has been called; off until then. */
+extern struct stage_cache stage_cache;
+
+/* An input file, read whole so that the bytes hashed for the stage cache are
+ * the bytes decoded.  key is their hash, and is the decoded image's key, from
+ * which every later stage's is chained.
+ */
+struct input_file {
+    unsigned char *bytes;
+    size_t len, size;
+    uint64_t key;
+};
+
+void init_pipeline(void);
+bool_t reconfigure_pipeline(const config_t *cfg);
+void open_stage_cache(void);
+
+bool_t read_input(struct input_file *in, const char *path);
+IplImage *decode_input(const struct input_file *in, int flags);
+void free_input(struct input_file *in);
+
+/* Stage cache keys for the pipeline as it is set up now. */
+uint64_t smooth_key(uint64_t input, int rows, int cols);
+uint64_t edges_key(uint64_t smooth, int threshold1, int threshold2);
+uint64_t grid_key(uint64_t edges, int rows, int cols);
+uint64_t colours_key(uint64_t input, int rows, int cols);
+
+void init_asciimatic(const char *filename, int r, int c);
+void asciify(IplImage *edges, bool_t edited);
+void shutdown_asciimatic(void);
+
+#endif
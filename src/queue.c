@@ -0,0 +1,114 @@
+/* queue.c
+ * Bounded blocking queue connecting pipeline stages.
+ *
+ * Copyright (c) 2014 Nathan Taylor <nbtaylor@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "queue.h"
+#include "utils.h"
+
+struct queue {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+
+    void **items;
+    int capacity;
+    int head, count;
+    bool_t closed;
+};
+
+struct queue *
+queue_create(int capacity) {
+    struct queue *q = xcalloc(1, sizeof(*q));
+
+    q->capacity = capacity < 1 ? 1 : capacity;
+    q->items = xcalloc(q->capacity, sizeof(void *));
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+
+    return q;
+}
+
+/* Blocks while the queue is full.  Returns false, without taking ownership of
+ * item, if the queue has been closed.
+ */
+bool_t
+queue_push(struct queue *q, void *item) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->capacity && !q->closed) {
+        pthread_cond_wait(&q->not_full, &q->lock);
+    }
+    if (q->closed) {
+        pthread_mutex_unlock(&q->lock);
+        return false;
+    }
+
+    q->items[(q->head + q->count) % q->capacity] = item;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+
+    return true;
+}
+
+/* Blocks while the queue is empty.  Returns NULL once the queue has been
+ * closed and drained.
+ */
+void *
+queue_pop(struct queue *q) {
+    void *item = NULL;
+
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && !q->closed) {
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    }
+    if (q->count > 0) {
+        item = q->items[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+        pthread_cond_signal(&q->not_full);
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return item;
+}
+
+/* Producers call this when they're done; consumers drain what's left. */
+void
+queue_close(struct queue *q) {
+    pthread_mutex_lock(&q->lock);
+    q->closed = true;
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_cond_broadcast(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+}
+
+void
+queue_destroy(struct queue *q) {
+    if (q == NULL) {
+        return;
+    }
+    pthread_cond_destroy(&q->not_full);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_mutex_destroy(&q->lock);
+    free(q->items);
+    free(q);
+}
@@ -0,0 +1,15 @@
+#ifndef _QUEUE_H_
+#define _QUEUE_H_
+
+#include "main.h"
+
+/* A bounded, blocking FIFO of pointers for handing work between threads. */
+struct queue;
+
+struct queue *queue_create(int capacity);
+bool_t queue_push(struct queue *q, void *item);
+void *queue_pop(struct queue *q);
+void queue_close(struct queue *q);
+void queue_destroy(struct queue *q);
+
+#endif
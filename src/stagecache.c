@@ -0,0 +1,339 @@
+/* stagecache.c
+ * An on-disk, size-bounded cache of pipeline stage results, keyed by content.
+ *
+ * Copyright (c) 2014 Nathan Taylor <nbtaylor@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <opencv/cv.h>
+
+#include "logging.h"
+#include "stagecache.h"
+#include "trace.h"
+#include "utils.h"
+
+#define STAGE_MAGIC "ASCSTGE"
+
+/* On-disk layout: this header and then len bytes; images are stored as
+ * height rows of width bytes.  Host-endian, like the template cache.
+ */
+struct stage_header {
+    char magic[8];
+    uint32_t width, height;     /* 0 for anything but an image */
+    uint64_t key;
+    uint64_t len;
+};
+
+/* Hashes data into parent eight bytes at a time, as hash_cell() does. */
+uint64_t
+stage_key(uint64_t parent, const void *data, size_t len) {
+    const unsigned char *p = data;
+    uint64_t hash = parent ^ (len * 0x9e3779b97f4a7c15ULL);
+    size_t i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        uint64_t v;
+        memcpy(&v, p + i, sizeof(v));
+        hash = (hash ^ v) * 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 32;
+    }
+    for (; i < len; i++) {
+        hash = (hash ^ p[i]) * 0x100000001b3ULL;
+    }
+    hash = (hash ^ (hash >> 33)) * 0xc4ceb9fe1a85ec53ULL;
+    return hash ^ (hash >> 29);
+}
+
+/* NULL hashes differently from "". */
+uint64_t
+stage_key_string(uint64_t parent, const char *s) {
+    return s != NULL ? stage_key(parent, s, strlen(s) + 1) : stage_key(parent, NULL, 0);
+}
+
+static char *
+stage_path(const struct stage_cache *c, const char *stage, uint64_t key) {
+    char *path;
+
+    if (asprintf(&path, "%s/%016llx.%s", c->dir, (unsigned long long)key, stage) == -1) {
+        panic(1, "Can't allocate space for asprintf()");
+    }
+    return path;
+}
+
+/* Is name one of ours, "<16 hex digits>.<stage>"? */
+static bool_t
+is_stage_file(const char *name) {
+    for (int i = 0; i < 16; i++) {
+        if (!((name[i] >= '0' && name[i] <= '9') || (name[i] >= 'a' && name[i] <= 'f'))) {
+            return false;
+        }
+    }
+    return name[16] == '.' && name[17] != '\0' && strstr(name, ".tmp") == NULL;
+}
+
+struct stage_file {
+    char *name;
+    struct timespec mtime;
+    off_t size;
+};
+
+static int
+cmp_mtime(const void *a, const void *b) {
+    const struct timespec *x = &((const struct stage_file *)a)->mtime;
+    const struct timespec *y = &((const struct stage_file *)b)->mtime;
+
+    if (x->tv_sec != y->tv_sec) {
+        return x->tv_sec < y->tv_sec ? -1 : 1;
+    }
+    return (x->tv_nsec > y->tv_nsec) - (x->tv_nsec < y->tv_nsec);
+}
+
+/* Totals what the directory holds, and if that is over the limit deletes the
+ * least recently used files until it is back under nine tenths of it, so that
+ * evictions come in batches rather than one per store.
+ */
+static void
+scan(struct stage_cache *c, bool_t evict) {
+    struct stage_file *files = NULL;
+    int nfiles = 0, maxfiles = 0, evicted = 0;
+    struct dirent *de;
+    struct stat st;
+    DIR *d;
+
+    if ((d = opendir(c->dir)) == NULL) {
+        return;
+    }
+    TRACE_SCOPE("stage cache scan");
+    c->used = 0;
+    while ((de = readdir(d)) != NULL) {
+        if (!is_stage_file(de->d_name) || fstatat(dirfd(d), de->d_name, &st, 0) == -1) {
+            continue;
+        }
+        if (nfiles == maxfiles) {
+            maxfiles = maxfiles ? maxfiles * 2 : 256;
+            files = xrealloc(files, maxfiles * sizeof(*files));
+        }
+        files[nfiles].name = xstrdup(de->d_name);
+        files[nfiles].mtime = st.st_mtim;
+        files[nfiles].size = st.st_size;
+        c->used += st.st_size;
+        nfiles++;
+    }
+
+    if (evict && c->used > c->limit) {
+        qsort(files, nfiles, sizeof(*files), cmp_mtime);
+        for (int i = 0; i < nfiles && c->used > c->limit / 10 * 9; i++) {
+            if (unlinkat(dirfd(d), files[i].name, 0) == 0) {
+                c->used -= files[i].size;
+                evicted++;
+            }
+        }
+        xlog(LOG_DEBUG, "Evicted %d stage results from %s; %lld bytes left",
+             evicted, c->dir, (long long)c->used);
+    }
+
+    for (int i = 0; i < nfiles; i++) {
+        free(files[i].name);
+    }
+    free(files);
+    closedir(d);
+}
+
+/* Opens the cache in dir, creating it if need be; NULL or "" leaves caching
+ * off.  limit_mb bounds what it may hold.
+ */
+void
+stage_cache_open(struct stage_cache *c, const char *dir, long limit_mb) {
+    memset(c, 0, sizeof(*c));
+    if (dir == NULL || *dir == '\0') {
+        return;
+    }
+    if (make_dirs(dir) == -1) {
+        xlog(LOG_WARNING, "Can't create stage cache %s: %s; not caching", dir, strerror(errno));
+        return;
+    }
+    c->dir = xstrdup(dir);
+    c->limit = (off_t)limit_mb * 1024 * 1024;
+    pthread_mutex_init(&c->lock, NULL);
+    scan(c, true);
+    xlog(LOG_DEBUG, "Stage cache %s holds %lld bytes of at most %lld",
+         c->dir, (long long)c->used, (long long)c->limit);
+}
+
+void
+stage_cache_close(struct stage_cache *c) {
+    if (c->dir == NULL) {
+        return;
+    }
+    if (c->hits + c->misses > 0) {
+        xlog(LOG_INFO, "Stage cache: %ld hits, %ld misses", c->hits, c->misses);
+    }
+    pthread_mutex_destroy(&c->lock);
+    free(c->dir);
+    memset(c, 0, sizeof(*c));
+}
+
+/* Opens a stage result and checks its header against what is expected of
+ * it.  A hit is touched, which is what keeps it off the eviction end.
+ */
+static FILE *
+open_result(struct stage_cache *c, const char *stage, uint64_t key, struct stage_header *hdr) {
+    char *path;
+    FILE *f;
+
+    if (c->dir == NULL) {
+        return NULL;
+    }
+    path = stage_path(c, stage, key);
+    f = fopen(path, "rb");
+    if (f != NULL && (fread(hdr, sizeof(*hdr), 1, f) != 1 ||
+            memcmp(hdr->magic, STAGE_MAGIC, sizeof(hdr->magic)) != 0 || hdr->key != key)) {
+        xlog(LOG_WARNING, "Ignoring corrupt stage result %s", path);
+        fclose(f);
+        unlink(path);
+        f = NULL;
+    }
+    if (f != NULL) {
+        futimens(fileno(f), NULL);
+        __atomic_fetch_add(&c->hits, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_add(&c->misses, 1, __ATOMIC_RELAXED);
+    }
+    free(path);
+    return f;
+}
+
+/* Writes a result under a temporary name and renames it into place, so that
+ * another process reading the same key never sees half of it.
+ */
+static void
+save_result(struct stage_cache *c, const char *stage, uint64_t key, const struct stage_header *hdr,
+            const char *data, size_t row_len, int nrows, size_t step) {
+    static unsigned tmp_seq;
+    char *path, *tmp_path;
+    bool_t ok;
+    FILE *f;
+
+    if (c->dir == NULL) {
+        return;
+    }
+    path = stage_path(c, stage, key);
+    if (asprintf(&tmp_path, "%s.%d.%u.tmp", path, getpid(),
+                 __atomic_fetch_add(&tmp_seq, 1, __ATOMIC_RELAXED)) == -1) {
+        panic(1, "Can't allocate space for asprintf()");
+    }
+
+    TRACE_SCOPE("stage cache store");
+    if ((f = fopen(tmp_path, "wb")) == NULL) {
+        xlog(LOG_WARNING, "Can't write stage result %s: %s", tmp_path, strerror(errno));
+        free(tmp_path);
+        free(path);
+        return;
+    }
+    ok = fwrite(hdr, sizeof(*hdr), 1, f) == 1;
+    for (int y = 0; ok && y < nrows; y++) {
+        ok = fwrite(data + y * step, 1, row_len, f) == row_len;
+    }
+    if (fclose(f) != 0 || !ok || rename(tmp_path, path) == -1) {
+        xlog(LOG_WARNING, "Can't write stage result %s: %s", path, strerror(errno));
+        unlink(tmp_path);
+    } else {
+        pthread_mutex_lock(&c->lock);
+        c->used += sizeof(*hdr) + row_len * nrows;
+        if (c->used > c->limit) {
+            scan(c, true);
+        }
+        pthread_mutex_unlock(&c->lock);
+    }
+    free(tmp_path);
+    free(path);
+}
+
+/* Fills buf with the len bytes stored for stage and key, if there are exactly
+ * that many.
+ */
+bool_t
+stage_cache_get(struct stage_cache *c, const char *stage, uint64_t key, void *buf, size_t len) {
+    struct stage_header hdr;
+    FILE *f = open_result(c, stage, key, &hdr);
+    bool_t ok;
+
+    if (f == NULL) {
+        return false;
+    }
+    ok = hdr.width == 0 && hdr.height == 0 && hdr.len == len && fread(buf, 1, len, f) == len;
+    fclose(f);
+    return ok;
+}
+
+void
+stage_cache_put(struct stage_cache *c, const char *stage, uint64_t key, const void *buf, size_t len) {
+    struct stage_header hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, STAGE_MAGIC, sizeof(STAGE_MAGIC));
+    hdr.key = key;
+    hdr.len = len;
+    save_result(c, stage, key, &hdr, buf, len, 1, len);
+}
+
+/* Returns the 8-bit, single channel image stored for stage and key, or NULL. */
+IplImage *
+stage_cache_get_image(struct stage_cache *c, const char *stage, uint64_t key) {
+    struct stage_header hdr;
+    FILE *f = open_result(c, stage, key, &hdr);
+    IplImage *img;
+
+    if (f == NULL) {
+        return NULL;
+    }
+    if (hdr.width == 0 || hdr.height == 0 || hdr.width > 1 << 16 || hdr.height > 1 << 16 ||
+            hdr.len != (uint64_t)hdr.width * hdr.height) {
+        fclose(f);
+        return NULL;
+    }
+    img = cvCreateImage(cvSize(hdr.width, hdr.height), IPL_DEPTH_8U, 1);
+    for (uint32_t y = 0; y < hdr.height; y++) {
+        if (fread(img->imageData + y * img->widthStep, 1, hdr.width, f) != hdr.width) {
+            cvReleaseImage(&img);
+            break;
+        }
+    }
+    fclose(f);
+    return img;
+}
+
+void
+stage_cache_put_image(struct stage_cache *c, const char *stage, uint64_t key, const IplImage *img) {
+    struct stage_header hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, STAGE_MAGIC, sizeof(STAGE_MAGIC));
+    hdr.width = img->width;
+    hdr.height = img->height;
+    hdr.key = key;
+    hdr.len = (uint64_t)img->width * img->height;
+    save_result(c, stage, key, &hdr, img->imageData, img->width, img->height, img->widthStep);
+}
@@ -0,0 +1,48 @@
+#ifndef _STAGECACHE_H_
+#define _STAGECACHE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <opencv/cv.h>
+
+#include "main.h"
+
+/* A content-addressed cache of pipeline stage results on disk.  Each result
+ * is a file named by a 64-bit key and its stage, where the key hashes
+ * everything the result depends on: the input's bytes and every parameter of
+ * this stage and the ones before it, usually by chaining from the previous
+ * stage's key.  Files are touched when read, and once the directory grows past
+ * its limit the least recently used are deleted.  One cache can be used from
+ * several threads at once.
+ */
+struct stage_cache {
+    char *dir;          /* NULL if caching is off */
+    off_t limit;        /* bytes */
+    off_t used;         /* as of the last scan, plus whatever has been added */
+    long hits, misses;
+    pthread_mutex_t lock;       /* for used, and scanning */
+};
+
+/* Bump this whenever a stage can produce different output from the same
+ * inputs and settings (a fix to edge detection or matching, a change to a
+ * stage's layout), so that results cached by older builds are missed rather
+ * than read back.  Every key starts from STAGE_KEY_SEED, which mixes it in.
+ */
+#define STAGE_CACHE_VERSION 1
+
+#define STAGE_KEY_SEED (0xcbf29ce484222325ULL ^ (STAGE_CACHE_VERSION * 0x9e3779b97f4a7c15ULL))
+
+uint64_t stage_key(uint64_t parent, const void *data, size_t len);
+uint64_t stage_key_string(uint64_t parent, const char *s);
+
+void stage_cache_open(struct stage_cache *c, const char *dir, long limit_mb);
+void stage_cache_close(struct stage_cache *c);
+
+bool_t stage_cache_get(struct stage_cache *c, const char *stage, uint64_t key, void *buf, size_t len);
+void stage_cache_put(struct stage_cache *c, const char *stage, uint64_t key, const void *buf, size_t len);
+IplImage *stage_cache_get_image(struct stage_cache *c, const char *stage, uint64_t key);
+void stage_cache_put_image(struct stage_cache *c, const char *stage, uint64_t key, const IplImage *img);
+
+#endif
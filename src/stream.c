@@ -0,0 +1,315 @@
+/* stream.c
+ * Frame-by-frame conversion of video files, image sequences and cameras.
+ *
+ * Copyright (c) 2014 Nathan Taylor <nbtaylor@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libconfig.h>
+#include <opencv/cv.h>
+#include <opencv/highgui.h>
+
+#include "asciimatic.h"
+#include "edges.h"
+#include "encoder.h"
+#include "logging.h"
+#include "trace.h"
+#include "main.h"
+#include "pipeline.h"
+#include "stream.h"
+#include "utils.h"
+
+extern config_t config;
+extern FILE *output_file;
+extern enum output_format output_format;
+
+static volatile sig_atomic_t stop_requested;
+
+static void
+on_sigint(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+static double
+now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile of a sorted sample. */
+static double
+percentile(const double *sorted, int n, double p) {
+    int rank = (int)(p / 100.0 * n + 0.5);
+
+    if (rank < 1) {
+        rank = 1;
+    }
+    if (rank > n) {
+        rank = n;
+    }
+    return sorted[rank - 1];
+}
+
+/* A source made only of digits is a camera index (0 is /dev/video0);
+ * anything else is handed to OpenCV as a video file or an image sequence
+ * pattern such as "frames/%04d.png".
+ */
+static bool_t
+is_camera(const char *source) {
+    const char *p;
+
+    for (p = source; isdigit((unsigned char)*p); p++)
+        ;
+    return *source != '\0' && *p == '\0';
+}
+
+static CvCapture *
+open_source(const char *source) {
+    if (is_camera(source)) {
+        return cvCaptureFromCAM(atoi(source));
+    }
+    return cvCaptureFromFile(source);
+}
+
+/* Seconds between frames when playing source back: play_fps, or else the
+ * rate the file says it was recorded at, or else 25.  Cameras deliver frames
+ * in real time already and aren't paced.
+ */
+static double
+play_interval(const char *source, CvCapture *capture) {
+    double fps = 0;
+
+    if (is_camera(source)) {
+        return 0;
+    }
+    if (!config_lookup_float(&config, "play_fps", &fps) || fps <= 0) {
+        fps = cvGetCaptureProperty(capture, CV_CAP_PROP_FPS);
+    }
+    if (!(fps > 0 && fps <= 1000)) {
+        fps = 25;
+    }
+    return 1.0 / fps;
+}
+
+static void
+sleep_until(double when) {
+    struct timespec ts;
+
+    ts.tv_sec = (time_t)when;
+    ts.tv_nsec = (long)((when - ts.tv_sec) * 1e9);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR && !stop_requested)
+        ;
+}
+
+/* Runs smoothing, edge detection and matching on every frame of source until
+ * it runs dry or we're interrupted, writing each frame's grid to output_file.
+ * Cells whose edges are unchanged from the previous frame reuse their old
+ * character.  Frame-time percentiles are logged at the end.
+ *
+ * On a terminal, or when playing, each frame is drawn as just the cells that
+ * changed since the one before, in one write.  Playing also paces frames to
+ * the source's rate, dropping frames unconverted once more than a frame
+ * behind, for watching over links where bytes are what limit the frame rate.
+ */
+int
+run_stream(const char *source, int cols, int rows, bool_t play) {
+    struct cell_cache cache;
+    struct gradient gradient;
+    struct pyramid pyramid;
+    struct screen screen;
+    IplImage *gray = NULL, *edges = NULL;
+    double *times = NULL, *sizes = NULL;
+    int ntimes = 0, maxtimes = 0;
+    long matched = 0, empty = 0, reused = 0, changed = 0, read = 0, dropped = 0;
+    double target_fps = 0, interval = 0;
+    CvCapture *capture;
+
+    if ((capture = open_source(source)) == NULL) {
+        panic(1, "Can't open video source \"%s\"", source);
+    }
+    config_lookup_float(&config, "stream_fps", &target_fps);
+
+    char *grid = xmalloc(rows * (cols + 1));
+    unsigned char *colours = NULL;
+    bool_t tty = isatty(fileno(output_file));
+    bool_t delta = (tty || play) && output_format != OUTPUT_HTML;
+    struct encoder out;
+
+    if (play) {
+        interval = play_interval(source, capture);
+    }
+    memset(&screen, 0, sizeof(screen));
+
+    if (output_format_coloured(output_format)) {
+        colours = xmalloc((size_t)rows * cols * 3);
+    }
+    encoder_init(&out, output_file, output_format);
+    encoder_begin(&out);
+
+    cell_cache_init(&cache);
+    gradient_init(&gradient);
+    memset(&pyramid, 0, sizeof(pyramid));
+    signal(SIGINT, on_sigint);
+
+    double start = now();
+    while (!stop_requested) {
+        double t0 = now();
+        struct trace_span span = trace_span_begin("load");
+        IplImage *frame = cvQueryFrame(capture);
+        trace_span_end(&span);
+
+        if (frame == NULL) {
+            break;
+        }
+
+        /* Frame n is due n intervals after the start. */
+        double due = start + read++ * interval;
+        if (interval > 0 && t0 > due + interval) {
+            dropped++;
+            continue;
+        }
+
+        if (gray == NULL || gray->width != frame->width || gray->height != frame->height) {
+            cvReleaseImage(&gray);
+            gray = cvCreateImage(cvGetSize(frame), IPL_DEPTH_8U, 1);
+            if (frame->width < cols || frame->height < rows) {
+                panic(1, "%dx%d frames are too small for a %dx%d grid",
+                      frame->width, frame->height, cols, rows);
+            }
+        }
+        if (frame->nChannels == 1) {
+            cvCopy(frame, gray, NULL);
+        } else {
+            cvCvtColor(frame, gray, CV_BGR2GRAY);
+        }
+
+        /* Frames come in colour, so coloured output costs no extra decoding. */
+        if (colours != NULL) {
+            cell_colours(frame, rows, cols, colours);
+        }
+
+        IplImage *level = downscale_for_grid(pipeline, &pyramid, gray, rows, cols);
+
+        span = trace_span_begin("smooth");
+        cvSmooth(level, level, CV_GAUSSIAN, 3, 3, 0, 0);
+        trace_span_end(&span);
+
+        span = trace_span_begin("detect_edges");
+        gradient_compute(&gradient, level);
+        edges = gradient_threshold(&gradient, edges, first_thresh, second_thresh);
+        trace_span_end(&span);
+
+        asciify_grid_cached(pipeline, edges, rows, cols, grid, &cache);
+        matched += cache.matched;
+        empty += cache.empty;
+        reused += cache.reused;
+
+        if (ntimes == maxtimes) {
+            maxtimes = maxtimes ? 2 * maxtimes : 1024;
+            times = xrealloc(times, maxtimes * sizeof(double));
+            sizes = xrealloc(sizes, maxtimes * sizeof(double));
+        }
+        times[ntimes] = now() - t0;
+
+        if (interval > 0) {
+            sleep_until(due);
+        }
+        size_t written = out.written;
+        if (delta) {
+            encoder_frame(&out, &screen, grid, colours, rows, cols);
+            changed += screen.changed;
+        } else {
+            /* Separate frames with a form feed. */
+            if (output_format != OUTPUT_HTML) {
+                encoder_text(&out, "\f\n");
+            }
+            encoder_grid(&out, grid, colours, rows, cols);
+        }
+        sizes[ntimes++] = out.written - written;
+    }
+    double elapsed = now() - start;
+
+    signal(SIGINT, SIG_DFL);
+
+    if (ntimes > 0) {
+        qsort(times, ntimes, sizeof(double), cmp_double);
+        xlog(LOG_INFO, "%d frames in %.3fs (%.2f fps); frame time p50 %.2fms, p90 %.2fms, "
+             "p99 %.2fms, max %.2fms", ntimes, elapsed, ntimes / elapsed,
+             1e3 * percentile(times, ntimes, 50), 1e3 * percentile(times, ntimes, 90),
+             1e3 * percentile(times, ntimes, 99), 1e3 * times[ntimes - 1]);
+        xlog(LOG_INFO, "Matched %ld cells, skipped %ld empty cells, reused %ld unchanged cells (%.1f%%)",
+             matched, empty, reused, 100.0 * reused / MAX(matched + empty + reused, 1));
+
+        if (target_fps > 0) {
+            double budget = 1.0 / target_fps;
+            int over = 0;
+
+            while (over < ntimes && times[ntimes - 1 - over] > budget) {
+                over++;
+            }
+            xlog(LOG_INFO, "%d of %d frames (%.1f%%) missed the %.2fms budget for %.1f fps",
+                 over, ntimes, 100.0 * over / ntimes, 1e3 * budget, target_fps);
+        }
+
+        double total = 0;
+        for (int i = 0; i < ntimes; i++) {
+            total += sizes[i];
+        }
+        qsort(sizes, ntimes, sizeof(double), cmp_double);
+        xlog(LOG_INFO, "Wrote %.0f bytes a frame on average; p50 %.0f, p99 %.0f, max %.0f",
+             total / ntimes, percentile(sizes, ntimes, 50), percentile(sizes, ntimes, 99), sizes[ntimes - 1]);
+        if (delta) {
+            xlog(LOG_INFO, "Redrew %.1f%% of cells", 100.0 * changed / ((double)ntimes * rows * cols));
+        }
+    }
+    if (dropped > 0) {
+        xlog(LOG_INFO, "Dropped %ld of %ld frames to keep up with %.2f fps", dropped, read, 1 / interval);
+    }
+
+    if (delta) {
+        encoder_screen_end(&out, &screen);
+    }
+    free(times);
+    free(sizes);
+    encoder_end(&out);
+    encoder_free(&out);
+    free(grid);
+    free(colours);
+    cell_cache_free(&cache);
+    gradient_free(&gradient);
+    pyramid_free(&pyramid);
+    cvReleaseImage(&edges);
+    cvReleaseImage(&gray);
+    cvReleaseCapture(&capture);
+
+    return 0;
+}
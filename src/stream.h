@@ -0,0 +1,8 @@
+#ifndef _STREAM_H_
+#define _STREAM_H_
+
+#include "main.h"
+
+int run_stream(const char *source, int cols, int rows, bool_t play);
+
+#endif
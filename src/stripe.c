@@ -0,0 +1,232 @@
+/* stripe.c
+ * Bounded-memory conversion of huge images, a stripe of cell rows at a time.
+ *
+ * Copyright (c) 2014 Nathan Taylor <nbtaylor@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <libconfig.h>
+#include <opencv/cv.h>
+
+#include "asciimatic.h"
+#include "edges.h"
+#include "encoder.h"
+#include "logging.h"
+#include "main.h"
+#include "pipeline.h"
+#include "stripe.h"
+#include "trace.h"
+#include "utils.h"
+
+extern config_t config;
+extern FILE *output_file;
+extern enum output_format output_format;
+
+/* A binary (P5) PGM, mapped rather than read. */
+struct pgm {
+    unsigned char *map;
+    size_t size;
+    size_t offset;      /* of the first pixel */
+    int width, height;
+};
+
+/* Reads the next header number, skipping whitespace and comments. */
+static int
+pgm_number(const struct pgm *pgm, size_t *pos) {
+    long n = 0;
+
+    for (;;) {
+        while (*pos < pgm->size && isspace(pgm->map[*pos])) {
+            (*pos)++;
+        }
+        if (*pos < pgm->size && pgm->map[*pos] == '#') {
+            while (*pos < pgm->size && pgm->map[*pos] != '\n') {
+                (*pos)++;
+            }
+            continue;
+        }
+        break;
+    }
+    if (*pos >= pgm->size || !isdigit(pgm->map[*pos])) {
+        return -1;
+    }
+    while (*pos < pgm->size && isdigit(pgm->map[*pos]) && n <= 1 << 30) {
+        n = n * 10 + pgm->map[(*pos)++] - '0';
+    }
+    return n > 1 << 30 ? -1 : (int)n;
+}
+
+static void
+pgm_open(struct pgm *pgm, const char *path) {
+    struct stat st;
+    size_t pos = 2;
+    int fd, maxval;
+
+    if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+        panic(1, "Can't open %s: %s", path, strerror(errno));
+    }
+    pgm->size = st.st_size;
+    pgm->map = mmap(NULL, pgm->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (pgm->map == MAP_FAILED) {
+        panic(1, "Can't map %s: %s", path, strerror(errno));
+    }
+    close(fd);
+
+    if (pgm->size < 2 || memcmp(pgm->map, "P5", 2) != 0) {
+        panic(1, "%s isn't a binary PGM; striped mode only reads those "
+              "(convert it with e.g. `convert %s -depth 8 out.pgm`)", path, path);
+    }
+    pgm->width = pgm_number(pgm, &pos);
+    pgm->height = pgm_number(pgm, &pos);
+    maxval = pgm_number(pgm, &pos);
+    if (pgm->width <= 0 || pgm->height <= 0 || maxval <= 0 || maxval > 255) {
+        panic(1, "%s: bad or unsupported PGM header (only 8-bit images are read)", path);
+    }
+    /* Exactly one whitespace character ends the header. */
+    pgm->offset = pos + 1;
+    if (pgm->offset + (size_t)pgm->width * pgm->height > pgm->size) {
+        panic(1, "%s is truncated", path);
+    }
+    madvise(pgm->map, pgm->size, MADV_SEQUENTIAL);
+}
+
+/* Lets the kernel drop the mapped pages wholly before row y. */
+static void
+pgm_release(struct pgm *pgm, int y, size_t *released) {
+    long page = sysconf(_SC_PAGESIZE);
+    size_t end = (pgm->offset + (size_t)y * pgm->width) / page * page;
+
+    if (end > *released) {
+        madvise(pgm->map + *released, end - *released, MADV_DONTNEED);
+        *released = end;
+    }
+}
+
+/* Converts the PGM at path without ever holding more than a stripe of it.
+ * Each stripe is a few cell rows plus stripe_halo rows above and below, which
+ * give smoothing, Sobel and non-maximum suppression the context they need at
+ * the cut; hysteresis can in principle follow an edge any distance, so edges
+ * right at a cut may come out slightly differently than they would from the
+ * whole image.  Cell rows are written as soon as they are matched.
+ */
+int
+run_striped(const char *path, int cols, int rows) {
+    struct pgm pgm;
+    struct gradient gradient;
+    IplImage *window = NULL, *edges = NULL;
+    IplImage rowsrc, view;      /* headers over the mapping and over edges */
+    IplImage cells;             /* header over the stripe's own rows of the mapping */
+    struct encoder out;
+    int stripe_height, halo, nstripes = 0;
+    size_t released = 0;
+
+    memset(&pgm, 0, sizeof(pgm));
+    pgm_open(&pgm, path);
+    if (pgm.width < cols || pgm.height < rows) {
+        panic(1, "%dx%d is too small for a %dx%d grid", pgm.width, pgm.height, cols, rows);
+    }
+    if (!config_lookup_int(&config, "stripe_height", &stripe_height) || stripe_height < 1) {
+        stripe_height = 512;
+    }
+    if (!config_lookup_int(&config, "stripe_halo", &halo) || halo < 1) {
+        halo = 16;
+    }
+
+    int char_height = pgm.height / rows;
+    int per_stripe = MAX(stripe_height / char_height, 1);
+    char *grid = xmalloc(per_stripe * (cols + 1));
+    unsigned char *colours = NULL;
+
+    /* PGMs are gray, so coloured formats get each cell's mean gray. */
+    if (output_format_coloured(output_format)) {
+        colours = xmalloc((size_t)per_stripe * cols * 3);
+    }
+    encoder_init(&out, output_file, output_format);
+    encoder_begin(&out);
+
+    xlog(LOG_DEBUG, "Converting %dx%d in stripes of %d cell rows (%d pixels) with %d rows of halo",
+         pgm.width, pgm.height, per_stripe, per_stripe * char_height, halo);
+    gradient_init(&gradient);
+
+    for (int r0 = 0; r0 < rows; r0 += per_stripe) {
+        int n = MIN(per_stripe, rows - r0);
+        int y0 = r0 * char_height, y1 = y0 + n * char_height;
+        int top = MAX(y0 - halo, 0), bottom = MIN(y1 + halo, pgm.height);
+        struct trace_span span;
+
+        /* The stripe's rows, straight out of the mapping... */
+        cvInitImageHeader(&rowsrc, cvSize(pgm.width, bottom - top), IPL_DEPTH_8U, 1, IPL_ORIGIN_TL, 4);
+        cvSetData(&rowsrc, pgm.map + pgm.offset + (size_t)top * pgm.width, pgm.width);
+        if (window == NULL || window->height != bottom - top) {
+            cvReleaseImage(&window);
+            window = cvCreateImage(cvSize(pgm.width, bottom - top), IPL_DEPTH_8U, 1);
+        }
+
+        /* ...smoothed into a buffer of our own, since the mapping is read-only. */
+        span = trace_span_begin("smooth");
+        cvSmooth(&rowsrc, window, CV_GAUSSIAN, 3, 3, 0, 0);
+        trace_span_end(&span);
+
+        span = trace_span_begin("gradient");
+        gradient_compute(&gradient, window);
+        trace_span_end(&span);
+
+        span = trace_span_begin("hysteresis");
+        edges = gradient_threshold(&gradient, edges, first_thresh, second_thresh);
+        trace_span_end(&span);
+
+        /* Match only the stripe's own cells, leaving out the halo. */
+        cvInitImageHeader(&view, cvSize(pgm.width, y1 - y0), IPL_DEPTH_8U, 1, IPL_ORIGIN_TL, 4);
+        cvSetData(&view, edges->imageData + (y0 - top) * edges->widthStep, edges->widthStep);
+        {
+            TRACE_SCOPE("match");
+            asciify_grid(pipeline, &view, n, cols, grid);
+        }
+
+        if (colours != NULL) {
+            cvInitImageHeader(&cells, cvSize(pgm.width, y1 - y0), IPL_DEPTH_8U, 1, IPL_ORIGIN_TL, 4);
+            cvSetData(&cells, pgm.map + pgm.offset + (size_t)y0 * pgm.width, pgm.width);
+            cell_colours(&cells, n, cols, colours);
+        }
+        encoder_grid(&out, grid, colours, n, cols);
+
+        /* Nothing above the next stripe's halo is needed again. */
+        pgm_release(&pgm, MAX(y1 - halo, 0), &released);
+        nstripes++;
+    }
+
+    xlog(LOG_INFO, "Converted %dx%d in %d stripes; at most %d rows held at once",
+         pgm.width, pgm.height, nstripes, per_stripe * char_height + 2 * halo);
+
+    encoder_end(&out);
+    encoder_free(&out);
+    free(colours);
+    cvReleaseImage(&window);
+    cvReleaseImage(&edges);
+    gradient_free(&gradient);
+    free(grid);
+    munmap(pgm.map, pgm.size);
+
+    return 0;
+}
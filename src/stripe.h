@@ -0,0 +1,6 @@
+#ifndef _STRIPE_H_
+#define _STRIPE_H_
+
+int run_striped(const char *path, int cols, int rows);
+
+#endif
@@ -0,0 +1,439 @@
+/* templates.c
+ * Glyph template rendering and the on-disk template bank cache.
+ *
+ * Copyright (c) 2014 Nathan Taylor <nbtaylor@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cairo/cairo.h>
+#include <opencv/cv.h>
+
+#include "logging.h"
+#include "templates.h"
+#include "utils.h"
+
+#define BANK_MAGIC "ASCTMPL"
+
+/* On-disk layout: this header, the charset and font name (not terminated),
+ * then the pixel slab at pixels_offset.  All fields are host-endian; the cache
+ * is not meant to move between machines.
+ */
+struct bank_header {
+    char magic[8];
+    uint32_t renderer;
+    uint32_t width, height, count;
+    uint32_t charset_len, font_len;
+    uint32_t pixels_offset;
+};
+
+static struct template_bank *
+bank_alloc(const char *charset, const char *font, int w, int h) {
+    struct template_bank *bank = xcalloc(1, sizeof(*bank));
+
+    bank->charset = xstrdup(charset);
+    bank->font = xstrdup(font);
+    bank->width = w;
+    bank->height = h;
+    bank->count = strlen(charset);
+    bank->templates = xcalloc(bank->count + 1, sizeof(IplImage *));
+
+    return bank;
+}
+
+/* Points one image header per glyph into the pixel slab. */
+static void
+bank_wrap_pixels(struct template_bank *bank) {
+    size_t glyph_size = (size_t)bank->width * bank->height;
+
+    for (int i = 0; i < bank->count; i++) {
+        bank->templates[i] = cvCreateImageHeader(cvSize(bank->width, bank->height), IPL_DEPTH_8U, 1);
+        cvSetData(bank->templates[i], bank->pixels + i * glyph_size, bank->width);
+    }
+}
+
+/* Given the supplied set of valid characters, generate the templates we'll be
+ * matching against.
+ */
+static struct template_bank *
+render_templates(const char *charset, const char *font, int char_width, int char_height) {
+    struct template_bank *bank = bank_alloc(charset, font, char_width, char_height);
+    size_t glyph_size = (size_t)char_width * char_height;
+
+    bank->pixels = xmalloc(MAX(bank->count * glyph_size, 1));
+    bank_wrap_pixels(bank);
+
+    /* For each character, render each as a square image and then scale it to the
+     * (char_width x char_height) dimension.
+     */
+    for (int i = 0; i < bank->count; i++) {
+        cairo_text_extents_t te;
+        char c = charset[i];
+        char letter[2] = {c, '\0'};
+
+        cairo_surface_t *surface =
+            cairo_image_surface_create(CAIRO_FORMAT_ARGB32, char_width, char_height);
+        cairo_t *cr = cairo_create(surface);
+
+        /* Render the text onto the image. */
+        cairo_set_source_rgb (cr, 0, 0, 0);
+        cairo_paint(cr);
+
+        cairo_select_font_face(cr, font, CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
+        cairo_set_font_size(cr, (int)(char_height * (4.0/3))); // x px <-> (4/3)x pt
+        cairo_set_source_rgb(cr, 1.0, 1.0, 1.0);
+        cairo_text_extents (cr, letter, &te);
+        cairo_move_to(cr, (char_width / 2) - te.x_bearing - te.width / 2,
+                          (char_height / 2) - te.y_bearing - te.height / 2);
+        cairo_show_text(cr, letter);
+        cairo_surface_flush(surface);
+
+        /* Copy the Cairo surface into an IplImage... */
+        IplImage *image = cvCreateImageHeader(cvSize(char_width, char_height), IPL_DEPTH_8U, 4);
+        char *data = xmalloc(char_width * char_height * sizeof(uint32_t));
+        memcpy(data, cairo_image_surface_get_data(surface), char_width * char_height * sizeof(uint32_t));
+        cvSetData(image, data, char_width * sizeof(uint32_t));
+
+        /* ...next, convert to grayscale, straight into the slab. */
+        cvCvtColor(image, bank->templates[i], CV_RGB2GRAY);
+
+        free(image->imageData);
+        cvReleaseImageHeader(&image);
+        cairo_surface_destroy(surface);
+        cairo_destroy(cr);
+    }
+
+    return bank;
+}
+
+/* FNV-1a, used only to name cache files; the header is checked in full on
+ * load, so a collision just costs a re-render.
+ */
+static uint64_t
+fnv1a(uint64_t h, const void *p, size_t len) {
+    const unsigned char *c = p;
+
+    while (len--) {
+        h ^= *c++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static char *
+bank_path(const char *cache_dir, const char *charset, const char *font, int w, int h) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    uint32_t key[3] = {TEMPLATE_RENDERER_VERSION, w, h};
+    char *path;
+
+    hash = fnv1a(hash, key, sizeof(key));
+    hash = fnv1a(hash, charset, strlen(charset) + 1);
+    hash = fnv1a(hash, font, strlen(font) + 1);
+
+    if (asprintf(&path, "%s/%dx%d-%016llx.bank", cache_dir, w, h, (unsigned long long)hash) == -1) {
+        panic(1, "Can't allocate space for asprintf()");
+    }
+    return path;
+}
+
+static struct template_bank *
+bank_load(const char *path, const char *charset, const char *font, int w, int h) {
+    struct template_bank *bank;
+    struct bank_header hdr;
+    struct stat st;
+    void *map;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) == -1) {
+        return NULL;
+    }
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(hdr)) {
+        close(fd);
+        return NULL;
+    }
+
+    /* A shared read-only mapping: every process using the same bank shares
+     * the same physical pages.
+     */
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        xlog(LOG_WARNING, "Can't map template bank %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    memcpy(&hdr, map, sizeof(hdr));
+    size_t clen = strlen(charset), flen = strlen(font);
+    size_t pixels_len = clen * w * h;
+    if (memcmp(hdr.magic, BANK_MAGIC, sizeof(hdr.magic)) != 0 ||
+            hdr.renderer != TEMPLATE_RENDERER_VERSION ||
+            hdr.width != (uint32_t)w || hdr.height != (uint32_t)h ||
+            hdr.count != clen || hdr.charset_len != clen || hdr.font_len != flen ||
+            (size_t)st.st_size < sizeof(hdr) + clen + flen ||
+            (size_t)st.st_size < (size_t)hdr.pixels_offset + pixels_len ||
+            memcmp((char *)map + sizeof(hdr), charset, clen) != 0 ||
+            memcmp((char *)map + sizeof(hdr) + clen, font, flen) != 0) {
+        xlog(LOG_WARNING, "Ignoring stale or mismatched template bank %s", path);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    bank = bank_alloc(charset, font, w, h);
+    bank->map = map;
+    bank->map_len = st.st_size;
+    bank->pixels = (unsigned char *)map + hdr.pixels_offset;
+    bank_wrap_pixels(bank);
+
+    return bank;
+}
+
+/* Writes the bank out under a temporary name and renames it into place, so a
+ * concurrent reader never sees a partial file.
+ */
+static void
+bank_save(const struct template_bank *bank, const char *cache_dir, const char *path) {
+    struct bank_header hdr;
+    static const char zeros[64];
+    static unsigned tmp_seq;
+    char *tmp_path;
+    FILE *f;
+
+    if (make_dirs(cache_dir) == -1) {
+        xlog(LOG_WARNING, "Can't create template cache %s: %s", cache_dir, strerror(errno));
+        return;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, BANK_MAGIC, sizeof(BANK_MAGIC));
+    hdr.renderer = TEMPLATE_RENDERER_VERSION;
+    hdr.width = bank->width;
+    hdr.height = bank->height;
+    hdr.count = bank->count;
+    hdr.charset_len = strlen(bank->charset);
+    hdr.font_len = strlen(bank->font);
+
+    /* Keep the slab cache-line aligned within the mapping. */
+    size_t prefix = sizeof(hdr) + hdr.charset_len + hdr.font_len;
+    hdr.pixels_offset = (prefix + sizeof(zeros) - 1) & ~(sizeof(zeros) - 1);
+
+    /* Unique per writer: several contexts in one process may save the same
+     * bank at once.
+     */
+    if (asprintf(&tmp_path, "%s.%d.%u.tmp", path, getpid(),
+                 __atomic_fetch_add(&tmp_seq, 1, __ATOMIC_RELAXED)) == -1) {
+        panic(1, "Can't allocate space for asprintf()");
+    }
+    if ((f = fopen(tmp_path, "wb")) == NULL) {
+        xlog(LOG_WARNING, "Can't write template bank %s: %s", tmp_path, strerror(errno));
+        free(tmp_path);
+        return;
+    }
+
+    size_t pixels_len = (size_t)bank->count * bank->width * bank->height;
+    bool_t ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 &&
+        fwrite(bank->charset, 1, hdr.charset_len, f) == hdr.charset_len &&
+        fwrite(bank->font, 1, hdr.font_len, f) == hdr.font_len &&
+        fwrite(zeros, 1, hdr.pixels_offset - prefix, f) == hdr.pixels_offset - prefix &&
+        fwrite(bank->pixels, 1, pixels_len, f) == pixels_len;
+
+    if (fclose(f) != 0 || !ok || rename(tmp_path, path) == -1) {
+        xlog(LOG_WARNING, "Can't write template bank %s: %s", path, strerror(errno));
+        unlink(tmp_path);
+    }
+    free(tmp_path);
+}
+
+/* Banks handed out recently, most recently used first, shared by every
+ * context in the process so that a cell size one has rendered is warm for the
+ * rest.  Idle banks beyond kept_capacity are dropped from the tail; banks in
+ * use stay until they are given back.  Off until template_bank_keep().
+ */
+static pthread_mutex_t kept_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct template_bank *kept_head, *kept_tail;
+static int kept_count, kept_capacity;
+
+static void bank_destroy(struct template_bank *bank);
+
+static void
+kept_unlink(struct template_bank *bank) {
+    if (bank->prev != NULL) {
+        bank->prev->next = bank->next;
+    } else {
+        kept_head = bank->next;
+    }
+    if (bank->next != NULL) {
+        bank->next->prev = bank->prev;
+    } else {
+        kept_tail = bank->prev;
+    }
+    bank->prev = bank->next = NULL;
+    kept_count--;
+}
+
+static void
+kept_push(struct template_bank *bank) {
+    bank->prev = NULL;
+    bank->next = kept_head;
+    if (kept_head != NULL) {
+        kept_head->prev = bank;
+    } else {
+        kept_tail = bank;
+    }
+    kept_head = bank;
+    kept_count++;
+}
+
+/* Called with kept_lock held. */
+static void
+kept_evict(void) {
+    struct template_bank *bank = kept_tail, *prev;
+
+    while (kept_count > kept_capacity && bank != NULL) {
+        prev = bank->prev;
+        if (bank->refs == 0) {
+            xlog(LOG_DEBUG, "Dropping %dx%d template bank", bank->width, bank->height);
+            kept_unlink(bank);
+            bank_destroy(bank);
+        }
+        bank = prev;
+    }
+}
+
+/* Called with kept_lock held.  Takes a reference to what it finds. */
+static struct template_bank *
+kept_find(const char *charset, const char *font, int w, int h) {
+    for (struct template_bank *bank = kept_head; bank != NULL; bank = bank->next) {
+        if (bank->width == w && bank->height == h &&
+                strcmp(bank->charset, charset) == 0 && strcmp(bank->font, font) == 0) {
+            kept_unlink(bank);
+            kept_push(bank);
+            bank->refs++;
+            return bank;
+        }
+    }
+    return NULL;
+}
+
+/* Keeps up to capacity idle banks around for template_bank_get() to share;
+ * 0 keeps none.
+ */
+void
+template_bank_keep(int capacity) {
+    pthread_mutex_lock(&kept_lock);
+    kept_capacity = MAX(capacity, 0);
+    kept_evict();
+    pthread_mutex_unlock(&kept_lock);
+}
+
+static struct template_bank *
+bank_fetch(const char *cache_dir, const char *charset, const char *font, int w, int h) {
+    struct template_bank *bank;
+    char *path;
+
+    if (cache_dir == NULL || *cache_dir == '\0') {
+        return render_templates(charset, font, w, h);
+    }
+
+    path = bank_path(cache_dir, charset, font, w, h);
+    if ((bank = bank_load(path, charset, font, w, h)) != NULL) {
+        xlog(LOG_DEBUG, "Mapped template bank %s", path);
+    } else {
+        bank = render_templates(charset, font, w, h);
+        bank_save(bank, cache_dir, path);
+    }
+    free(path);
+
+    return bank;
+}
+
+/* Returns the template bank for the given charset, font and cell size.  With a
+ * cache directory, a previously rendered bank is mapped straight from disk and
+ * a freshly rendered one is saved there; with none, cairo renders every time.
+ * Kept banks are looked for first.
+ */
+struct template_bank *
+template_bank_get(const char *cache_dir, const char *charset, const char *font, int w, int h) {
+    struct template_bank *bank, *other;
+
+    pthread_mutex_lock(&kept_lock);
+    bank = kept_capacity > 0 ? kept_find(charset, font, w, h) : NULL;
+    pthread_mutex_unlock(&kept_lock);
+    if (bank != NULL) {
+        return bank;
+    }
+
+    /* Rendered without the lock, so another thread may beat us to it. */
+    bank = bank_fetch(cache_dir, charset, font, w, h);
+
+    pthread_mutex_lock(&kept_lock);
+    if (kept_capacity > 0) {
+        if ((other = kept_find(charset, font, w, h)) != NULL) {
+            bank_destroy(bank);
+            bank = other;
+        } else {
+            bank->kept = true;
+            bank->refs = 1;
+            kept_push(bank);
+            kept_evict();
+        }
+    }
+    pthread_mutex_unlock(&kept_lock);
+
+    return bank;
+}
+
+/* Gives a bank back; kept banks stay around for the next caller. */
+void
+template_bank_free(struct template_bank *bank) {
+    if (bank == NULL) {
+        return;
+    }
+    if (!bank->kept) {
+        bank_destroy(bank);
+        return;
+    }
+
+    pthread_mutex_lock(&kept_lock);
+    bank->refs--;
+    kept_evict();
+    pthread_mutex_unlock(&kept_lock);
+}
+
+static void
+bank_destroy(struct template_bank *bank) {
+    for (int i = 0; i < bank->count; i++) {
+        cvReleaseImageHeader(&bank->templates[i]);
+    }
+    if (bank->map != NULL) {
+        munmap(bank->map, bank->map_len);
+    } else {
+        free(bank->pixels);
+    }
+    free(bank->templates);
+    free(bank->charset);
+    free(bank->font);
+    free(bank);
+}
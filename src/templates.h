@@ -0,0 +1,38 @@
+#ifndef _TEMPLATES_H_
+#define _TEMPLATES_H_
+
+#include <stddef.h>
+
+#include <opencv/cv.h>
+
+/* Bump whenever a change to render_templates() would produce different pixels,
+ * so that stale on-disk banks are re-rendered rather than reused.
+ */
+#define TEMPLATE_RENDERER_VERSION 1
+
+/* One grayscale template per character of the charset.  The pixels of every
+ * template live in a single tightly-packed slab, either heap-allocated or
+ * mapped read-only from the on-disk cache.
+ */
+struct template_bank {
+    char *charset;
+    char *font;
+    int width, height, count;
+    IplImage **templates;   /* count + 1 entries, NULL-terminated */
+
+    unsigned char *pixels;  /* count * height * width */
+    void *map;              /* non-NULL if pixels point into a mapped file */
+    size_t map_len;
+
+    /* Kept banks are shared: see template_bank_keep(). */
+    int refs;
+    struct template_bank *prev, *next;
+    int kept;
+};
+
+struct template_bank *template_bank_get(const char *cache_dir, const char *charset,
+                                        const char *font, int w, int h);
+void template_bank_free(struct template_bank *bank);
+void template_bank_keep(int capacity);
+
+#endif
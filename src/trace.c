@@ -0,0 +1,286 @@
+/* trace.c
+ * Scoped timers, per-thread spans and counters, exported as Chrome trace JSON.
+ *
+ * Copyright (c) 2014 Nathan Taylor <nbtaylor@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "trace.h"
+#include "utils.h"
+
+#define EVENTS_PER_CHUNK 4096
+
+/* A span ("X" event) or, with name NULL, a counter sample ("C" event). */
+struct trace_event {
+    const char *name;
+    uint64_t start, dur;
+    int counter;
+    long value;
+};
+
+struct trace_chunk {
+    struct trace_chunk *next;
+    int used;
+    struct trace_event events[EVENTS_PER_CHUNK];
+};
+
+/* Each thread only ever appends to its own buffer, so recording needs no
+ * locks; the list of buffers is only walked once every thread is done.
+ */
+struct trace_buffer {
+    struct trace_buffer *next;
+    int tid;
+    const char *thread_name;
+    struct trace_chunk *head, *tail;
+};
+
+static const char *counter_names[NUM_TRACE_COUNTERS] = {
+    "cells matched", "cells pruned", "cells empty", "cells reused", "allocations"
+};
+
+bool_t trace_enabled;
+static char *trace_path;
+static uint64_t trace_epoch;
+static long counters[NUM_TRACE_COUNTERS];
+
+static pthread_mutex_t buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_buffer *buffers;
+static int next_tid;
+static __thread struct trace_buffer *my_buffer;
+
+uint64_t
+trace_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Trace storage comes straight from malloc() rather than the x* wrappers, so
+ * that tracing doesn't show up in the allocation counts it reports.
+ */
+static struct trace_chunk *
+new_chunk(void) {
+    struct trace_chunk *c = calloc(1, sizeof(*c));
+
+    if (c == NULL) {
+        panic(1, "Can't allocate trace buffer");
+    }
+    return c;
+}
+
+static struct trace_buffer *
+thread_buffer(void) {
+    struct trace_buffer *b = my_buffer;
+
+    if (b != NULL) {
+        return b;
+    }
+    if ((b = calloc(1, sizeof(*b))) == NULL) {
+        panic(1, "Can't allocate trace buffer");
+    }
+    b->head = b->tail = new_chunk();
+
+    pthread_mutex_lock(&buffers_lock);
+    b->tid = ++next_tid;
+    b->next = buffers;
+    buffers = b;
+    pthread_mutex_unlock(&buffers_lock);
+
+    return my_buffer = b;
+}
+
+static struct trace_event *
+next_event(void) {
+    struct trace_buffer *b = thread_buffer();
+
+    if (b->tail->used == EVENTS_PER_CHUNK) {
+        b->tail->next = new_chunk();
+        b->tail = b->tail->next;
+    }
+    return &b->tail->events[b->tail->used++];
+}
+
+/* Starts tracing, to be written to path at trace_shutdown().  A NULL path
+ * leaves tracing off.
+ */
+void
+trace_init(const char *path) {
+    if (path == NULL) {
+        return;
+    }
+    trace_path = xstrdup(path);
+    trace_epoch = trace_now();
+    trace_enabled = true;
+    trace_thread_name("main");
+}
+
+void
+trace_thread_name(const char *name) {
+    if (trace_enabled) {
+        thread_buffer()->thread_name = name;
+    }
+}
+
+void
+trace_span_end(struct trace_span *span) {
+    if (!trace_enabled || span->start == 0) {
+        return;
+    }
+
+    uint64_t end = trace_now();
+    struct trace_event *e = next_event();
+
+    e->name = span->name;
+    e->start = span->start;
+    e->dur = end - span->start;
+}
+
+void
+trace_count(enum trace_counter counter, long delta) {
+    if (!trace_enabled) {
+        return;
+    }
+
+    long value = __sync_add_and_fetch(&counters[counter], delta);
+    struct trace_event *e = next_event();
+
+    e->start = trace_now();
+    e->counter = counter;
+    e->value = value;
+}
+
+struct span_summary {
+    const char *name;
+    long count;
+    uint64_t total, max;
+};
+
+static int
+cmp_summaries(const void *a, const void *b) {
+    const struct span_summary *x = a, *y = b;
+
+    return x->total < y->total ? 1 : x->total > y->total ? -1 : 0;
+}
+
+static void
+log_summary(void) {
+    struct span_summary *sums = NULL;
+    int nsums = 0, i;
+
+    for (struct trace_buffer *b = buffers; b != NULL; b = b->next) {
+        for (struct trace_chunk *c = b->head; c != NULL; c = c->next) {
+            for (int k = 0; k < c->used; k++) {
+                struct trace_event *e = &c->events[k];
+
+                if (e->name == NULL) {
+                    continue;
+                }
+                for (i = 0; i < nsums && strcmp(sums[i].name, e->name) != 0; i++)
+                    ;
+                if (i == nsums) {
+                    sums = xrealloc(sums, ++nsums * sizeof(*sums));
+                    memset(&sums[i], 0, sizeof(*sums));
+                    sums[i].name = e->name;
+                }
+                sums[i].count++;
+                sums[i].total += e->dur;
+                if (e->dur > sums[i].max) {
+                    sums[i].max = e->dur;
+                }
+            }
+        }
+    }
+    qsort(sums, nsums, sizeof(*sums), cmp_summaries);
+
+    xlog(LOG_INFO, "%-20s %8s %12s %12s %12s", "span", "count", "total ms", "mean ms", "max ms");
+    for (i = 0; i < nsums; i++) {
+        xlog(LOG_INFO, "%-20s %8ld %12.3f %12.3f %12.3f", sums[i].name, sums[i].count,
+             sums[i].total / 1e6, sums[i].total / 1e6 / sums[i].count, sums[i].max / 1e6);
+    }
+    for (i = 0; i < NUM_TRACE_COUNTERS; i++) {
+        xlog(LOG_INFO, "%-20s %8ld", counter_names[i], counters[i]);
+    }
+    free(sums);
+}
+
+static void
+write_json(void) {
+    FILE *f = xfopen(trace_path, "w");
+    int pid = getpid();
+    const char *sep = "";
+
+    fprintf(f, "{\"traceEvents\":[\n");
+    for (struct trace_buffer *b = buffers; b != NULL; b = b->next) {
+        if (b->thread_name != NULL) {
+            fprintf(f, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,"
+                    "\"args\":{\"name\":\"%s\"}}", sep, pid, b->tid, b->thread_name);
+            sep = ",\n";
+        }
+        for (struct trace_chunk *c = b->head; c != NULL; c = c->next) {
+            for (int k = 0; k < c->used; k++) {
+                struct trace_event *e = &c->events[k];
+                double ts = (e->start - trace_epoch) / 1e3;
+
+                if (e->name != NULL) {
+                    fprintf(f, "%s{\"ph\":\"X\",\"name\":\"%s\",\"pid\":%d,\"tid\":%d,"
+                            "\"ts\":%.3f,\"dur\":%.3f}", sep, e->name, pid, b->tid, ts, e->dur / 1e3);
+                } else {
+                    fprintf(f, "%s{\"ph\":\"C\",\"name\":\"%s\",\"pid\":%d,\"ts\":%.3f,"
+                            "\"args\":{\"value\":%ld}}", sep, counter_names[e->counter], pid, ts, e->value);
+                }
+                sep = ",\n";
+            }
+        }
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+}
+
+/* Writes out the trace and the summary.  Every traced thread must have
+ * finished by now.
+ */
+void
+trace_shutdown(void) {
+    if (!trace_enabled) {
+        return;
+    }
+    trace_enabled = false;
+
+    log_summary();
+    write_json();
+    xlog(LOG_INFO, "Wrote trace to %s", trace_path);
+
+    while (buffers != NULL) {
+        struct trace_buffer *b = buffers;
+
+        buffers = b->next;
+        while (b->head != NULL) {
+            struct trace_chunk *c = b->head;
+            b->head = c->next;
+            free(c);
+        }
+        free(b);
+    }
+    free(trace_path);
+    trace_path = NULL;
+}
@@ -0,0 +1,53 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+#include "main.h"
+
+/* Lightweight tracing of where the time goes.  Spans are recorded into
+ * per-thread buffers without locking, and written out as Chrome trace-event
+ * JSON (load it in chrome://tracing or Perfetto) plus a summary table in the
+ * log when the program exits.  When tracing is off, a span costs one branch.
+ *
+ * Span and counter names must be string literals, or at least outlive the
+ * trace.
+ */
+enum trace_counter {
+    TRACE_CELLS_MATCHED,
+    TRACE_CELLS_PRUNED,
+    TRACE_CELLS_EMPTY,
+    TRACE_CELLS_REUSED,
+    TRACE_ALLOCATIONS,
+    NUM_TRACE_COUNTERS
+};
+
+struct trace_span {
+    const char *name;
+    uint64_t start;
+};
+
+extern bool_t trace_enabled;
+
+void trace_init(const char *path);
+void trace_shutdown(void);
+void trace_thread_name(const char *name);
+
+uint64_t trace_now(void);
+void trace_span_end(struct trace_span *span);
+void trace_count(enum trace_counter counter, long delta);
+
+static inline struct trace_span
+trace_span_begin(const char *name) {
+    struct trace_span span = { name, trace_enabled ? trace_now() : 0 };
+    return span;
+}
+
+/* Times the rest of the enclosing block. */
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) \
+    struct trace_span TRACE_CONCAT(trace_span_, __LINE__) \
+        __attribute__((cleanup(trace_span_end), unused)) = trace_span_begin(name)
+
+#endif
@@ -0,0 +1,324 @@
+/* tree.c
+ * Decision-tree cell classifier: features, training, and model files.
+ *
+ * Copyright (c) 2014 Nathan Taylor <nbtaylor@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "classify.h"
+#include "logging.h"
+#include "tree.h"
+#include "utils.h"
+
+#define TREE_MAGIC "asciimatic-tree"
+#define TREE_VERSION 2
+
+void
+tree_features(const unsigned char *cell, int step, int w, int h, float *features) {
+    int ink = 0;
+
+    cell_signature(cell, step, w, h, 1, features);
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            ink += cell[y * step + x] != 0;
+        }
+    }
+    features[SIG_LEN] = (float)ink / (w * h);
+}
+
+/* Model files are text: a header line, the character set the model was
+ * trained on, then one line per node, the root first and every node before its
+ * children:
+ *
+ *     asciimatic-tree <version> <features> <nodes> <characters>
+ *     <character> ...
+ *     <feature> <threshold> <left> <right> <glyph> <confidence>
+ *
+ * Leaves have a feature of -1; glyphs and characters are character codes.
+ * Version 1 files have neither the character count nor the character line.
+ *
+ * Returns NULL, having logged why, if the file can't be read or isn't a model
+ * this build can use.
+ */
+struct tree_model *
+tree_load(const char *path) {
+    FILE *f = fopen(path, "r");
+    struct tree_model *m;
+    int version, features, nchars = 0, i;
+
+    if (f == NULL) {
+        xlog(LOG_ERR, "Can't open %s: %s", path, strerror(errno));
+        return NULL;
+    }
+    m = xcalloc(1, sizeof(*m));
+
+    if (fscanf(f, TREE_MAGIC " %d %d %d", &version, &features, &m->nnodes) != 3 || m->nnodes < 1 ||
+            (version >= 2 && (fscanf(f, "%d", &nchars) != 1 || nchars < 1 || nchars > 255))) {
+        xlog(LOG_ERR, "%s isn't a decision tree model", path);
+        goto bad;
+    }
+    if (version < 1 || version > TREE_VERSION || features != TREE_FEATURES) {
+        xlog(LOG_ERR, "%s was trained on different features; train it again with -L", path);
+        goto bad;
+    }
+
+    if (nchars > 0) {
+        m->charset = xcalloc(nchars + 1, 1);
+        for (i = 0; i < nchars; i++) {
+            int c;
+
+            if (fscanf(f, "%d", &c) != 1 || c < 1 || c > 255) {
+                xlog(LOG_ERR, "%s: malformed character set", path);
+                goto bad;
+            }
+            m->charset[i] = c;
+        }
+    }
+
+    m->nodes = xcalloc(m->nnodes, sizeof(*m->nodes));
+    for (i = 0; i < m->nnodes; i++) {
+        struct tree_node *n = &m->nodes[i];
+        int glyph;
+
+        if (fscanf(f, "%d %f %d %d %d %f", &n->feature, &n->threshold, &n->left, &n->right,
+                   &glyph, &n->confidence) != 6) {
+            xlog(LOG_ERR, "%s: truncated or malformed at node %d", path, i);
+            goto bad;
+        }
+        if (n->feature >= TREE_FEATURES ||
+                (n->feature >= 0 && (n->left <= i || n->right <= i ||
+                                     n->left >= m->nnodes || n->right >= m->nnodes)) ||
+                (n->feature < 0 && (glyph < 1 || glyph > 255))) {
+            xlog(LOG_ERR, "%s: bad node %d", path, i);
+            goto bad;
+        }
+        n->glyph = glyph;
+    }
+
+    fclose(f);
+    return m;
+
+bad:
+    fclose(f);
+    tree_free(m);
+    return NULL;
+}
+
+void
+tree_save(const struct tree_model *m, const char *path) {
+    FILE *f = xfopen(path, "w");
+    int nchars = strlen(m->charset);
+
+    fprintf(f, "%s %d %d %d %d\n", TREE_MAGIC, TREE_VERSION, TREE_FEATURES, m->nnodes, nchars);
+    for (int i = 0; i < nchars; i++) {
+        fprintf(f, "%d%c", (unsigned char)m->charset[i], i + 1 < nchars ? ' ' : '\n');
+    }
+    for (int i = 0; i < m->nnodes; i++) {
+        const struct tree_node *n = &m->nodes[i];
+
+        fprintf(f, "%d %.9g %d %d %d %.6f\n", n->feature, n->threshold, n->left, n->right,
+                (unsigned char)n->glyph, n->confidence);
+    }
+    if (fclose(f) != 0) {
+        panic(1, "Can't write %s", path);
+    }
+}
+
+void
+tree_free(struct tree_model *m) {
+    if (m == NULL) {
+        return;
+    }
+    free(m->nodes);
+    free(m->charset);
+    free(m);
+}
+
+void
+tree_samples_add(struct tree_samples *s, const float *features, char label) {
+    if (s->count == s->size) {
+        s->size = s->size ? s->size * 2 : 1024;
+        s->features = xrealloc(s->features, (size_t)s->size * TREE_FEATURES * sizeof(float));
+        s->labels = xrealloc(s->labels, s->size);
+    }
+    memcpy(s->features + (size_t)s->count * TREE_FEATURES, features, TREE_FEATURES * sizeof(float));
+    s->labels[s->count++] = label;
+}
+
+void
+tree_samples_free(struct tree_samples *s) {
+    free(s->features);
+    free(s->labels);
+    memset(s, 0, sizeof(*s));
+}
+
+/* CART with Gini impurity.  Each node sorts its samples along every feature
+ * and tries every cut between distinct values; that is plenty fast for the few
+ * hundred thousand cells of a corpus and the couple of dozen features.
+ */
+struct split_key {
+    float value;
+    unsigned char label;
+};
+
+struct trainer {
+    const struct tree_samples *s;
+    int max_depth, min_leaf;
+    int *idx;                   /* samples, partitioned as the tree grows */
+    struct split_key *keys;
+    struct tree_model *m;
+    int size;
+};
+
+static int
+cmp_keys(const void *a, const void *b) {
+    float x = ((const struct split_key *)a)->value, y = ((const struct split_key *)b)->value;
+
+    return (x > y) - (x < y);
+}
+
+static int
+new_node(struct trainer *t) {
+    if (t->m->nnodes == t->size) {
+        t->size = t->size ? t->size * 2 : 64;
+        t->m->nodes = xrealloc(t->m->nodes, t->size * sizeof(*t->m->nodes));
+    }
+    return t->m->nnodes++;
+}
+
+/* Builds the subtree for samples idx[lo, hi) and returns its root. */
+static int
+grow(struct trainer *t, int lo, int hi, int depth) {
+    const float *features = t->s->features;
+    int n = hi - lo, node = new_node(t);
+    int counts[256], left[256], right[256];
+    int best = 0, bf = -1, i, k, f;
+    long long sumsq = 0;
+    float bthresh = 0;
+
+    memset(counts, 0, sizeof(counts));
+    for (i = lo; i < hi; i++) {
+        counts[(unsigned char)t->s->labels[t->idx[i]]]++;
+    }
+    for (i = 0; i < 256; i++) {
+        sumsq += (long long)counts[i] * counts[i];
+        if (counts[i] > counts[best]) {
+            best = i;
+        }
+    }
+
+    struct tree_node *leaf = &t->m->nodes[node];
+    leaf->feature = -1;
+    leaf->threshold = 0;
+    leaf->left = leaf->right = 0;
+    leaf->glyph = best;
+    leaf->confidence = (float)counts[best] / n;
+    if (depth >= t->max_depth || counts[best] == n || n < 2 * t->min_leaf) {
+        return node;
+    }
+
+    /* Weighted impurity, n * (1 - sum p^2), of the node and of each cut;
+     * sums of squared counts are updated as one sample at a time crosses over.
+     */
+    double bscore = n - (double)sumsq / n - 1e-9;
+    for (f = 0; f < TREE_FEATURES; f++) {
+        for (k = 0; k < n; k++) {
+            t->keys[k].value = features[(size_t)t->idx[lo + k] * TREE_FEATURES + f];
+            t->keys[k].label = t->s->labels[t->idx[lo + k]];
+        }
+        qsort(t->keys, n, sizeof(*t->keys), cmp_keys);
+
+        memset(left, 0, sizeof(left));
+        memcpy(right, counts, sizeof(right));
+        long long sl = 0, sr = sumsq;
+        for (k = 0; k + 1 < n; k++) {
+            int c = t->keys[k].label, nl = k + 1, nr = n - nl;
+
+            sl += 2 * left[c] + 1;
+            left[c]++;
+            sr -= 2 * right[c] - 1;
+            right[c]--;
+
+            if (t->keys[k].value == t->keys[k + 1].value || nl < t->min_leaf || nr < t->min_leaf) {
+                continue;
+            }
+            double score = (nl - (double)sl / nl) + (nr - (double)sr / nr);
+            if (score < bscore) {
+                float a = t->keys[k].value, b = t->keys[k + 1].value;
+
+                bscore = score;
+                bf = f;
+                bthresh = a + (b - a) / 2;
+                if (bthresh >= b) {
+                    bthresh = a;
+                }
+            }
+        }
+    }
+    if (bf < 0) {
+        return node;
+    }
+
+    int mid = lo;
+    for (i = lo; i < hi; i++) {
+        if (features[(size_t)t->idx[i] * TREE_FEATURES + bf] <= bthresh) {
+            int tmp = t->idx[i];
+            t->idx[i] = t->idx[mid];
+            t->idx[mid++] = tmp;
+        }
+    }
+
+    /* Children may move the node array, so only index it afterwards. */
+    int l = grow(t, lo, mid, depth + 1);
+    int r = grow(t, mid, hi, depth + 1);
+    t->m->nodes[node].feature = bf;
+    t->m->nodes[node].threshold = bthresh;
+    t->m->nodes[node].left = l;
+    t->m->nodes[node].right = r;
+    return node;
+}
+
+/* Trains a tree at most max_depth comparisons deep, with at least min_leaf
+ * samples at every leaf.
+ */
+struct tree_model *
+tree_train(const struct tree_samples *s, int max_depth, int min_leaf) {
+    struct trainer t;
+
+    if (s->count == 0) {
+        panic(1, "Nothing to train on: every cell was empty");
+    }
+
+    memset(&t, 0, sizeof(t));
+    t.s = s;
+    t.max_depth = max_depth;
+    t.min_leaf = MAX(min_leaf, 1);
+    t.idx = xmalloc(s->count * sizeof(int));
+    t.keys = xmalloc(s->count * sizeof(*t.keys));
+    t.m = xcalloc(1, sizeof(*t.m));
+    for (int i = 0; i < s->count; i++) {
+        t.idx[i] = i;
+    }
+
+    grow(&t, 0, s->count, 0);
+
+    free(t.idx);
+    free(t.keys);
+    return t.m;
+}
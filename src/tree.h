@@ -0,0 +1,58 @@
+#ifndef _TREE_H_
+#define _TREE_H_
+
+#include "classify.h"
+
+/* A decision tree over a few cheap features of a cell, trained offline (-L)
+ * on what the exact matcher made of a corpus, and used by the "tree" matcher
+ * to classify cells in a handful of comparisons.
+ *
+ * The features are the cell's signature from classify.c (ink density over a
+ * grid and stroke orientations, both normalised) plus the fraction of its
+ * pixels that are edges.  None depend on the cell size.
+ */
+#define TREE_FEATURES (SIG_LEN + 1)
+
+struct tree_node {
+    int feature;        /* -1 for a leaf */
+    float threshold;    /* go left if feature <= threshold */
+    int left, right;
+    char glyph;         /* leaves only */
+    float confidence;   /* the fraction of training cells at this leaf that were glyph */
+};
+
+struct tree_model {
+    int nnodes;
+    struct tree_node *nodes;
+    char *charset;      /* what it was trained on; NULL if the file predates that */
+};
+
+/* Labelled cells to train on. */
+struct tree_samples {
+    int count, size;
+    float *features;    /* count x TREE_FEATURES */
+    char *labels;
+};
+
+void tree_features(const unsigned char *cell, int step, int w, int h, float *features);
+
+static inline char
+tree_classify(const struct tree_model *m, const float *features, float *confidence) {
+    const struct tree_node *n = m->nodes;
+
+    while (n->feature >= 0) {
+        n = &m->nodes[features[n->feature] <= n->threshold ? n->left : n->right];
+    }
+    *confidence = n->confidence;
+    return n->glyph;
+}
+
+struct tree_model *tree_load(const char *path);
+void tree_save(const struct tree_model *m, const char *path);
+void tree_free(struct tree_model *m);
+
+void tree_samples_add(struct tree_samples *s, const float *features, char label);
+void tree_samples_free(struct tree_samples *s);
+struct tree_model *tree_train(const struct tree_samples *s, int max_depth, int min_leaf);
+
+#endif
@@ -18,14 +18,23 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include "logging.h"
 #include "utils.h"
 
+/* Every successful trip to the heap through the wrappers below. */
+static volatile unsigned long alloc_count;
+
+unsigned long xalloc_count(void) {
+    return alloc_count;
+}
+
 void panic(int exitcode, const char *fmt, ...) {
   va_list ap;
 
@@ -43,6 +52,7 @@ char *xstrdup(const char *str) {
     if (!p) {
         panic(1, "strdup failed: %s", strerror(errno));
     }
+    __sync_fetch_and_add(&alloc_count, 1);
 
     return p;
 }
@@ -53,6 +63,7 @@ void *xcalloc(size_t count, size_t sz) {
     if (!p) {
         panic(1, "calloc(%lu, %lu) failed: %s", count, sz, strerror(errno));
     }
+    __sync_fetch_and_add(&alloc_count, 1);
 
     return p;
 }
@@ -63,6 +74,7 @@ void *xrealloc(void *p, size_t sz) {
     if (!r) {
         panic(1, "realloc failed: %s", strerror(errno));
     }
+    __sync_fetch_and_add(&alloc_count, 1);
 
     return r;
 }
@@ -73,10 +85,84 @@ void *xmalloc(size_t sz) {
     if (!p) {
         panic(1, "malloc(%lu) failed: %s", sz, strerror(errno));
     }
+    __sync_fetch_and_add(&alloc_count, 1);
+
+    return p;
+}
+
+void *xaligned_alloc(size_t alignment, size_t sz) {
+    void *p;
+    int err;
+
+    if ((err = posix_memalign(&p, alignment, sz)) != 0) {
+        panic(1, "posix_memalign(%lu, %lu) failed: %s", alignment, sz, strerror(err));
+    }
+    __sync_fetch_and_add(&alloc_count, 1);
 
     return p;
 }
 
+/* A bump allocator for state that lives exactly as long as one frame
+ * geometry: everything is carved out when the geometry is set up, so matching
+ * cells never goes back to the heap, and all of it is freed at once with
+ * arena_free().
+ */
+struct arena_block {
+    struct arena_block *next;
+    size_t size, used;
+    char data[];
+};
+
+#define ARENA_MIN_BLOCK (64 * 1024)
+
+void arena_init(struct arena *a) {
+    a->head = a->cur = NULL;
+}
+
+/* Returns sz zeroed bytes aligned to align, which must be a power of two. */
+void *arena_alloc(struct arena *a, size_t sz, size_t align) {
+    struct arena_block *b = a->cur;
+
+    for (;;) {
+        if (b != NULL) {
+            uintptr_t base = (uintptr_t)b->data;
+            uintptr_t p = (base + b->used + align - 1) & ~(uintptr_t)(align - 1);
+            if (p + sz <= base + b->size) {
+                b->used = p + sz - base;
+                a->cur = b;
+                return memset((void *)p, 0, sz);
+            }
+            if (b->next != NULL) {
+                b = b->next;
+                continue;
+            }
+        }
+
+        size_t bsz = sz + align > ARENA_MIN_BLOCK ? sz + align : ARENA_MIN_BLOCK;
+        struct arena_block *nb = xmalloc(sizeof(*nb) + bsz);
+        nb->next = NULL;
+        nb->size = bsz;
+        nb->used = 0;
+        if (b != NULL) {
+            b->next = nb;
+        } else {
+            a->head = nb;
+        }
+        b = nb;
+    }
+}
+
+void arena_free(struct arena *a) {
+    struct arena_block *b = a->head;
+
+    while (b != NULL) {
+        struct arena_block *next = b->next;
+        free(b);
+        b = next;
+    }
+    a->head = a->cur = NULL;
+}
+
 int xopen(const char *file, int oflag) {
     int fd;
 
@@ -99,6 +185,28 @@ FILE *xfopen(const char *file, const char *mode) {
     return f;
 }
 
+/* mkdir -p.  Returns -1, with errno set, if some component can't be made. */
+int make_dirs(const char *dir) {
+    char *path = xstrdup(dir);
+    int ret = 0;
+
+    for (char *p = path + 1; ret == 0; p++) {
+        if (*p == '/' || *p == '\0') {
+            char c = *p;
+            *p = '\0';
+            if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+                ret = -1;
+            }
+            *p = c;
+            if (c == '\0') {
+                break;
+            }
+        }
+    }
+    free(path);
+    return ret;
+}
+
 ssize_t xgetline(char **lineptr, size_t *n, FILE *stream) {
     ssize_t chars = getline(lineptr, n, stream);
 
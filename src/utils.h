@@ -14,8 +14,20 @@ char *xstrdup(const char *str);
 void *xcalloc(size_t count, size_t sz);
 void *xrealloc(void *p, size_t sz);
 void *xmalloc(size_t sz);
+void *xaligned_alloc(size_t alignment, size_t sz);
+
+unsigned long xalloc_count(void);
+
+struct arena {
+    struct arena_block *head, *cur;
+};
+
+void arena_init(struct arena *a);
+void *arena_alloc(struct arena *a, size_t sz, size_t align);
+void arena_free(struct arena *a);
 
 FILE *xfopen(const char *path, const char *flags);
+int make_dirs(const char *dir);
 
 ssize_t xgetline(char **lineptr, size_t *n, FILE *stream);
 #endif
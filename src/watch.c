@@ -0,0 +1,432 @@
+/* watch.c
+ * Re-rendering an image whenever it or the configuration changes.
+ *
+ * Copyright (c) 2014 Nathan Taylor <nbtaylor@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <libconfig.h>
+#include <opencv/cv.h>
+#include <opencv/highgui.h>
+
+#include "asciimatic.h"
+#include "encoder.h"
+#include "logging.h"
+#include "main.h"
+#include "pipeline.h"
+#include "stagecache.h"
+#include "trace.h"
+#include "utils.h"
+#include "watch.h"
+
+extern config_t config;
+extern char *config_path;
+extern FILE *output_file;
+extern enum output_format output_format;
+
+/* After a change, wait until things have been quiet this long before
+ * rendering, since editors and build tools tend to write in bursts.
+ */
+#define WATCH_SETTLE_MS 50
+
+/* The stages whose results are kept, in pipeline order. */
+enum stage {
+    STAGE_GRAY,         /* the decoded input */
+    STAGE_SMOOTH,       /* downscaled for the grid and smoothed */
+    STAGE_EDGES,        /* Canny at the configured thresholds */
+    STAGE_GRID,         /* the matched characters */
+    STAGE_COLOURS,      /* the cells' mean colours, for coloured formats */
+    NUM_STAGES
+};
+static const char *stage_names[NUM_STAGES] = {"gray", "smooth", "edges", "grid", "colours"};
+
+/* How a render came by each stage's result. */
+enum provenance {
+    UNUSED,             /* a later stage didn't need it */
+    KEPT,               /* still in memory from the last render */
+    CACHED,             /* read back from the stage cache */
+    COMPUTED
+};
+static const char *provenance_names[] = {"unused", "kept", "cached", "computed"};
+
+struct watcher {
+    const char *path;
+    int cols, rows;
+    struct input_file in;       /* as last read */
+
+    uint64_t want[NUM_STAGES];  /* keys for the render under way */
+    uint64_t held[NUM_STAGES];  /* keys of the results below; 0 for none */
+    enum provenance how[NUM_STAGES];
+
+    IplImage *images[STAGE_GRID];   /* gray, smooth and edges */
+    char *grid;
+    unsigned char *colours;
+    int renders;
+};
+
+static volatile sig_atomic_t stop_requested;
+
+static void
+on_signal(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+/* Keys every stage from the input's bytes and the settings each stage and
+ * the ones before it depend on.
+ */
+static void
+compute_keys(struct watcher *w) {
+    w->want[STAGE_GRAY] = w->in.key;
+    w->want[STAGE_SMOOTH] = smooth_key(w->in.key, w->rows, w->cols);
+    w->want[STAGE_EDGES] = edges_key(w->want[STAGE_SMOOTH], first_thresh, second_thresh);
+    w->want[STAGE_GRID] = grid_key(w->want[STAGE_EDGES], w->rows, w->cols);
+    w->want[STAGE_COLOURS] = colours_key(w->in.key, w->rows, w->cols);
+}
+
+static IplImage *decode_gray(struct watcher *w);
+static IplImage *smooth(struct watcher *w);
+static IplImage *edges(struct watcher *w);
+
+/* The image for stage s: kept from the last render if its key hasn't
+ * changed, else read back from the cache, else made from the stage before.
+ */
+static IplImage *
+image_stage(struct watcher *w, enum stage s) {
+    IplImage **slot = &w->images[s];
+
+    if (*slot != NULL && w->held[s] == w->want[s]) {
+        w->how[s] = KEPT;
+        return *slot;
+    }
+    cvReleaseImage(slot);
+    w->held[s] = 0;
+    if ((*slot = stage_cache_get_image(&stage_cache, stage_names[s], w->want[s])) != NULL) {
+        w->how[s] = CACHED;
+    } else {
+        switch (s) {
+            case STAGE_GRAY:
+                *slot = decode_gray(w);
+                break;
+            case STAGE_SMOOTH:
+                *slot = smooth(w);
+                break;
+            case STAGE_EDGES:
+            default:
+                *slot = edges(w);
+                break;
+        }
+        if (*slot == NULL) {
+            return NULL;
+        }
+        stage_cache_put_image(&stage_cache, stage_names[s], w->want[s], *slot);
+        w->how[s] = COMPUTED;
+    }
+    w->held[s] = w->want[s];
+    return *slot;
+}
+
+static IplImage *
+decode_gray(struct watcher *w) {
+    IplImage *img = decode_input(&w->in, CV_LOAD_IMAGE_GRAYSCALE);
+
+    if (img == NULL) {
+        xlog(LOG_WARNING, "Can't decode %s", w->path);
+    } else if (img->width < w->cols || img->height < w->rows) {
+        xlog(LOG_WARNING, "%s is too small for a %dx%d grid", w->path, w->cols, w->rows);
+        cvReleaseImage(&img);
+    }
+    return img;
+}
+
+static IplImage *
+smooth(struct watcher *w) {
+    IplImage *gray = image_stage(w, STAGE_GRAY), *img;
+
+    if (gray == NULL) {
+        return NULL;
+    }
+    img = cvCloneImage(gray);
+    downscale_image(pipeline, &img, w->rows, w->cols);
+
+    TRACE_SCOPE("smooth");
+    cvSmooth(img, img, CV_GAUSSIAN, 3, 3, 0, 0);
+    return img;
+}
+
+static IplImage *
+edges(struct watcher *w) {
+    IplImage *smoothed = image_stage(w, STAGE_SMOOTH);
+
+    return smoothed != NULL ? detect_edges(pipeline, NULL, smoothed) : NULL;
+}
+
+static bool_t
+grid_stage(struct watcher *w) {
+    size_t len = (size_t)w->rows * (w->cols + 1);
+
+    if (w->held[STAGE_GRID] == w->want[STAGE_GRID]) {
+        w->how[STAGE_GRID] = KEPT;
+        return true;
+    }
+    w->held[STAGE_GRID] = 0;
+    if (stage_cache_get(&stage_cache, stage_names[STAGE_GRID], w->want[STAGE_GRID], w->grid, len)) {
+        w->how[STAGE_GRID] = CACHED;
+    } else {
+        IplImage *e = image_stage(w, STAGE_EDGES);
+
+        if (e == NULL) {
+            return false;
+        }
+        TRACE_SCOPE("match");
+        asciify_grid(pipeline, e, w->rows, w->cols, w->grid);
+        stage_cache_put(&stage_cache, stage_names[STAGE_GRID], w->want[STAGE_GRID], w->grid, len);
+        w->how[STAGE_GRID] = COMPUTED;
+    }
+    w->held[STAGE_GRID] = w->want[STAGE_GRID];
+    return true;
+}
+
+static bool_t
+colours_stage(struct watcher *w) {
+    size_t len = (size_t)w->rows * w->cols * 3;
+    IplImage *colour;
+
+    if (w->held[STAGE_COLOURS] == w->want[STAGE_COLOURS]) {
+        w->how[STAGE_COLOURS] = KEPT;
+        return true;
+    }
+    w->held[STAGE_COLOURS] = 0;
+    if (stage_cache_get(&stage_cache, stage_names[STAGE_COLOURS], w->want[STAGE_COLOURS], w->colours, len)) {
+        w->how[STAGE_COLOURS] = CACHED;
+    } else {
+        if ((colour = decode_input(&w->in, CV_LOAD_IMAGE_COLOR)) == NULL ||
+                colour->width < w->cols || colour->height < w->rows) {
+            cvReleaseImage(&colour);
+            return false;
+        }
+        cell_colours(colour, w->rows, w->cols, w->colours);
+        cvReleaseImage(&colour);
+        stage_cache_put(&stage_cache, stage_names[STAGE_COLOURS], w->want[STAGE_COLOURS], w->colours, len);
+        w->how[STAGE_COLOURS] = COMPUTED;
+    }
+    w->held[STAGE_COLOURS] = w->want[STAGE_COLOURS];
+    return true;
+}
+
+/* Gets output_file ready for another render: a terminal is cleared, a file
+ * is truncated, and anything else gets a form feed between renders.
+ */
+static void
+restart_output(struct encoder *e) {
+    int fd = fileno(output_file);
+
+    if (isatty(fd)) {
+        encoder_text(e, "\033[H\033[2J");
+        return;
+    }
+    fflush(output_file);
+    if (ftruncate(fd, 0) == 0) {
+        rewind(output_file);
+    } else if (output_format != OUTPUT_HTML) {
+        encoder_text(e, "\f\n");
+    }
+}
+
+/* Renders the input through whichever stages' keys have changed since the
+ * last render, and writes it out.
+ */
+static void
+render(struct watcher *w) {
+    bool_t coloured = output_format_coloured(output_format);
+    struct encoder e;
+
+    if (!read_input(&w->in, w->path)) {
+        return;
+    }
+    compute_keys(w);
+    for (int s = 0; s < NUM_STAGES; s++) {
+        w->how[s] = UNUSED;
+    }
+    if (!grid_stage(w) || (coloured && !colours_stage(w))) {
+        return;
+    }
+
+    encoder_init(&e, output_file, output_format);
+    if (w->renders++ > 0) {
+        restart_output(&e);
+    }
+    encoder_begin(&e);
+    encoder_grid(&e, w->grid, coloured ? w->colours : NULL, w->rows, w->cols);
+    encoder_end(&e);
+    encoder_free(&e);
+
+    xlog(LOG_INFO, "Rendered %s: gray %s, smooth %s, edges %s, grid %s%s%s", w->path,
+         provenance_names[w->how[STAGE_GRAY]], provenance_names[w->how[STAGE_SMOOTH]],
+         provenance_names[w->how[STAGE_EDGES]], provenance_names[w->how[STAGE_GRID]],
+         coloured ? ", colours " : "", coloured ? provenance_names[w->how[STAGE_COLOURS]] : "");
+}
+
+/* Re-reads the configuration file into config and rebuilds the pipeline from
+ * it.  A file that doesn't parse, or whose settings are bad, changes nothing.
+ */
+static bool_t
+reload_config(void) {
+    config_t fresh;
+
+    config_init(&fresh);
+    if (config_read_file(&fresh, config_path) == CONFIG_FALSE) {
+        xlog(LOG_WARNING, "Can't parse %s:%d: %s; keeping the old settings", config_path,
+             config_error_line(&fresh), config_error_text(&fresh) ? config_error_text(&fresh) : "<unknown>");
+        config_destroy(&fresh);
+        return false;
+    }
+    if (!reconfigure_pipeline(&fresh)) {
+        config_destroy(&fresh);
+        return false;
+    }
+    config_destroy(&fresh);
+
+    /* Settings point back at their config, so it is read again in place
+     * rather than copied over.
+     */
+    config_destroy(&config);
+    config_init(&config);
+    if (config_read_file(&config, config_path) == CONFIG_FALSE) {
+        xlog(LOG_WARNING, "%s changed while being read", config_path);
+    }
+    xlog(LOG_INFO, "Re-read %s", config_path);
+    return true;
+}
+
+/* Watches path's directory rather than path, so that files replaced by
+ * renaming (as most editors save) are still noticed.  Returns the watch
+ * descriptor; *name is set to path's last component.
+ */
+static int
+watch_file(int fd, const char *path, const char **name) {
+    const char *slash = strrchr(path, '/');
+    char *dir = slash != NULL ? strndup(path, MAX(slash - path, 1)) : xstrdup(".");
+    int wd = inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+
+    if (wd == -1) {
+        panic(1, "Can't watch %s: %s", dir, strerror(errno));
+    }
+    free(dir);
+    *name = slash != NULL ? slash + 1 : path;
+    return wd;
+}
+
+/* Reads whatever events are pending, noting which of the two files changed. */
+static void
+drain_events(int fd, int input_wd, const char *input_name, int config_wd, const char *config_name,
+             bool_t *input_changed, bool_t *config_changed) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n; ) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+
+            if (ev->len > 0) {
+                if (ev->wd == input_wd && strcmp(ev->name, input_name) == 0) {
+                    *input_changed = true;
+                }
+                if (ev->wd == config_wd && strcmp(ev->name, config_name) == 0) {
+                    *config_changed = true;
+                }
+            }
+            p += sizeof(*ev) + ev->len;
+        }
+    }
+}
+
+/* Renders path to output_file, then again each time path or the
+ * configuration file changes, until interrupted.  Every stage's result is
+ * memoised by a key over its inputs, in memory and in the stage cache, so a
+ * render only redoes the stages downstream of what actually changed: a new
+ * threshold redoes edges and matching but not decoding or smoothing, and
+ * touching the input without changing it redoes nothing.
+ */
+int
+run_watch(const char *path, int cols, int rows) {
+    struct watcher w;
+    const char *input_name, *config_name;
+    int fd, input_wd, config_wd;
+
+    memset(&w, 0, sizeof(w));
+    w.path = path;
+    w.cols = cols;
+    w.rows = rows;
+    w.grid = xmalloc((size_t)rows * (cols + 1));
+    w.colours = xmalloc((size_t)rows * cols * 3);
+    open_stage_cache();
+
+    if ((fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+        panic(1, "Can't start watching: %s", strerror(errno));
+    }
+    input_wd = watch_file(fd, path, &input_name);
+    config_wd = watch_file(fd, config_path, &config_name);
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    render(&w);
+    xlog(LOG_INFO, "Watching %s and %s", path, config_path);
+
+    while (!stop_requested) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        bool_t input_changed = false, config_changed = false;
+
+        if (poll(&pfd, 1, 500) <= 0) {
+            continue;
+        }
+        /* Let a burst of writes finish before looking. */
+        do {
+            drain_events(fd, input_wd, input_name, config_wd, config_name, &input_changed, &config_changed);
+        } while (!stop_requested && poll(&pfd, 1, WATCH_SETTLE_MS) > 0);
+
+        if (config_changed && !reload_config()) {
+            continue;
+        }
+        if (input_changed || config_changed) {
+            render(&w);
+        }
+    }
+
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    close(fd);
+
+    for (int s = 0; s < STAGE_GRID; s++) {
+        cvReleaseImage(&w.images[s]);
+    }
+    free_input(&w.in);
+    free(w.grid);
+    free(w.colours);
+
+    return 0;
+}
@@ -0,0 +1,6 @@
+#ifndef _WATCH_H_
+#define _WATCH_H_
+
+int run_watch(const char *path, int cols, int rows);
+
+#endif
@@ -0,0 +1,188 @@
+/* workpool.c
+ * A small persistent pthread worker pool.
+ *
+ * Copyright (c) 2014 Nathan Taylor <nbtaylor@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logging.h"
+#include "trace.h"
+#include "utils.h"
+#include "workpool.h"
+
+/* The thread calling workpool_run() always takes part as worker 0, so a pool
+ * of n workers only spawns n - 1 threads.  Items are handed out one at a time
+ * from a shared counter; since the items we schedule (rows of cells) vary a lot
+ * in cost, this balances far better than carving out fixed bands up front.
+ */
+struct workpool {
+    int nworkers;
+    pthread_t *threads;
+
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+
+    /* Current batch; protected by lock except for next_item. */
+    unsigned long generation;
+    work_fn fn;
+    void *arg;
+    int nitems;
+    volatile int next_item;
+    int active;
+    bool_t quit;
+};
+
+struct worker_arg {
+    struct workpool *wp;
+    int id;
+};
+
+static void
+drain(struct workpool *wp, work_fn fn, void *arg, int nitems, int id) {
+    int item;
+
+    while ((item = __sync_fetch_and_add(&wp->next_item, 1)) < nitems) {
+        fn(item, id, arg);
+    }
+}
+
+static void *
+worker_main(void *p) {
+    struct worker_arg *wa = p;
+    struct workpool *wp = wa->wp;
+    int id = wa->id;
+    unsigned long seen = 0;
+
+    free(wa);
+    trace_thread_name("worker");
+
+    pthread_mutex_lock(&wp->lock);
+    for (;;) {
+        while (wp->generation == seen && !wp->quit) {
+            pthread_cond_wait(&wp->start, &wp->lock);
+        }
+        if (wp->quit) {
+            break;
+        }
+        seen = wp->generation;
+
+        work_fn fn = wp->fn;
+        void *arg = wp->arg;
+        int nitems = wp->nitems;
+        pthread_mutex_unlock(&wp->lock);
+
+        drain(wp, fn, arg, nitems, id);
+
+        pthread_mutex_lock(&wp->lock);
+        if (--wp->active == 0) {
+            pthread_cond_signal(&wp->done);
+        }
+    }
+    pthread_mutex_unlock(&wp->lock);
+
+    return NULL;
+}
+
+struct workpool *
+workpool_create(int nworkers) {
+    struct workpool *wp = xcalloc(1, sizeof(*wp));
+    int i, err;
+
+    if (nworkers < 1) {
+        nworkers = 1;
+    }
+    wp->nworkers = nworkers;
+    wp->threads = xcalloc(nworkers, sizeof(pthread_t));
+
+    pthread_mutex_init(&wp->lock, NULL);
+    pthread_cond_init(&wp->start, NULL);
+    pthread_cond_init(&wp->done, NULL);
+
+    for (i = 1; i < nworkers; i++) {
+        struct worker_arg *wa = xmalloc(sizeof(*wa));
+        wa->wp = wp;
+        wa->id = i;
+        if ((err = pthread_create(&wp->threads[i], NULL, worker_main, wa)) != 0) {
+            panic(1, "Can't start worker thread: %s", strerror(err));
+        }
+    }
+
+    return wp;
+}
+
+int
+workpool_size(const struct workpool *wp) {
+    return wp->nworkers;
+}
+
+/* Runs fn over items [0, nitems) across the pool, returning once every item
+ * has been processed.  Not reentrant: only one batch may be in flight.
+ */
+void
+workpool_run(struct workpool *wp, int nitems, work_fn fn, void *arg) {
+    if (wp->nworkers == 1 || nitems <= 1) {
+        for (int i = 0; i < nitems; i++) {
+            fn(i, 0, arg);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&wp->lock);
+    wp->fn = fn;
+    wp->arg = arg;
+    wp->nitems = nitems;
+    wp->next_item = 0;
+    wp->active = wp->nworkers - 1;
+    wp->generation++;
+    pthread_cond_broadcast(&wp->start);
+    pthread_mutex_unlock(&wp->lock);
+
+    drain(wp, fn, arg, nitems, 0);
+
+    pthread_mutex_lock(&wp->lock);
+    while (wp->active > 0) {
+        pthread_cond_wait(&wp->done, &wp->lock);
+    }
+    pthread_mutex_unlock(&wp->lock);
+}
+
+void
+workpool_destroy(struct workpool *wp) {
+    int i;
+
+    if (wp == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&wp->lock);
+    wp->quit = true;
+    pthread_cond_broadcast(&wp->start);
+    pthread_mutex_unlock(&wp->lock);
+
+    for (i = 1; i < wp->nworkers; i++) {
+        pthread_join(wp->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&wp->done);
+    pthread_cond_destroy(&wp->start);
+    pthread_mutex_destroy(&wp->lock);
+    free(wp->threads);
+    free(wp);
+}
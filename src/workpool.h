@@ -0,0 +1,16 @@
+#ifndef _WORKPOOL_H_
+#define _WORKPOOL_H_
+
+/* A work function is handed the index of the item to process and the index of
+ * the worker running it, so that callers can keep per-worker scratch state.
+ */
+typedef void (*work_fn)(int item, int worker, void *arg);
+
+struct workpool;
+
+struct workpool *workpool_create(int nworkers);
+int workpool_size(const struct workpool *wp);
+void workpool_run(struct workpool *wp, int nitems, work_fn fn, void *arg);
+void workpool_destroy(struct workpool *wp);
+
+#endif
@@ -0,0 +1,261 @@
+#!/bin/sh
+# harness.sh
+# Golden-output regression and benchmark runs over the cases in tests/cases.
+#
+#     sh tests/harness.sh check           one run per case, scored, then the
+#                                         edge checks and matcher agreement
+#                                         runs
+#     sh tests/harness.sh bench [runs]    repeated runs per case, timed
+#     sh tests/harness.sh record          one run per case, and write each
+#                                         case's match rate into tests/cases
+#
+# Each case is converted headless (batch mode, one image per run) and its
+# output compared with the golden tests/<image>.txt at every cell that is not
+# blank there.  One JSON object per case is written to stdout, or to $RESULTS
+# if set; a readable summary goes to stderr.  Cases expected to pass fail the
+# run if asciimatic fails on them or if they match fewer of those cells than
+# the case's min_match in tests/cases (or $MIN_MATCH, if set, for every case).
+#
+# The edge checks run tools/asciimatic-edgecheck (or $EDGECHECK) over each
+# case's image at its thresholds, and fail if edges.c and cvCanny() disagree
+# on a single pixel.
+#
+# The agreement runs convert every case once per matcher in tests/matchers
+# with check_matcher set, which matches each cell with the matcher's
+# reference as well, and fail if the two agree on fewer cells than required.
+# The tree matcher's model is trained with -L over the cases first.
+#
+# Copyright (c) 2014 Nathan Taylor <nbtaylor@gmail.com>
+#
+# Permission to use, copy, modify, and/or distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+# SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+mode=${1:-check}
+case $mode in
+    check) runs=1 ;;
+    bench) runs=${2:-10} ;;
+    record) runs=1 ;;
+    *) echo "usage: $0 check | bench [runs] | record" >&2; exit 1 ;;
+esac
+
+ASCIIMATIC=${ASCIIMATIC:-./asciimatic}
+case $ASCIIMATIC in
+    /*) ;;
+    *) ASCIIMATIC=$PWD/$ASCIIMATIC ;;
+esac
+EDGECHECK=${EDGECHECK:-./tools/asciimatic-edgecheck}
+TESTS=tests
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT INT TERM
+: > "$tmp/results"
+: > "$tmp/rates"
+
+# Every run works from a copy of the config with the stage cache off, so that
+# it converts each image rather than reading back an earlier run's results.
+mkdir -p "$tmp/run/config"
+sed '/^#*stage_cache = /d' config/asciimatic.cfg > "$tmp/run/config/asciimatic.cfg"
+echo 'stage_cache = "";' >> "$tmp/run/config/asciimatic.cfg"
+
+now_ns() {
+    date +%s%N
+}
+
+# Sums span durations by name over a Chrome trace written by -T, in ms.
+stage_times() {
+    awk '/"ph":"X"/ {
+        match($0, /"name":"[^"]*"/); name = substr($0, RSTART + 8, RLENGTH - 9)
+        match($0, /"dur":[0-9.]+/); dur = substr($0, RSTART + 6, RLENGTH - 6)
+        sum[name] += dur
+    }
+    END { for (n in sum) printf "%s\t%.3f\n", n, sum[n] / 1000 }' "$1"
+}
+
+# Fraction of the golden grid's non-blank cells in $2 that $1 has the same
+# character in.  Blank cells are left out, since an output with no edges at
+# all would otherwise match most of every image.  The golden files may carry
+# stray log lines, so only lines exactly $3 characters wide count.
+score() {
+    awk -v cols="$3" -v rows="$4" '
+        FNR == NR { if (length($0) == cols) golden[ng++] = $0; next }
+        { out[no++] = $0 }
+        END {
+            same = 0
+            inked = 0
+            for (j = 0; j < rows && j < ng; j++)
+                for (i = 1; i <= cols; i++) {
+                    c = substr(golden[j], i, 1)
+                    if (c == " ")
+                        continue
+                    inked++
+                    same += (j < no && c == substr(out[j], i, 1))
+                }
+            printf "%.4f\n", (inked > 0 ? same / inked : 0)
+        }' "$2" "$1"
+}
+
+grep -v -e '^#' -e '^[[:space:]]*$' "$TESTS/cases" | sed 's/#.*//' |
+while read image cols rows t1 t2 expect min_match; do
+    base=${image%.*}
+    out="$tmp/$base.txt"
+    printf '%s/%s %s %s %s %s\n' "$PWD/$TESTS" "$image" "$cols" "$rows" "$t1" "$t2" > "$tmp/manifest"
+
+    ok=1
+    walls=""
+    : > "$tmp/stages"
+    run=0
+    while [ $run -lt $runs ]; do
+        rm -f "$out"
+        start=$(now_ns)
+        if ! (cd "$tmp/run" && "$ASCIIMATIC" -T "$tmp/trace.json" -f plain -b "$tmp/manifest" -O "$tmp" 80 40 \
+                > /dev/null 2> "$tmp/log") || [ ! -s "$out" ]; then
+            ok=0
+            break
+        fi
+        walls="$walls $(( ($(now_ns) - start) / 1000 ))"
+        stage_times "$tmp/trace.json" >> "$tmp/stages"
+        run=$((run + 1))
+    done
+
+    ran=$ok
+    if [ $ok -eq 1 ]; then
+        rate=$(score "$out" "$TESTS/$base.txt" "$cols" "$rows")
+        ok=$(awk -v r="$rate" -v m="${MIN_MATCH:-$min_match}" 'BEGIN { print (r >= m) }')
+    else
+        rate=0
+    fi
+
+    case $expect/$ok in
+        pass/1) status=pass ;;
+        pass/0) status=fail ;;
+        xfail/0) status=xfail ;;
+        xfail/1) status=xpass ;;
+    esac
+
+    # Wall times are in microseconds; report the minimum and median.
+    wall=$(echo $walls | tr ' ' '\n' | sort -n | awk '
+        { t[NR] = $1 }
+        END { if (NR) printf "%.3f %.3f", t[1] / 1000, t[int((NR + 1) / 2)] / 1000; else print "0 0" }')
+    set -- $wall
+    stages=$(awk -F '\t' -v n="$run" '
+        { sum[$1] += $2 }
+        END { sep = ""; for (s in sum) { printf "%s\"%s\":%.3f", sep, s, sum[s] / n; sep = "," } }' "$tmp/stages")
+    cells_per_s=$(awk -v c=$((cols * rows)) -v ms="$2" 'BEGIN { printf "%.0f", (ms > 0 ? c / (ms / 1000) : 0) }')
+
+    printf '{"case":"%s","expect":"%s","status":"%s","columns":%s,"rows":%s,"match_rate":%s,"min_match":%s,' \
+        "$image" "$expect" "$status" "$cols" "$rows" "$rate" "${MIN_MATCH:-$min_match}" >> "$tmp/results"
+    printf '"runs":%s,"wall_ms_min":%s,"wall_ms_median":%s,"cells_per_s":%s,"stage_ms":{%s}}\n' \
+        "$run" "$1" "$2" "$cells_per_s" "$stages" >> "$tmp/results"
+    printf '%-6s %-12s match %6s (min %6s)  median %9s ms  %10s cells/s\n' \
+        "$status" "$image" "$rate" "${MIN_MATCH:-$min_match}" "$2" "$cells_per_s" >&2
+
+    # Only rates from runs that finished are worth recording.
+    [ $ran -eq 1 ] && printf '%s %s\n' "$image" "$rate" >> "$tmp/rates"
+    [ $status = fail ] && echo fail
+done > "$tmp/failures"
+
+# Rewrites the min_match column of tests/cases with the rates just measured,
+# keeping the comments.
+if [ $mode = record ]; then
+    awk 'FNR == NR { rate[$1] = $2; next }
+        /^#/ || /^[[:space:]]*$/ || !($1 in rate) { print; next }
+        {
+            comment = ""
+            if (index($0, "#")) comment = "   " substr($0, index($0, "#"))
+            printf "%-13s %-7s %-5s %-10s %-11s %-6s %s%s\n", $1, $2, $3, $4, $5, $6, rate[$1], comment
+        }' "$tmp/rates" "$TESTS/cases" > "$tmp/cases" && cp "$tmp/cases" "$TESTS/cases"
+    echo "Recorded match rates in $TESTS/cases" >&2
+fi
+
+# Edge checks: edges.c must find exactly the edges cvCanny() does, on every
+# case's image at that case's thresholds.
+if [ $mode = check ]; then
+    grep -v -e '^#' -e '^[[:space:]]*$' "$TESTS/cases" | sed 's/#.*//' |
+    while read image cols rows t1 t2 expect min_match; do
+        if "$EDGECHECK" "$t1" "$t2" "$TESTS/$image" > "$tmp/edgecheck" 2>&1; then
+            status=pass
+        else
+            status=fail
+        fi
+        differ=$(sed -n 's/.*: \([0-9]*\) of [0-9]* pixels differ.*/\1/p' "$tmp/edgecheck")
+        printf '{"edges":"%s","status":"%s","threshold1":%s,"threshold2":%s,"pixels_differ":%s}\n' \
+            "$image" "$status" "$t1" "$t2" "${differ:-null}" >> "$tmp/results"
+        printf '%-6s %-12s edges at %s/%s differ from cvCanny at %s pixels\n' \
+            "$status" "$image" "$t1" "$t2" "${differ:-?}" >&2
+
+        [ $status = fail ] && echo fail
+    done >> "$tmp/failures"
+fi
+
+# Agreement runs: each matcher converts every case with check_matcher set,
+# from a copy of the config that selects it, and the agreement it logs for
+# each image is summed.
+if [ $mode = check ]; then
+    mkdir -p "$tmp/agree/config"
+    grep -v -e '^#' -e '^[[:space:]]*$' "$TESTS/cases" | sed 's/#.*//' |
+    while read image cols rows t1 t2 expect min_match; do
+        printf '%s/%s %s %s %s %s\n' "$PWD/$TESTS" "$image" "$cols" "$rows" "$t1" "$t2"
+    done > "$tmp/agree/manifest"
+
+    # The tree matcher runs from a model trained with -L on the same cases.
+    sed -e 's/^syslog = .*/syslog = false;/' -e '/^logfile/d' \
+        "$tmp/run/config/asciimatic.cfg" > "$tmp/agree/config/asciimatic.cfg"
+    (cd "$tmp/agree" && "$ASCIIMATIC" -L tree.model -b manifest 80 40 > /dev/null 2> train.log) ||
+        echo "Training the tree matcher failed; see its row" >&2
+
+    sed 's/#.*//' "$TESTS/matchers" | grep -v '^[[:space:]]*$' |
+    while read matcher required expect; do
+        sed -e "s/^matcher = .*/matcher = \"$matcher\";/" \
+            -e 's/^check_matcher = .*/check_matcher = true;/' \
+            -e 's/^fft_crossover = .*/fft_crossover = 0;/' \
+            -e 's/^tree_model = .*/tree_model = "tree.model";/' \
+            -e 's/^syslog = .*/syslog = false;/' -e '/^logfile/d' \
+            "$tmp/run/config/asciimatic.cfg" > "$tmp/agree/config/asciimatic.cfg"
+
+        if (cd "$tmp/agree" && "$ASCIIMATIC" -f plain -b manifest -O out 80 40 > /dev/null 2> log); then
+            set -- $(sed -n 's/.*agreed with [a-z]* on \([0-9]*\) of \([0-9]*\) cells.*/\1 \2/p' "$tmp/agree/log" |
+                     awk '{ a += $1; c += $2 } END { printf "%d %d", a, c }')
+        else
+            set -- 0 0
+        fi
+        agreed=$1
+        checked=$2
+        ok=$(awk -v a="$agreed" -v c="$checked" -v m="$required" 'BEGIN { print (c > 0 && a / c >= m) }')
+        rate=$(awk -v a="$agreed" -v c="$checked" 'BEGIN { printf "%.4f", (c > 0 ? a / c : 0) }')
+
+        case $expect/$ok in
+            pass/1) status=pass ;;
+            pass/0) status=fail ;;
+            xfail/0) status=xfail ;;
+            xfail/1) status=xpass ;;
+        esac
+
+        printf '{"matcher":"%s","expect":"%s","status":"%s","agreed":%s,"checked":%s,"agreement":%s,"required":%s}\n' \
+            "$matcher" "$expect" "$status" "$agreed" "$checked" "$rate" "$required" >> "$tmp/results"
+        printf '%-6s %-12s agrees %6s (min %6s) on %s cells\n' \
+            "$status" "$matcher" "$rate" "$required" "$checked" >&2
+
+        [ $status = fail ] && echo fail
+    done >> "$tmp/failures"
+fi
+
+if [ -n "$RESULTS" ]; then
+    cp "$tmp/results" "$RESULTS"
+else
+    cat "$tmp/results"
+fi
+
+failures=$(wc -l < "$tmp/failures")
+if [ "$failures" -gt 0 ]; then
+    echo "$failures case(s) failed" >&2
+    exit 1
+fi
@@ -0,0 +1,94 @@
+/* asciimatic-edgecheck.c
+ * Checks the split Canny in edges.c against cvCanny() itself.
+ *
+ * Copyright (c) 2014 Nathan Taylor <nbtaylor@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <opencv/cv.h>
+#include <opencv/highgui.h>
+
+#include "edges.h"
+
+/* Runs each image through gradient_compute() and gradient_threshold() and
+ * through cvCanny(..., 3) at the same thresholds, and compares the two edge
+ * maps byte for byte.  The images are smoothed first, as the pipeline does
+ * before it looks for edges.  Exits non-zero if any pixel differs or an
+ * image can't be read.
+ */
+
+static void
+usage(const char *progname) {
+    fprintf(stderr, "usage: %s <threshold1> <threshold2> <image> [<image> ...]\n", progname);
+    exit(1);
+}
+
+/* Number of pixels at which a and b, both 8-bit and the same size, differ. */
+static long
+count_differences(const IplImage *a, const IplImage *b) {
+    long differ = 0;
+
+    for (int y = 0; y < a->height; y++) {
+        const unsigned char *ra = (const unsigned char *)a->imageData + y * a->widthStep;
+        const unsigned char *rb = (const unsigned char *)b->imageData + y * b->widthStep;
+
+        for (int x = 0; x < a->width; x++) {
+            differ += ra[x] != rb[x];
+        }
+    }
+    return differ;
+}
+
+int
+main(int argc, char **argv) {
+    struct gradient gradient;
+    int thresh1, thresh2, failed = 0;
+
+    if (argc < 4 || sscanf(argv[1], "%d", &thresh1) != 1 || sscanf(argv[2], "%d", &thresh2) != 1) {
+        usage(argv[0]);
+    }
+
+    gradient_init(&gradient);
+    for (int i = 3; i < argc; i++) {
+        IplImage *src = cvLoadImage(argv[i], CV_LOAD_IMAGE_GRAYSCALE);
+
+        if (src == NULL) {
+            fprintf(stderr, "%s: could not load %s\n", argv[0], argv[i]);
+            failed = 1;
+            continue;
+        }
+        cvSmooth(src, src, CV_GAUSSIAN, 3, 3, 0, 0);
+
+        IplImage *canny = cvCreateImage(cvGetSize(src), IPL_DEPTH_8U, 1);
+        cvCanny(src, canny, thresh1, thresh2, 3);
+
+        gradient_compute(&gradient, src);
+        IplImage *edges = gradient_threshold(&gradient, NULL, thresh1, thresh2);
+
+        long differ = count_differences(canny, edges);
+        printf("%-8s %s at %d/%d: %ld of %d pixels differ from cvCanny\n",
+               differ ? "fail" : "pass", argv[i], thresh1, thresh2, differ, src->width * src->height);
+        failed |= differ > 0;
+
+        cvReleaseImage(&edges);
+        cvReleaseImage(&canny);
+        cvReleaseImage(&src);
+    }
+    gradient_free(&gradient);
+
+    return failed;
+}
@@ -0,0 +1,228 @@
+/* asciimatic-kbench.c
+ * Microbenchmark of the fixed-size matching kernels against the generic ones.
+ *
+ * Copyright (c) 2014 Nathan Taylor <nbtaylor@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <opencv/cv.h>
+
+#include "bitmatch.h"
+#include "kernels.h"
+#include "matcher.h"
+#include "templates.h"
+#include "utils.h"
+
+/* Times the atlas and bitset matchers' fixed-size kernels against their
+ * generic ones on the same cells, for each geometry in FIXED_GEOMETRIES (or
+ * those given on the command line), and checks that both pick the same glyph
+ * for every cell.  The templates are rendered as usual; the cells are edge
+ * maps made from them, jittered by a pixel and with some ink dropped, plus a
+ * share of empty cells, which is roughly what Canny output looks like to the
+ * matchers.
+ */
+
+#define ALL_GEOMETRIES(w, h) { w, h },
+
+struct geometry {
+    int w, h;
+};
+
+static double
+now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* ncells w x h cells side by side in one image, so that the last one ends
+ * where the buffer does.
+ */
+static unsigned char *
+make_cells(const struct template_bank *bank, int ncells, int *step) {
+    int w = bank->width, h = bank->height;
+    unsigned char *cells = xcalloc((size_t)ncells * w * h, 1);
+
+    *step = ncells * w;
+    for (int i = 0; i < ncells; i++) {
+        const IplImage *t = bank->templates[rand() % bank->count];
+        int dx = rand() % 3 - 1, dy = rand() % 3 - 1;
+
+        if (i % 4 == 0) {
+            continue;
+        }
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++) {
+                int sx = x + dx, sy = y + dy;
+
+                if (sx >= 0 && sx < w && sy >= 0 && sy < h &&
+                        (unsigned char)t->imageData[sy * t->widthStep + sx] >= 128 && rand() % 8 != 0) {
+                    cells[(size_t)y * *step + i * w + x] = 255;
+                }
+            }
+        }
+    }
+    return cells;
+}
+
+/* Seconds per cell for the best of runs passes over the cells; picks gets
+ * each cell's glyph.
+ */
+static double
+time_atlas(const struct glyph_atlas *atlas, struct match_scratch *s, atlas_match_fn match,
+           const unsigned char *cells, int ncells, int step, int runs, int *picks) {
+    double best = 1e9;
+
+    for (int r = 0; r < runs; r++) {
+        double start = now();
+
+        for (int i = 0; i < ncells; i++) {
+            picks[i] = match(atlas, s, cells + i * atlas->width, step, NULL, 0);
+        }
+        best = MIN(best, now() - start);
+    }
+    return best / ncells;
+}
+
+static double
+time_bitset(const struct bit_bank *bank, uint64_t *s, bitbank_match_fn match,
+            const unsigned char *cells, int ncells, int step, int runs, int *picks) {
+    double best = 1e9;
+
+    for (int r = 0; r < runs; r++) {
+        double start = now();
+
+        for (int i = 0; i < ncells; i++) {
+            picks[i] = match(bank, s, cells + i * bank->width, step, NULL, 0);
+        }
+        best = MIN(best, now() - start);
+    }
+    return best / ncells;
+}
+
+static int
+report(const char *matcher, const struct geometry *g, const char *kernel, double generic, double fixed,
+       const int *generic_picks, const int *fixed_picks, int ncells) {
+    int differ = 0;
+
+    for (int i = 0; i < ncells; i++) {
+        differ += generic_picks[i] != fixed_picks[i];
+    }
+    printf("%-6s %2dx%-2d  %-16s generic %8.1f ns/cell  fixed %8.1f ns/cell  %5.2fx",
+           matcher, g->w, g->h, kernel, generic * 1e9, fixed * 1e9, generic / fixed);
+    if (differ > 0) {
+        printf("  %d cells differ", differ);
+    }
+    putchar('\n');
+    return differ;
+}
+
+static void
+usage(const char *progname) {
+    fprintf(stderr, "usage: %s [-n cells] [-r runs] [-c charset] [-f font] [<width>x<height> ...]\n", progname);
+    exit(1);
+}
+
+int
+main(int argc, char **argv) {
+    static const struct geometry fixed[] = { FIXED_GEOMETRIES(ALL_GEOMETRIES) };
+    const char *charset = " -|+\\/'^:_", *font = "sans-serif";
+    int ncells = 4096, runs = 20, ngeometries, differ = 0, opt;
+    struct geometry *geometries;
+
+    while ((opt = getopt(argc, argv, "c:f:n:r:")) != -1) {
+        switch (opt) {
+            case 'c':
+                charset = optarg;
+                break;
+            case 'f':
+                font = optarg;
+                break;
+            case 'n':
+                ncells = atoi(optarg);
+                break;
+            case 'r':
+                runs = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (ncells < 1 || runs < 1) {
+        usage(argv[0]);
+    }
+
+    if (optind < argc) {
+        ngeometries = argc - optind;
+        geometries = xcalloc(ngeometries, sizeof(*geometries));
+        for (int i = 0; i < ngeometries; i++) {
+            if (sscanf(argv[optind + i], "%dx%d", &geometries[i].w, &geometries[i].h) != 2 ||
+                    geometries[i].w < 1 || geometries[i].h < 1) {
+                usage(argv[0]);
+            }
+        }
+    } else {
+        ngeometries = sizeof(fixed) / sizeof(fixed[0]);
+        geometries = xcalloc(ngeometries, sizeof(*geometries));
+        memcpy(geometries, fixed, sizeof(fixed));
+    }
+
+    printf("%d cells, best of %d runs, on a CPU at the %s level\n", ncells, runs, cpu_level_name(cpu_level()));
+    srand(1);
+
+    for (int i = 0; i < ngeometries; i++) {
+        const struct geometry *g = &geometries[i];
+        struct template_bank *bank = template_bank_get("", charset, font, g->w, g->h);
+        int *generic_picks = xcalloc(ncells, sizeof(int)), *fixed_picks = xcalloc(ncells, sizeof(int));
+        struct match_scratch ms;
+        struct arena arena;
+        int step;
+        double generic, special;
+
+        unsigned char *cells = make_cells(bank, ncells, &step);
+        struct glyph_atlas *atlas = atlas_create(bank->templates, charset, g->w, g->h);
+        struct bit_bank *bits = bitbank_create(bank->templates, charset, g->w, g->h, 1);
+
+        arena_init(&arena);
+        match_scratch_init(&ms, atlas, &arena);
+        uint64_t *cellbits = bitbank_scratch(bits, &arena);
+
+        generic = time_atlas(atlas, &ms, atlas_match_generic, cells, ncells, step, runs, generic_picks);
+        special = time_atlas(atlas, &ms, atlas->match, cells, ncells, step, runs, fixed_picks);
+        differ += report("atlas", g, atlas->kernel, generic, special, generic_picks, fixed_picks, ncells);
+
+        generic = time_bitset(bits, cellbits, bitbank_match_generic, cells, ncells, step, runs, generic_picks);
+        special = time_bitset(bits, cellbits, bits->match, cells, ncells, step, runs, fixed_picks);
+        differ += report("bitset", g, bits->kernel, generic, special, generic_picks, fixed_picks, ncells);
+
+        arena_free(&arena);
+        atlas_destroy(atlas);
+        bitbank_destroy(bits);
+        template_bank_free(bank);
+        free(cells);
+        free(generic_picks);
+        free(fixed_picks);
+    }
+
+    free(geometries);
+    return differ > 0;
+}
@@ -0,0 +1,287 @@
+/* asciimatic-load.c
+ * Load generator for the daemon (-D): latency percentiles and throughput.
+ *
+ * Copyright (c) 2014 Nathan Taylor <nbtaylor@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Sends the same image to a daemon over and over from a number of concurrent
+ * clients, one connection per request as the protocol has it, and reports how
+ * long the requests took.  It needs nothing but libc, so it builds anywhere the
+ * daemon runs.
+ */
+
+struct load {
+    const char *socket_path;
+    char header[128];
+    size_t header_len;
+    unsigned char *image;
+    size_t image_len;
+
+    int requests;               /* in all */
+    int next;                   /* the next one to send */
+    pthread_mutex_t lock;
+
+    double *latencies;          /* of successful requests, in seconds */
+    int ok, failed, late, rejected;
+};
+
+/* How a request ended. */
+enum outcome {
+    CONVERTED,
+    LATE,           /* ERR deadline */
+    REJECTED,       /* any other ERR */
+    BROKEN          /* no status line at all */
+};
+
+static void
+die(const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    exit(1);
+}
+
+static double
+now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile of a sorted sample. */
+static double
+percentile(const double *sorted, int n, double p) {
+    int rank = (int)(p / 100.0 * n + 0.5);
+
+    if (rank < 1) {
+        rank = 1;
+    }
+    if (rank > n) {
+        rank = n;
+    }
+    return sorted[rank - 1];
+}
+
+/* Writes all of buf to fd.  A daemon that turns a request down hangs up
+ * without reading the rest, so this must fail with EPIPE rather than raise
+ * SIGPIPE.
+ */
+static int
+send_all(int fd, const void *buf, size_t len) {
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t n = send(fd, (const char *)buf + done, len - done, MSG_NOSIGNAL);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+/* Makes one request and says how it ended. */
+static enum outcome
+request(struct load *l) {
+    struct sockaddr_un addr;
+    char reply[4096];
+    ssize_t n, got = 0;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, l->socket_path, sizeof(addr.sun_path) - 1);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        return BROKEN;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return BROKEN;
+    }
+
+    /* Even if sending fails, the daemon may have said why before hanging up,
+     * so the reply is read either way.  Only the status line matters; the rest
+     * is read and thrown away.
+     */
+    if (send_all(fd, l->header, l->header_len) == 0) {
+        send_all(fd, l->image, l->image_len);
+    }
+    while ((n = read(fd, reply + (got < 64 ? got : 64), sizeof(reply) - 64)) > 0) {
+        got += n;
+    }
+    close(fd);
+
+    if (got >= 3 && memcmp(reply, "OK ", 3) == 0) {
+        return CONVERTED;
+    }
+    if (got >= 12 && memcmp(reply, "ERR deadline", 12) == 0) {
+        return LATE;
+    }
+    if (got >= 4 && memcmp(reply, "ERR ", 4) == 0) {
+        return REJECTED;
+    }
+    return BROKEN;
+}
+
+static void *
+client_main(void *arg) {
+    struct load *l = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&l->lock);
+        if (l->next == l->requests) {
+            pthread_mutex_unlock(&l->lock);
+            return NULL;
+        }
+        l->next++;
+        pthread_mutex_unlock(&l->lock);
+
+        double t0 = now();
+        enum outcome outcome = request(l);
+        double elapsed = now() - t0;
+
+        pthread_mutex_lock(&l->lock);
+        if (outcome == CONVERTED) {
+            l->latencies[l->ok++] = elapsed;
+        } else {
+            l->failed++;
+            l->late += outcome == LATE;
+            l->rejected += outcome == REJECTED;
+        }
+        pthread_mutex_unlock(&l->lock);
+    }
+}
+
+static void
+read_image(struct load *l, const char *path) {
+    struct stat st;
+    FILE *f;
+
+    if ((f = fopen(path, "rb")) == NULL || fstat(fileno(f), &st) == -1) {
+        die("Can't open %s: %s", path, strerror(errno));
+    }
+    l->image_len = st.st_size;
+    if ((l->image = malloc(l->image_len + 1)) == NULL) {
+        die("Out of memory");
+    }
+    if (fread(l->image, 1, l->image_len, f) != l->image_len) {
+        die("Can't read %s", path);
+    }
+    fclose(f);
+}
+
+static void
+usage(const char *progname) {
+    fprintf(stderr, "usage: %s [-c clients] [-n requests] [-d deadline ms] [-t t1:t2] "
+            "<socket> <image> <columns> <rows>\n", progname);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    struct load l;
+    pthread_t *clients;
+    int nclients = 4, deadline = 0, t1 = 100, t2 = 300, opt, i;
+
+    memset(&l, 0, sizeof(l));
+    l.requests = 1000;
+
+    while ((opt = getopt(argc, argv, "c:d:n:t:")) != -1) {
+        switch (opt) {
+            case 'c':
+                nclients = atoi(optarg);
+                break;
+            case 'd':
+                deadline = atoi(optarg);
+                break;
+            case 'n':
+                l.requests = atoi(optarg);
+                break;
+            case 't':
+                if (sscanf(optarg, "%d:%d", &t1, &t2) != 2) {
+                    usage(argv[0]);
+                }
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc - optind != 4 || nclients < 1 || l.requests < 1 || deadline < 0) {
+        usage(argv[0]);
+    }
+
+    l.socket_path = argv[optind];
+    read_image(&l, argv[optind + 1]);
+    l.header_len = snprintf(l.header, sizeof(l.header), "%d %d %d %d %d %zu\n",
+                            atoi(argv[optind + 2]), atoi(argv[optind + 3]), t1, t2, deadline, l.image_len);
+    l.latencies = calloc(l.requests, sizeof(double));
+    clients = calloc(nclients, sizeof(pthread_t));
+    if (l.latencies == NULL || clients == NULL) {
+        die("Out of memory");
+    }
+    pthread_mutex_init(&l.lock, NULL);
+
+    double start = now();
+    for (i = 0; i < nclients; i++) {
+        if (pthread_create(&clients[i], NULL, client_main, &l) != 0) {
+            die("Can't start client %d", i);
+        }
+    }
+    for (i = 0; i < nclients; i++) {
+        pthread_join(clients[i], NULL);
+    }
+    double elapsed = now() - start;
+
+    printf("%d requests from %d clients in %.3fs: %.1f requests/s\n",
+           l.requests, nclients, elapsed, l.ok / elapsed);
+    printf("%d failed (%d past their deadline, %d otherwise turned down)\n", l.failed, l.late, l.rejected);
+    if (l.ok > 0) {
+        qsort(l.latencies, l.ok, sizeof(double), cmp_double);
+        printf("latency p50 %.2fms, p90 %.2fms, p99 %.2fms, max %.2fms\n",
+               1e3 * percentile(l.latencies, l.ok, 50), 1e3 * percentile(l.latencies, l.ok, 90),
+               1e3 * percentile(l.latencies, l.ok, 99), 1e3 * l.latencies[l.ok - 1]);
+    }
+
+    free(l.image);
+    free(l.latencies);
+    free(clients);
+    return l.failed > 0 ? 2 : 0;
+}